@@ -16,10 +16,16 @@
 #include "queue.h"
 #include "cam_server.h"
 #include "cam_client.h"
+#include "tcp_server.h"
 #include "cam_proto.h"
+#include "metrics.h"
+#include "loopprof.h"
+#define LOG_MODULE LM_CAM_CLIENT
 #include "logprt.h"
+#include "statpage.h"
 
 #define CLIENT_MAX_BUFFER   8096
+#define CLIENT_SEND_TIMEOUT 5000    // ms queued replies may wait for the peer
 
 enum {
     RCV_HDRSIZE = 0,
@@ -33,16 +39,9 @@ enum {
     const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
     (type *)( (char *)__mptr - offsetof(type,member) );})
 
-struct cam_client_list_entry
-{
-    struct cam_client *cam_client;
-    LIST_ENTRY(cam_client_list_entry) link;
-};
-    
 struct cam_client
 {
-    struct uloop_fd sock_u_fd;
-    int sock_fd;
+    struct tcp_conn conn;               // first, tcp_server allocates the client
     struct cam_server *cam_server;
     char ibuf[CLIENT_MAX_BUFFER];
     int ibuf_count;
@@ -54,12 +53,36 @@ struct cam_client
     upgrade_t up;
     int authlevel;
 };
-void cam_client_send(struct cam_client *cam_client, void *data, long data_size, long sec, long nsec);
+
+static struct {
+    char *cmdstr;
+    int hist;
+} CamCmdHist[] = {
+    {CAM_REBOOT,        MET_LAT_REBOOT},
+    {CAM_HARDDEFAULT,   MET_LAT_HARDDEFAULT},
+    {STR_FILEDOWNLOAD,  MET_LAT_FILEDOWNLOAD},
+    {STR_DOWNDATA,      MET_LAT_DOWNDATA},
+    {STR_UPGRADE,       MET_LAT_UPGRADE},
+    {STR_UPABORT,       MET_LAT_UPABORT},
+    {STR_CAMVERSION,    MET_LAT_CAMVERSION},
+    {STR_UPSTATUS,      MET_LAT_UPSTATUS},
+    {NULL,              -1}
+};
+
+static int cam_cmd_hist(char *cmdstr)
+{
+    int i;
+
+    for( i = 0; CamCmdHist[i].cmdstr != NULL; i++){
+        if( !strcmp(cmdstr, CamCmdHist[i].cmdstr) ) break;
+    }
+    return CamCmdHist[i].hist;
+}
 
 void cam_send_packet(struct cam_client *cam_client)
 {
-    cam_client_send(cam_client,&cam_client->rcvpkt.phdr, cam_client->rcvpkt.cmdhdrsize,1,0);
-    cam_client_send(cam_client,&cam_client->rcvpkt.data, cam_client->rcvpkt.totalsize,1,0);
+    tcp_conn_send(&cam_client->conn,&cam_client->rcvpkt.phdr, cam_client->rcvpkt.cmdhdrsize);
+    tcp_conn_send(&cam_client->conn,&cam_client->rcvpkt.data, cam_client->rcvpkt.totalsize);
 
 }
 
@@ -100,6 +123,7 @@ void cam_client_set_loadversion(struct cam_client *cam_client, char *loadversion
 void cam_client_upgrade_abort(struct cam_client *cam_client)
 {
     if( cam_client->up.update != 0 ){ // UPDATE_IDLE
+        metrics_inc(MET_UPGRADE_ABORT);
         cam_client_destroy(cam_client);
     }
 }
@@ -107,24 +131,45 @@ void cam_client_upgrade_abort_all(struct cam_client *cam_client)
 {
     cam_server_upgrade_abort_all(cam_client->cam_server);
 }
+upstatus_t *cam_client_get_upstatus(struct cam_client *cam_client)
+{
+    return cam_server_get_upstatus(cam_client->cam_server);
+}
+int cam_client_run_upgrade(struct cam_client *cam_client, char *cmd)
+{
+    return cam_server_run_upgrade(cam_client->cam_server, cam_client, cmd);
+}
+void cam_client_upgrade_done(struct cam_client *cam_client, int status)
+{
+    if( status == 0 ){
+        mk_response(&cam_client->rcvpkt, STR_UPGRADE, 0);
+    } else {
+        mk_response_msg(&cam_client->rcvpkt, STR_UPGRADE, 1, "UPGRADE RUNNER ERROR");
+    }
+    cam_send_packet(cam_client);
+}
+identity_t *cam_client_get_identity(struct cam_client *cam_client){
+    return cam_server_get_identity(cam_client->cam_server);
+}
 void cam_client_get_id(struct cam_client *cam_client, char *model, char *sn, char *mac, char *submodel, char *version){
     cam_server_get_id(cam_client->cam_server,model,sn,mac,submodel,version);
 }
 
-static void cam_sock_read_cb(struct uloop_fd *u_fd)
+static void cam_client_read(struct tcp_conn *conn)
 {
-    struct cam_client *cam_client = container_of(u_fd, struct cam_client, sock_u_fd);
+    struct cam_client *cam_client = (struct cam_client *)conn;
     ssize_t count;
     char tmp[32];
     proto_t *proto;
     unsigned char checksum = 0x0;
+    unsigned long t0;
     int ret;
 
     if (cam_client->ibuf_count >= sizeof(cam_client->ibuf)) {
         cam_client->ibuf_count = 0;
     }
 
-    count = recv(u_fd->fd, &cam_client->ibuf[cam_client->ibuf_count], cam_client->rcv_left, 0);
+    count = tcp_conn_recv(conn, &cam_client->ibuf[cam_client->ibuf_count], cam_client->rcv_left);
     logprt(LOG_DEBUG,"sock_read_cb %d",count);
     if (count > 0) {
         cam_client->ibuf_count += count;
@@ -148,6 +193,13 @@ static void cam_sock_read_cb(struct uloop_fd *u_fd)
                     memset(tmp,0,sizeof(tmp));
                     strncpy(tmp,cam_client->ibuf+2,12);
                     cam_client->rcvpkt.totalsize = atoi(tmp);
+                    // the frame has to fit ibuf and the packet data
+                    if( cam_client->rcvpkt.totalsize < 0 || cam_client->rcvpkt.totalsize > (int)sizeof(cam_client->rcvpkt.data)
+                        || cam_client->rcvpkt.cmdhdrsize + 2 + cam_client->rcvpkt.totalsize > (int)sizeof(cam_client->ibuf) ){
+                        logprt(LOG_INFO,"frame too large : %d", cam_client->rcvpkt.totalsize);
+                        tcp_conn_close(conn);
+                        return;
+                    }
                     memcpy((char *)&cam_client->rcvpkt.phdr,cam_client->ibuf,cam_client->rcvpkt.cmdhdrsize+2);
                     cam_client->rcvpkt.phdr.cmdstr[cam_client->rcvpkt.cmdhdrsize - 14] = 0;
                     cam_client->rcv_state = RCV_DATA;
@@ -159,17 +211,21 @@ static void cam_sock_read_cb(struct uloop_fd *u_fd)
                 cam_client->rcv_len += count;
                 cam_client->rcv_left -= count;
                 if( cam_client->rcv_left <= 0 ){
+                    metrics_inc(MET_FRAMES_RX);
                     proto = (proto_t *)cam_client->ibuf;
                     memcpy(cam_client->rcvpkt.data,cam_client->ibuf+cam_client->rcvpkt.cmdhdrsize+2,cam_client->rcvpkt.totalsize);
                     checksum = get_checksum(cam_client->rcvpkt.data,cam_client->rcvpkt.totalsize);
                     if(checksum != proto->checksum){
                         logprt(LOG_INFO,"checksum error : %x %x", checksum, proto->checksum);
+                        metrics_inc(MET_CHECKSUM_ERR);
+                        statpage_error("%s checksum error",cam_client->rcvpkt.phdr.cmdstr);
                         cam_client->rcvpkt.error_flag = ERR_CHECKSUM;
                     } else {
                         logprt(LOG_DEBUG,"checksum ok : %x %x", checksum, proto->checksum);
                     }
 //                    printf(" err : %d,cmdstr : %s\n",cam_client->rcvpkt.error_flag,cam_client->rcvpkt.phdr.cmdstr);
                     if( cam_client->rcvpkt.error_flag == ERR_NOERROR ){
+                        t0 = metrics_now_us();
                         if(!strcmp(cam_client->rcvpkt.phdr.cmdstr, CAM_REBOOT)){
                             ret = cam_reboot(cam_client,&cam_client->rcvpkt,cam_client->rcvpkt.phdr.cmdstr);
                             cam_send_packet(cam_client);
@@ -196,8 +252,13 @@ static void cam_sock_read_cb(struct uloop_fd *u_fd)
                             // no response
                         } else if(!strcmp(cam_client->rcvpkt.phdr.cmdstr, STR_UPGRADE)){
                             ret = cam_upgrade(cam_client,&cam_client->rcvpkt,&cam_client->up,cam_client->rcvpkt.phdr.cmdstr);
-                            cam_client_set_upgrade(cam_client,UPDATE_IDLE);
-                            cam_send_packet(cam_client);
+                            if( ret == 1 ){
+                                // runner started, cam_client_upgrade_done() replies
+                                logprt(LOG_INFO,"%s upgrade started!",cam_client->up.filename);
+                            } else {
+                                cam_client_set_upgrade(cam_client,UPDATE_IDLE);
+                                cam_send_packet(cam_client);
+                            }
                             if( ret == 0 ){
                                 logprt(LOG_INFO,"%s upgrade end!",cam_client->up.filename);
                             }
@@ -212,7 +273,11 @@ static void cam_sock_read_cb(struct uloop_fd *u_fd)
                         } else if(!strcmp(cam_client->rcvpkt.phdr.cmdstr, STR_CAMVERSION)){
                             ret = cam_camversion(cam_client,&cam_client->rcvpkt,&cam_client->up,cam_client->rcvpkt.phdr.cmdstr);
                             cam_send_packet(cam_client);
-                        }                        
+                        } else if(!strcmp(cam_client->rcvpkt.phdr.cmdstr, STR_UPSTATUS)){
+                            ret = cam_upstatus(cam_client,&cam_client->rcvpkt,cam_client->rcvpkt.phdr.cmdstr);
+                            cam_send_packet(cam_client);
+                        }
+                        metrics_observe(cam_cmd_hist(cam_client->rcvpkt.phdr.cmdstr), metrics_now_us() - t0);                        
                     } else {
                         if(cam_client->rcvpkt.error_flag == ERR_CHECKSUM){
                             mk_response_msg(&cam_client->sndpkt, cam_client->sndpkt.phdr.cmdstr, cam_client->rcvpkt.error_flag, "CHECKSUM ERROR");
@@ -236,134 +301,41 @@ static void cam_sock_read_cb(struct uloop_fd *u_fd)
 
                 break;            
         }
-    } else if (count < 0) {
-        if (errno != EINTR && errno != EAGAIN) {
-            cam_client_destroy(cam_client);
-        }
-    } else {
-        cam_client_destroy(cam_client);
     }
 }
 
-void cam_client_send(struct cam_client *cam_client, void *data, long data_size, long sec, long nsec)
+static int cam_client_open(struct tcp_conn *conn)
 {
-    struct timespec now;
-    struct timespec out;
-    struct iovec iov[3];
-    struct timeval tv;
-    struct msghdr msg;
-    fd_set wfds;
-    int sent;
-    int left;
-    int ret;
-
-    sent = 0;
-    left = data_size;
+    struct cam_client *cam_client = (struct cam_client *)conn;
 
-    clock_gettime(CLOCK_MONOTONIC, &out);
-    out.tv_sec  += sec;
-    out.tv_nsec += nsec;
-    if (out.tv_nsec > 1000000000L) {
-        out.tv_sec  += 1;
-        out.tv_nsec -= 1000000000L;
-    }
-
-    while (left > 0) {
-        FD_ZERO(&wfds);
-        FD_SET(cam_client->sock_fd, &wfds);
-
-        clock_gettime(CLOCK_MONOTONIC, &now);
-
-        tv.tv_sec  = out.tv_sec  - now.tv_sec;
-        tv.tv_usec = out.tv_nsec / 1000 - now.tv_nsec / 1000;
-        if (tv.tv_usec < 0) {
-            tv.tv_sec  -= 1;
-            tv.tv_usec += 1000000;
-        }
-
-        if ((tv.tv_sec < 0) || (tv.tv_sec == 0 && tv.tv_usec <= 0)) {
-            return;
-        }
-
-        ret = select(cam_client->sock_fd + 1, NULL, &wfds, NULL, &tv);
-        if (ret < 0) {
-            if (errno == EINTR) {
-                continue;
-            } else {
-                cam_client_destroy(cam_client);
-                return;
-            }
-        } else if (ret == 0) {
-            return;
-        }
-
-        if (FD_ISSET(cam_client->sock_fd, &wfds)) {
-            if( sent < data_size ){
-                msg.msg_name = NULL;
-                msg.msg_namelen = 0;
-                msg.msg_iov = iov;
-                msg.msg_iovlen = 1;
-                msg.msg_control = NULL;
-                msg.msg_controllen = 0;
-                msg.msg_flags = 0;
-
-                iov[0].iov_base = data + sent;
-                iov[0].iov_len = data_size - sent;
-            }
-            ret = sendmsg(cam_client->sock_fd, &msg, 0);
-            if (ret < 0) {
-                if (errno == EINTR) {
-                    continue;
-                } else {
-                    cam_client_destroy(cam_client);
-                    return;
-                }
-            } else if (ret == 0) {
-                return;
-            }
-
-            sent += ret;
-            left -= ret;
-        }
-    }
- //   if( left == 0 ) cam_client_destroy(cam_client);
-}
-
-int cam_client_create(struct cam_server *cam_server, int fd)
-{
-    struct cam_client *cam_client;
-
-    cam_client = malloc(sizeof(*cam_client));
-    memset(cam_client, 0, sizeof(*cam_client));
-
-    cam_client->sock_fd = fd;
-    cam_client->cam_server = cam_server;
+    cam_client->cam_server = tcp_conn_owner(conn);
     cam_client->rcv_left = 2;
     cam_client->rcv_state = RCV_HDRSIZE;
-
-    fcntl(cam_client->sock_fd, F_SETFL, fcntl(cam_client->sock_fd, F_GETFL, 0) | O_NONBLOCK);
-
-    cam_client->sock_u_fd.cb = cam_sock_read_cb;
-    cam_client->sock_u_fd.fd = cam_client->sock_fd;
-    uloop_fd_add(&cam_client->sock_u_fd, ULOOP_READ);
-
-    cam_server_add_cam_client(cam_server, cam_client);
-    logprt(LOG_DEBUG,"cam_client create");
     return 0;
 }
 
-void cam_client_destroy(struct cam_client *cam_client)
+static void cam_client_close(struct tcp_conn *conn)
 {
-    if (cam_client->cam_server) {
-        cam_server_delete_cam_client(cam_client->cam_server, cam_client);
-    }
+    struct cam_client *cam_client = (struct cam_client *)conn;
 
-    uloop_fd_delete(&cam_client->sock_u_fd);
+    cam_server_delete_cam_client(cam_client->cam_server, cam_client);
+}
 
-    if (cam_client->sock_fd) {
-        close(cam_client->sock_fd);
-    }
-    free(cam_client);
-    logprt(LOG_DEBUG,"cam_client destroy");    
+// released once the current callback is done, see tcp_conn_close()
+void cam_client_destroy(struct cam_client *cam_client)
+{
+    tcp_conn_close(&cam_client->conn);
 }
 
+struct tcp_handler cam_client_handler = {
+    .name = "cam",
+    .conn_size = sizeof(struct cam_client),
+    .idle_ms = 0,                       // a download may pause for the flash
+    .send_ms = CLIENT_SEND_TIMEOUT,
+    .gauge = MET_CAM_CLIENTS,
+    .site_accept = LP_CAM_ACCEPT,
+    .site_read = LP_CAM_READ,
+    .open = cam_client_open,
+    .read = cam_client_read,
+    .close = cam_client_close,
+};
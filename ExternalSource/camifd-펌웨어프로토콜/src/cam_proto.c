@@ -23,8 +23,11 @@
 #include "cam_client.h"
 #include "cam_proto.h"
 
+#define LOG_MODULE LM_CAM_PROTO
 #include "logprt.h"
+#include "metrics.h"
 #include "strutil.h"
+#include "statpage.h"
 
 #define KILROGDIR       "/tmp"
 #define SYSTEMDIR       "/var"
@@ -822,12 +825,20 @@ int add_response(pkt_t *pkt, char *item)
 }
 
 int mkpkthdr(pkt_t *pkt)
+{
+    int totalsize = strlen((char *)pkt->data);
+
+    return mkpkthdr_sum(pkt, totalsize, get_checksum(pkt->data,totalsize));
+}
+
+// header for data whose size and checksum are already known
+int mkpkthdr_sum(pkt_t *pkt, int totalsize, unsigned char checksum)
 {
     pkt->cmdhdrsize = PKTHDRSIZE + strlen(pkt->phdr.cmdstr);
-    pkt->totalsize = strlen((char *)pkt->data);
+    pkt->totalsize = totalsize;
     sprintf(pkt->phdr.cmdsize,"%02d",pkt->cmdhdrsize - 2); // remove Len size
     sprintf(pkt->phdr.total_size,"%012d",pkt->totalsize);
-    pkt->phdr.checksum = get_checksum(pkt->data,pkt->totalsize);
+    pkt->phdr.checksum = checksum;
     return 0;
 }
 
@@ -882,6 +893,8 @@ int cam_filedownload(struct cam_client *cam_client, pkt_t *pkt, upgrade_t *up, c
     if( upgrade != UPDATE_IDLE){
         mk_response_msg(pkt,cmdstr,1, "IN UPDATING PROCESS");
         logprt(LOG_INFO,"%s IN UPDATING PROCESS!", up->filename);
+        metrics_inc(MET_UPGRADE_REJECT);
+        statpage_error("FILEDOWNLOAD refused, update in progress");
         return -1;
     } else {
         cam_client_set_upgrade(cam_client,UPDATE_FILESET);
@@ -902,6 +915,8 @@ int cam_filedownload(struct cam_client *cam_client, pkt_t *pkt, upgrade_t *up, c
     strcpy(up->filename, vdata[PO_FILENAME].value);
     up->filesize = atoi(vdata[PO_FILESIZE].value);
     logprt(LOG_INFO,"filename: [%s], size : [%d]",up->filename,up->filesize);
+    upstatus_start(cam_client_get_upstatus(cam_client), up->filesize);
+    metrics_inc(MET_UPGRADE_START);
 
     if( strstr(up->filename,"deb" ) != NULL ){
         up->type = UPTYP_KILROG;
@@ -969,6 +984,7 @@ int cam_downdata(struct cam_client *cam_client, pkt_t *pkt, upgrade_t *up, char
     char *p, *s;
     int size;
     int n;
+    unsigned long t0;
 
     if( up->update == UPDATE_FILESET ){
         cam_client_set_upgrade(cam_client,UPDATE_DOWNDATA);
@@ -993,6 +1009,8 @@ int cam_downdata(struct cam_client *cam_client, pkt_t *pkt, upgrade_t *up, char
         up->seq = seq;
     } else {
         logprt(LOG_INFO,"sequence error in %d, rcv %d",up->seq,seq);
+        metrics_inc(MET_SEQUENCE_ERR);
+        statpage_error("DOWNDATA sequence error in %d, rcv %d",up->seq,seq);
         mk_response_msg(pkt,cmdstr,1,"SEQUENCE NUMBER ERROR");
         return -2;
 
@@ -1002,12 +1020,17 @@ int cam_downdata(struct cam_client *cam_client, pkt_t *pkt, upgrade_t *up, char
     size = pkt->totalsize - SIZE_SEQSIZE - 1 ;
 
 
+    t0 = metrics_now_us();
     n = fwrite(p,1,size,up->fp);
+    metrics_observe(MET_LAT_STAGE_WRITE, metrics_now_us() - t0);
     if( n != size ){
+        metrics_inc(MET_WRITE_ERR);
+        statpage_error("DOWNDATA write error, %d of %d bytes",n,size);
         logprt(LOG_INFO,"size error : n : %d, size : %d, cmdhdrsize : %d",n,size,pkt->cmdhdrsize);
         mk_response_msg(pkt,cmdstr,1,"FILE WRITE ERROR");
         return -1;
     }
+    upstatus_add_bytes(cam_client_get_upstatus(cam_client), n);
     return 0;
 }
 
@@ -1018,8 +1041,11 @@ int cam_upgrade(struct cam_client *cam_client, pkt_t *pkt, upgrade_t *up, char *
     char filename[128];
     int  size;
     int  default_falg;
+    int  run = 0;
     char buf[128], buf2[128];
-    
+
+    memset(buf,0,sizeof(buf));
+
     if( up->update == UPDATE_DOWNDATA ){
         up->update = UPDATE_UPGRADE;
         cam_client_set_upgrade(cam_client,UPDATE_UPGRADE);
@@ -1074,11 +1100,11 @@ int cam_upgrade(struct cam_client *cam_client, pkt_t *pkt, upgrade_t *up, char *
         }else{
             sprintf(buf2,"/sbin/sysupgrade %s",filename);
         }
-        system(buf2);
+        run = 1;
     } else if( up->type == UPTYP_OPENWRT_R ){
         sprintf(filename,"%s/restore.tar.gz",OPENWRTDIR);
         sprintf(buf2,"/sbin/sysupgrade -r %s; sync; /sbin/reboot &",filename);
-        system(buf2);
+        run = 1;
     } else {
         sprintf(filename,"%s/%s",KILROGDIR,up->filename);
         sprintf(buf,"/usr/bin/dpkg -i %s",filename);
@@ -1092,6 +1118,17 @@ int cam_upgrade(struct cam_client *cam_client, pkt_t *pkt, upgrade_t *up, char *
     cam_client_set_loadversion(cam_client,buf);
 //    sprintf(buf,"rm -rf %s",filename);
 //    system(buf);
+
+    // sysupgrade runs in the background so UPSTATUS can follow it,
+    // the UPGRADE reply goes out when it exits
+    if( run ){
+        if( cam_client_run_upgrade(cam_client,buf2) != 0 ){
+            mk_response_msg(pkt,cmdstr,1,"UPGRADE RUNNER ERROR");
+            return -1;
+        }
+        return 1;
+    }
+
     mk_response(pkt,cmdstr,0);
     return 0;
 }
@@ -1109,57 +1146,57 @@ int cam_upabort(struct cam_client *cam_client, pkt_t *pkt, char *cmdstr)
 int cam_camversion(struct cam_client *cam_client, pkt_t *pkt, upgrade_t *up, char *mdstr)
 {
     int ret=0;
-   
-    char loadversion[128];
-    char flashversion[128];
-    char createdate[128];    
-    int  loadlen;
-    int  flashlen;
-    char line[128], *result;
-    FILE *fp;
+    identity_t *id;
+
+    // reply data comes serialized from the identity snapshot
+    id = cam_client_get_identity(cam_client);
 
     memset(pkt->data, 0, sizeof(pkt->data));    
     sprintf(pkt->phdr.cmdstr,"%s;",pkt->phdr.cmdstr);
+    pkt->error_flag = 0;
 
-    memset(loadversion,0,sizeof(loadversion));
-    memset(flashversion,0,sizeof(flashversion));    
+    memcpy(pkt->data, id->camversion, id->camversion_len);
+    mkpkthdr_sum(pkt, id->camversion_len, id->camversion_sum);
 
-    pkt->error_flag = 0;
+    return ret;
+}
 
-    cam_client_get_loadversion(cam_client,loadversion);
-
-    memset(line,0,sizeof(line));
-    fp = fopen(FLASHFILE,"r");
-    if(fp){
-        while (fgets(line, sizeof(line), fp) != NULL) {
-            if (strncmp(line, "DISTRIB_REVISION", 16) == 0) {
-                result = strtok(line, "'");
-                if (result != NULL) {
-                    result = strtok(NULL, "'");
-                    strcpy(flashversion, result);
-                }
-            }
-        }
-        fclose(fp);
-    }
+int cam_upstatus(struct cam_client *cam_client, pkt_t *pkt, char *cmdstr)
+{
+    upstatus_t *us;
+    char cmd[64];
+    char buf[64];
+    char *line;
+    int i;
 
-    loadlen = strlen(loadversion) ;
-    flashlen = strlen(flashversion);
-    loadversion[loadlen] = 0;
-    flashversion[flashlen] = 0;
+    us = cam_client_get_upstatus(cam_client);
 
-    if( strncmp(flashversion,"FLASHERASED",11) == 0){
-        add_response(pkt,RSP_FAIL);
-    } else {
-        add_response(pkt,RSP_SUCCESS);
-    }
+    strncpy(cmd,cmdstr,sizeof(cmd)-1);
+    cmd[sizeof(cmd)-1] = 0;
+    memset(pkt->data, 0, sizeof(pkt->data));
+    sprintf(pkt->phdr.cmdstr,"%s;",cmd);
+    pkt->error_flag = 0;
 
-    add_data(pkt,"LOADVERSION",loadversion);
-    add_data(pkt,"FLASHVERSION",flashversion);
+    add_response(pkt,RSP_SUCCESS);
+    add_data(pkt,"STAGE",upstatus_stage_name(us->stage));
+    sprintf(buf,"%lld",us->staged);
+    add_data(pkt,"STAGED",buf);
+    sprintf(buf,"%d",us->filesize);
+    add_data(pkt,"SIZE",buf);
+    sprintf(buf,"%ld",upstatus_rate(us));
+    add_data(pkt,"RATE",buf);
+    sprintf(buf,"%ld",upstatus_avgrate(us));
+    add_data(pkt,"AVGRATE",buf);
+    sprintf(buf,"%ld",upstatus_elapsed(us));
+    add_data(pkt,"ELAPSED",buf);
+    add_data(pkt,"RESULT",upstatus_result_name(us->result));
+    for( i = 0; (line = upstatus_get_line(us,i)) != NULL; i++){
+        sprintf(buf,"LOG%d",i + 1);
+        add_data(pkt,buf,line);
+    }
 
     mkpkthdr(pkt);
-
-    return ret;
+    return 0;
 }
 
 int cam_reboot(struct cam_client *cam_client, pkt_t *pkt, char *cmdstr)
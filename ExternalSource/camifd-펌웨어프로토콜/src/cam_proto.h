@@ -71,6 +71,7 @@ typedef struct _upgrage_t{
 #define STR_UPGRADE         "UPGRADE"
 #define STR_UPABORT         "UPABORT"
 #define STR_CAMVERSION      "CAMVERSION"
+#define STR_UPSTATUS        "UPSTATUS"
 #define CAM_SOFTDEFAULT         "SOFTDEFAULT"
 #define CAM_HARDDEFAULT         "HARDDEFAULT"
 
@@ -78,6 +79,9 @@ typedef struct _upgrage_t{
 #define UPDATE_FILESET     1
 #define UPDATE_DOWNDATA    2
 #define UPDATE_UPGRADE     3
+#define UPDATE_VERIFY      4 // runner started, image check
+#define UPDATE_FLASH       5 // runner writing flash
+#define UPDATE_REBOOT      6 // runner finished writing, rebooting
 
 #define UPTYP_NONE      0
 #define UPTYP_KILROG    1
@@ -87,6 +91,7 @@ typedef struct _upgrage_t{
 
 
 extern unsigned char get_checksum(char *buf, int size);
+extern int mkpkthdr_sum(pkt_t *pkt, int totalsize, unsigned char checksum);
 extern int mk_response(pkt_t *pkt, char *cmdstr, int error_flag);
 extern int mk_response_msg(pkt_t *pkt, char *cmdstr, int error_flag, char *msg);
 extern int cam_filedownload(struct cam_client *cam_client, pkt_t *pkt, upgrade_t *up, char *cmdstr);
@@ -94,6 +99,7 @@ extern int cam_downdata(struct cam_client *cam_client, pkt_t *pkt, upgrade_t *up
 extern int cam_upgrade(struct cam_client *cam_client, pkt_t *pkt, upgrade_t *up, char *cmdstr);
 extern int cam_upabort(struct cam_client *cam_client, pkt_t *pkt, char *cmdstr);
 extern int cam_camversion(struct cam_client *cam_client, pkt_t *pkt, upgrade_t *up, char *mdstr);
+extern int cam_upstatus(struct cam_client *cam_client, pkt_t *pkt, char *cmdstr);
 extern int cam_reboot(struct cam_client *cam_client, pkt_t *pkt, char *cmdstr);
 extern int cam_harddefault(struct cam_client *cam_client, pkt_t *pkt, char *cmdstr);
 
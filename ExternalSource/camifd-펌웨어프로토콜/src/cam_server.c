@@ -5,7 +5,9 @@
 #include <unistd.h>
 #include <signal.h>
 #include <syslog.h>
+#include <errno.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
@@ -14,8 +16,15 @@
 #include "queue.h"
 #include "cam_server.h"
 #include "cam_client.h"
+#include "tcp_server.h"
 #include "server.h"
+#include "cam_proto.h"
+#include "metrics.h"
+#include "loopprof.h"
 #include "logprt.h"
+#include "statpage.h"
+
+#define RUNNER_MAX_BUFFER   256
 
 #define offsetof(TYPE, MEMBER) ((size_t) &((TYPE *)0)->MEMBER)
 
@@ -23,26 +32,36 @@
     const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
     (type *)( (char *)__mptr - offsetof(type,member) );})
 
-struct cam_client_list_entry
-{
-    struct cam_client *cam_client;
-    LIST_ENTRY(cam_client_list_entry) link;
-};
-    
 struct cam_server
 {
-    struct uloop_fd sock_u_fd;
-    int sock_fd;
-    int cam_client_count;
-    LIST_HEAD(cam_client_list, cam_client_list_entry) cam_client_list;
-    int port;
+    struct tcp_server *tcp_server;
     int upgrade;
     char loadversion[128];
+    upstatus_t upstatus;
+    struct uloop_process runner;        // sysupgrade child
+    struct uloop_fd runner_fd;          // its stdout/stderr
+    char runner_buf[RUNNER_MAX_BUFFER];
+    int runner_len;
+    struct cam_client *runner_client;   // waits for the UPGRADE reply
     struct server *server;
 };
+
+// sysupgrade messages that move the upgrade to a later stage
+static struct {
+    char *key;
+    int stage;
+} RunnerStage[] = {
+    {"Commencing upgrade",          UPDATE_FLASH},
+    {"Performing system upgrade",   UPDATE_FLASH},
+    {"Writing",                     UPDATE_FLASH},
+    {"Upgrade completed",           UPDATE_REBOOT},
+    {"Rebooting",                   UPDATE_REBOOT},
+    {NULL,                          0}
+};
+
 int cam_server_get_port(struct cam_server *cam_server)
 {
-    return cam_server->port;
+    return tcp_server_get_port(cam_server->tcp_server);
 }
 int cam_server_get_upgrade(struct cam_server *cam_server)
 {
@@ -51,7 +70,17 @@ int cam_server_get_upgrade(struct cam_server *cam_server)
 
 void cam_server_set_upgrade(struct cam_server *cam_server, int upgrade_state)
 {
+    if( cam_server->upgrade != upgrade_state ){
+        // the flashed version may change with the stage
+        server_invalidate_identity(cam_server->server);
+    }
     cam_server->upgrade = upgrade_state;
+    upstatus_set_stage(&cam_server->upstatus, upgrade_state);
+    metrics_gauge_set(MET_UPGRADE_STAGE, upgrade_state);
+}
+upstatus_t *cam_server_get_upstatus(struct cam_server *cam_server)
+{
+    return &cam_server->upstatus;
 }
 void cam_server_get_loadversion(struct cam_server *cam_server, char *loadversion)
 {
@@ -61,69 +90,194 @@ void cam_server_get_loadversion(struct cam_server *cam_server, char *loadversion
 void cam_server_set_loadversion(struct cam_server *cam_server, char *loadversion)
 {
     strncpy(cam_server->loadversion,loadversion,127);
+    server_invalidate_identity(cam_server->server);
+}
+identity_t *cam_server_get_identity(struct cam_server *cam_server)
+{
+    return server_get_identity(cam_server->server);
 }
 void cam_server_get_id(struct cam_server *cam_server, char *model, char *sn, char *mac, char *submodel, char *version)
 {
     server_get_id(cam_server->server,model,sn,mac,submodel,version);
 }
 
+static void cam_server_abort_conn(struct tcp_conn *conn, void *arg)
+{
+    (void)arg;
+    cam_client_upgrade_abort((struct cam_client *)conn);
+}
+
 void cam_server_upgrade_abort_all(struct cam_server *cam_server)
 {
-    struct cam_client_list_entry *entry;
-    struct cam_client_list_entry *temp;
+    tcp_server_foreach(cam_server->tcp_server, cam_server_abort_conn, NULL);
+    // a running sysupgrade can't be taken back, keep new downloads out
+    if( !cam_server->runner.pending ){
+        cam_server_set_upgrade(cam_server, UPDATE_IDLE);
+    }
+}
+
+static void cam_runner_line(struct cam_server *cam_server, char *line)
+{
+    int i;
 
-    LIST_FOREACH_SAFE(entry, &cam_server->cam_client_list, link, temp) {
-        cam_client_upgrade_abort(entry->cam_client);
+    logprt(LOG_INFO,"runner : %s",line);
+    upstatus_add_line(&cam_server->upstatus, line);
+    for( i = 0; RunnerStage[i].key != NULL; i++){
+        if( strstr(line, RunnerStage[i].key) != NULL && RunnerStage[i].stage > cam_server->upgrade ){
+            cam_server_set_upgrade(cam_server, RunnerStage[i].stage);
+        }
     }
-    cam_server->upgrade = 0;
 }
 
-static void cam_sock_io_cb(struct uloop_fd *u_fd)
+static void cam_runner_close(struct cam_server *cam_server)
 {
-    struct cam_server *cam_server = container_of(u_fd, struct cam_server, sock_u_fd);
-    struct sockaddr_in cam_client_addr;
-    socklen_t cam_client_len = sizeof(cam_client_addr);
-    int cam_client_fd;
+    if( cam_server->runner_fd.fd < 0 ) return;
 
-    cam_client_fd = accept(u_fd->fd, (struct sockaddr *)&cam_client_addr, &cam_client_len);
-    cam_client_create(cam_server, cam_client_fd);
-    logprt(LOG_DEBUG,"cam_sock accept");
+    if( cam_server->runner_len > 0 ){
+        cam_server->runner_buf[cam_server->runner_len] = 0;
+        cam_runner_line(cam_server, cam_server->runner_buf);
+        cam_server->runner_len = 0;
+    }
+    uloop_fd_delete(&cam_server->runner_fd);
+    close(cam_server->runner_fd.fd);
+    cam_server->runner_fd.fd = -1;
 }
 
-void cam_server_add_cam_client(struct cam_server *cam_server, struct cam_client *cam_client)
+static int cam_runner_read(struct cam_server *cam_server)
 {
-    struct cam_client_list_entry *entry;
+    ssize_t count;
+    char *s, *e;
+
+    count = read(cam_server->runner_fd.fd, &cam_server->runner_buf[cam_server->runner_len],
+                 sizeof(cam_server->runner_buf) - cam_server->runner_len - 1);
+    if (count > 0) {
+        cam_server->runner_len += count;
+        cam_server->runner_buf[cam_server->runner_len] = 0;
+
+        s = cam_server->runner_buf;
+        while( (e = strpbrk(s, "\r\n")) != NULL ){
+            *e = 0;
+            if( *s ) cam_runner_line(cam_server, s);
+            s = e + 1;
+        }
+        cam_server->runner_len -= s - cam_server->runner_buf;
+        memmove(cam_server->runner_buf, s, cam_server->runner_len);
 
-    entry = malloc(sizeof(*entry));
-    entry->cam_client = cam_client;
-    LIST_INSERT_HEAD(&cam_server->cam_client_list, entry, link);
-    cam_server->cam_client_count++;
+        // no newline in a full buffer, pass it on as one line
+        if( cam_server->runner_len >= (int)sizeof(cam_server->runner_buf) - 1 ){
+            cam_server->runner_buf[cam_server->runner_len] = 0;
+            cam_runner_line(cam_server, cam_server->runner_buf);
+            cam_server->runner_len = 0;
+        }
+    } else if (count < 0) {
+        if (errno != EINTR && errno != EAGAIN) {
+            cam_runner_close(cam_server);
+        }
+    } else {
+        cam_runner_close(cam_server);
+    }
+    return count;
 }
 
-void cam_server_delete_cam_client(struct cam_server *cam_server, struct cam_client *cam_client)
+static void cam_runner_read_fd(struct uloop_fd *u_fd)
 {
-    struct cam_client_list_entry *entry;
-    struct cam_client_list_entry *temp;
+    struct cam_server *cam_server = container_of(u_fd, struct cam_server, runner_fd);
 
-    LIST_FOREACH_SAFE(entry, &cam_server->cam_client_list, link, temp) {
-        if (entry->cam_client == cam_client) {
-            LIST_REMOVE(entry, link);
-            free(entry);
-            cam_server->cam_client_count--;
+    cam_runner_read(cam_server);
+}
+LOOPPROF_FD_CB(cam_runner_read_cb, cam_runner_read_fd, LP_RUNNER_READ)
+
+static void cam_runner_exit(struct uloop_process *p, int ret)
+{
+    struct cam_server *cam_server = container_of(p, struct cam_server, runner);
+    struct cam_client *cam_client = cam_server->runner_client;
+    int status;
+
+    status = WIFEXITED(ret) ? WEXITSTATUS(ret) : -1;
+    logprt(LOG_INFO,"upgrade runner [%d] exit : %d", p->pid, status);
+
+    // pick up what is left in the pipe, a backgrounded reboot may still hold it open
+    if( cam_server->runner_fd.fd >= 0 ){
+        while( cam_runner_read(cam_server) > 0 );
+        cam_runner_close(cam_server);
+    }
+
+    cam_server->runner_client = NULL;
+    if( status == 0 ){
+        upstatus_set_result(&cam_server->upstatus, UPRESULT_OK);
+        if( cam_server->upgrade < UPDATE_REBOOT ){
+            cam_server_set_upgrade(cam_server, UPDATE_REBOOT);
         }
+    } else {
+        upstatus_set_result(&cam_server->upstatus, UPRESULT_FAIL);
+        statpage_error("upgrade runner exit %d",status);
+        cam_server_set_upgrade(cam_server, UPDATE_IDLE);
+    }
+
+    if( cam_client ){
+        cam_client_upgrade_done(cam_client, status);
     }
 }
+LOOPPROF_PROCESS_CB(cam_runner_exit_cb, cam_runner_exit, LP_RUNNER_EXIT)
 
-void cam_server_delete_cam_client_all(struct cam_server *cam_server)
+int cam_server_run_upgrade(struct cam_server *cam_server, struct cam_client *cam_client, char *cmd)
 {
-    struct cam_client_list_entry *entry;
-    struct cam_client_list_entry *temp;
+    int pfd[2];
+    pid_t pid;
+    int fd;
+
+    if( cam_server->runner.pending ){
+        logprt(LOG_INFO,"upgrade runner [%d] already running", cam_server->runner.pid);
+        return -1;
+    }
+
+    if( pipe(pfd) < 0 ){
+        logprt(LOG_ERR, "error to pipe");
+        return -1;
+    }
+
+    pid = fork();
+    if( pid < 0 ){
+        logprt(LOG_ERR, "error to fork");
+        close(pfd[0]);
+        close(pfd[1]);
+        return -1;
+    }
+
+    if( pid == 0 ){
+        dup2(pfd[1], STDOUT_FILENO);
+        dup2(pfd[1], STDERR_FILENO);
+        // don't hand our listening sockets to sysupgrade
+        for( fd = STDERR_FILENO + 1; fd < 1024; fd++) close(fd);
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
 
-    entry = LIST_FIRST(&cam_server->cam_client_list);
-    LIST_FOREACH_SAFE(entry, &cam_server->cam_client_list, link, temp) {
-        LIST_REMOVE(entry, link);
-        free(entry);
-        cam_server->cam_client_count--;
+    close(pfd[1]);
+    fcntl(pfd[0], F_SETFL, fcntl(pfd[0], F_GETFL, 0) | O_NONBLOCK);
+
+    cam_server->runner_len = 0;
+    cam_server->runner_fd.cb = cam_runner_read_cb;
+    cam_server->runner_fd.fd = pfd[0];
+    uloop_fd_add(&cam_server->runner_fd, ULOOP_READ);
+
+    cam_server->runner.cb = cam_runner_exit_cb;
+    cam_server->runner.pid = pid;
+    uloop_process_add(&cam_server->runner);
+
+    cam_server->runner_client = cam_client;
+    upstatus_set_result(&cam_server->upstatus, UPRESULT_NONE);
+    cam_server_set_upgrade(cam_server, UPDATE_VERIFY);
+
+    logprt(LOG_INFO,"upgrade runner [%d] : %s", pid, cmd);
+    return 0;
+}
+
+// the session is going away, forget it as the UPGRADE reply target
+void cam_server_delete_cam_client(struct cam_server *cam_server, struct cam_client *cam_client)
+{
+    if (cam_server->runner_client == cam_client) {
+        cam_server->runner_client = NULL;
     }
 }
 
@@ -131,8 +285,6 @@ struct cam_server *cam_server_create(struct server *server, int port)
 {
     struct sigaction sa;
     struct cam_server *cam_server;
-    struct sockaddr_in addr;
-    int v = 1;
     logprt(LOG_DEBUG,"camifd cam_server_create");
 
     memset(&sa, 0, sizeof(sa));
@@ -147,55 +299,30 @@ struct cam_server *cam_server_create(struct server *server, int port)
     memset(cam_server, 0, sizeof(*cam_server));
 
     cam_server->server = server;
-    cam_server->cam_client_count = 0;
-    cam_server->port = port;
     strncpy(cam_server->loadversion,"NONE",127);
+    cam_server->runner_fd.fd = -1;
 
-    cam_server->sock_fd = socket(PF_INET, SOCK_STREAM, 0);
-    if (cam_server->sock_fd < 0) {
-        logprt(LOG_ERR,  "error to socket");
+    cam_server->tcp_server = tcp_server_create(&cam_client_handler, port, cam_server);
+    if (cam_server->tcp_server == NULL) {
         free(cam_server);
         return NULL;
     }
-    setsockopt(cam_server->sock_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&v, sizeof(int));
-
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = INADDR_ANY;
-    if (bind(cam_server->sock_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
-        logprt(LOG_ERR,  "error to bind");
-        close(cam_server->sock_fd);
-        free(cam_server);
-        return NULL;
-    }
-
-    if (fcntl(cam_server->sock_fd, F_SETFL, fcntl(cam_server->sock_fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
-        logprt(LOG_ERR,  "error to fcntl");
-        close(cam_server->sock_fd);
-        free(cam_server);
-        return NULL;
-    }
-
-    if (listen(cam_server->sock_fd, 3) < 0) {
-        logprt(LOG_ERR,  "error to listen");
-        close(cam_server->sock_fd);
-        free(cam_server);
-        return NULL;
-    }
-
-    cam_server->sock_u_fd.cb = cam_sock_io_cb;
-    cam_server->sock_u_fd.fd = cam_server->sock_fd;
-    uloop_fd_add(&cam_server->sock_u_fd, ULOOP_READ);
 
     return cam_server;
 }
 
+int cam_server_rebind(struct cam_server *cam_server, int port)
+{
+    return tcp_server_rebind(cam_server->tcp_server, port);
+}
+
 void cam_server_destroy(struct cam_server *cam_server)
 {
-    uloop_fd_delete(&cam_server->sock_u_fd);
-    cam_server_delete_cam_client_all(cam_server);
-    close(cam_server->sock_fd);
+    if (cam_server->runner.pending) {
+        uloop_process_delete(&cam_server->runner);
+    }
+    cam_runner_close(cam_server);
+    tcp_server_destroy(cam_server->tcp_server);
     free(cam_server);
 }
 
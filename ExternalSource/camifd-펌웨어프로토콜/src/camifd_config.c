@@ -16,6 +16,7 @@
 
 #include "typedef.h"
 #include "camifd_config.h"
+#include "uci_conf.h"
 #include "logprt.h"
 
 struct CamifDB
@@ -25,14 +26,23 @@ struct CamifDB
 struct IdDB
 {
     int port;
+    int udp;    // answer queries over UDP on the same port
 };
 
 
+// only read when camifd is built with the ipinstall module
+struct Discovery
+{
+    int enabled;    // answer discovery here, the ipinstall service stays down
+};
+
 typedef struct CamifDB CamifDB_t;
 typedef struct IdDB IdDB_t;
+typedef struct Discovery Discovery_t;
 
 CamifDB_t CamifDBData;
 IdDB_t IdDBData;
+Discovery_t DiscoveryData;
 
 int cfg_camifdb_get(int type,void *data)
 {
@@ -55,6 +65,24 @@ int cfg_iddb_get(int type,void *data)
         case CFG_IDDB_PORT : 
             *(int *)data = IdDBData.port;
             break;
+        case CFG_IDDB_UDP : 
+            *(int *)data = IdDBData.udp;
+            break;
+         default : 
+            ret = -1;
+            break;
+    }
+    return ret;
+                        
+}
+
+int cfg_discovery_get(int type,void *data)
+{
+    int ret = 0;
+    switch(type){
+        case CFG_DISCOVERY_ENABLED : 
+            *(int *)data = DiscoveryData.enabled;
+            break;
          default : 
             ret = -1;
             break;
@@ -74,20 +102,62 @@ static void save_set_long(char *szConfValue, void *pObj)
     sprintf(szConfValue,"%d",*(int *)pObj);
 }
 
+// a listener port from uci, present and in 1..65535
+static SCODE conf_get_port(char *key, int *port)
+{
+    char *p, *end;
+    long v;
+
+    p = conf_get(key);
+    if( p == NULL ){
+        logprt(LOG_ERR, "%s missing", key);
+        return S_FAIL;
+    }
+    v = strtol(p, &end, 10);
+    if( end == p || *end != 0 || v < 1 || v > 65535 ){
+        logprt(LOG_ERR, "%s '%s' is not a port", key, p);
+        return S_FAIL;
+    }
+    *port = (int)v;
+    return S_OK;
+}
+
+/*
+ * Everything is read before anything is stored, so a bad file leaves the
+ * running configuration as it was and the caller can keep it.
+ */
 SCODE LoadConfig(void)
 {
-    CamifDB_t *pCamifDB = &CamifDBData;
-    IdDB_t* pIdDB = &IdDBData;
+    char key[64];
+    int cam_port, id_port;
+    char *p;
+    int i;
 
     conf_init("camifd");
-    pCamifDB->port = atoi(conf_get("camifd.camifdb.port"));
-    pIdDB->port = atoi(conf_get("camifd.iddb.port"));
+    if( conf_get_port("camifd.camifdb.port", &cam_port) != S_OK ) return S_FAIL;
+    if( conf_get_port("camifd.iddb.port", &id_port) != S_OK ) return S_FAIL;
+
+    CamifDBData.port = cam_port;
+    IdDBData.port = id_port;
+    p = conf_get("camifd.iddb.udp");
+    IdDBData.udp = (p != NULL) ? atoi(p) : 0;
+    p = conf_get("camifd.discovery.enabled");
+    DiscoveryData.enabled = (p != NULL) ? atoi(p) : 0;
+
+    // optional per module levels, e.g. option cam_proto '7' in config log 'log'
+    for( i = 0; i < LM_MODULE_MAX; i++){
+        sprintf(key,"camifd.log.%s",logprt_module_name(i));
+        p = conf_get(key);
+        if( p != NULL ) set_log_module_level(logprt_module_name(i), atoi(p));
+    }
     
     return S_OK;
 }
 
 SCODE save_camifd_conf(char *camifdb_port, char *iddb_port)
 {
+    // the uci context is shared, it may no longer hold camifd
+    conf_init("camifd");
 
     conf_set("camifd.camifdb.port", camifdb_port);
     conf_set("camifd.iddb.port", iddb_port);
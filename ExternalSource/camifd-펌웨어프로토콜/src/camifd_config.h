@@ -5,7 +5,11 @@ enum {
     CFG_CAMIFDB_PORT = 0
 };
 enum {
-    CFG_IDDB_PORT = 0
+    CFG_IDDB_PORT = 0,
+    CFG_IDDB_UDP
+};
+enum {
+    CFG_DISCOVERY_ENABLED = 0
 };
 
 
@@ -17,5 +21,6 @@ SCODE save_camifd_conf(char *, char *);
 
 int cfg_camifdb_get(int type,void *data);
 int cfg_iddb_get(int type,void *data);
+int cfg_discovery_get(int type,void *data);
 
 #endif
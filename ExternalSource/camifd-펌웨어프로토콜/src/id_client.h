@@ -1,9 +1,11 @@
 #ifndef _ID_CLIENT_H
 #define _ID_CLIENT_H
+#include "tcp_server.h"
 struct id_client;
 struct id_server;
 
-int id_client_create(struct id_server *id_server, int fd);
+extern struct tcp_handler id_client_handler;
+
 void id_client_destroy(struct id_client *id_client);
 
 #endif
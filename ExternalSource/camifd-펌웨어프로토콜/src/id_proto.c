@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "id_server.h"
+#include "id_proto.h"
+#include "strutil.h"
+#include "metrics.h"
+#include "loopprof.h"
+#define LOG_MODULE LM_ID_CLIENT
+#include "logprt.h"
+
+/*
+ * Answer one CMD=... line. *reply points at the answer, either into buf or
+ * at a reply prebuilt elsewhere, and the return value is its length.
+ * Returns -1 when the line gets no answer.
+ */
+int id_proto_reply(struct id_server *id_server, char *line, int mode, char *buf, int size, char **reply)
+{
+    char tmp[128];
+    identity_t *id;
+    char module[32], level[16];
+    unsigned long t0;
+    int len;
+
+    if( !get_str_data_n(line,"CMD",tmp,sizeof(tmp)) ) return -1;
+
+    *reply = buf;
+    if(strncmp("GETEEPROM",tmp,9) == 0 ){
+        t0 = metrics_now_us();
+        id = id_server_get_identity(id_server);
+        *reply = id->eeprom;
+        metrics_observe(MET_LAT_GETEEPROM, metrics_now_us() - t0);
+        return id->eeprom_len;
+    }
+
+    // the rest answer kilobytes, a spoofed datagram must not get them
+    if( mode == ID_PROTO_RO ) return -1;
+
+    if(strncmp("GETSTATS",tmp,8) == 0 ){
+        len = metrics_format(buf, size - 2);
+        if( len < 0 ){
+            logprt(LOG_ERR,"camifd id : stats buffer too small");
+            len = 0;
+        }
+    } else if(strncmp("GETPROF",tmp,7) == 0 ){
+        len = loopprof_format(buf, size - 2);
+        if( len < 0 ){
+            logprt(LOG_ERR,"camifd id : prof buffer too small");
+            len = 0;
+        }
+    } else if(strncmp("SETLOG",tmp,6) == 0 || strncmp("GETLOG",tmp,6) == 0 ){
+        // CMD=SETLOG;MODULE=cam_proto;LEVEL=7, both reply with the current levels
+        if( tmp[0] == 'S' && get_str_data_n(line,"MODULE",module,sizeof(module)) && get_str_data_n(line,"LEVEL",level,sizeof(level)) ){
+            if( set_log_module_level(module,atoi(level)) != 0 ){
+                logprt(LOG_INFO,"camifd id : bad log module %s level %s",module,level);
+            }
+        }
+        len = logprt_format_levels(buf, size - 2);
+        if( len < 0 ) len = 0;
+    } else {
+        return -1;
+    }
+    strcpy(buf + len, "\r\n");
+    return len + 2;
+}
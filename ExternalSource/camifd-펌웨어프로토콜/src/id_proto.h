@@ -0,0 +1,12 @@
+#ifndef _ID_PROTO_H
+#define _ID_PROTO_H
+struct id_server;
+
+#define ID_REPLY_MAX    2048
+
+#define ID_PROTO_RW     0   // TCP session, every command
+#define ID_PROTO_RO     1   // UDP query, GETEEPROM only
+
+int id_proto_reply(struct id_server *id_server, char *line, int mode, char *buf, int size, char **reply);
+
+#endif
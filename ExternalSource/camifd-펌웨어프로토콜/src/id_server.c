@@ -9,12 +9,15 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <errno.h>
 #include <libubox/uloop.h>
 
-#include "queue.h"
 #include "id_server.h"
 #include "id_client.h"
+#include "id_proto.h"
 #include "server.h"
+#include "metrics.h"
+#include "loopprof.h"
 #include "logprt.h"
 
 #define offsetof(TYPE, MEMBER) ((size_t) &((TYPE *)0)->MEMBER)
@@ -23,84 +26,102 @@
     const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
     (type *)( (char *)__mptr - offsetof(type,member) );})
 
-struct id_client_list_entry
-{
-    struct id_client *id_client;
-    LIST_ENTRY(id_client_list_entry) link;
-};
-    
 struct id_server
 {
-    struct uloop_fd sock_u_fd;
-    int sock_fd;
-    int id_client_count;
-    LIST_HEAD(id_client_list, id_client_list_entry) id_client_list;
+    struct tcp_server *tcp_server;
     int port;
+    struct uloop_fd udp_u_fd;   // optional connectionless queries
+    int udp_fd;
  
     struct server *server;
 };
 int id_server_get_port(struct id_server *id_server)
 {
-    return id_server->port;
+    return tcp_server_get_port(id_server->tcp_server);
 }
-void id_server_get_id(struct id_server *id_server, char *model, char *sn, char *mac, char *submodel, char *version)
+identity_t *id_server_get_identity(struct id_server *id_server)
 {
-    server_get_id(id_server->server,model,sn,mac,submodel,version);
+    return server_get_identity(id_server->server);
 }
-
-static void id_sock_io_cb(struct uloop_fd *u_fd)
-{
-    struct id_server *id_server = container_of(u_fd, struct id_server, sock_u_fd);
-    struct sockaddr_in id_client_addr;
-    socklen_t id_client_len = sizeof(id_client_addr);
-    int id_client_fd;
-
-    id_client_fd = accept(u_fd->fd, (struct sockaddr *)&id_client_addr, &id_client_len);
-    id_client_create(id_server, id_client_fd);
-    logprt(LOG_DEBUG,"id_sock accept");
-}
-void id_server_add_id_client(struct id_server *id_server, struct id_client *id_client)
+void id_server_get_id(struct id_server *id_server, char *model, char *sn, char *mac, char *submodel, char *version)
 {
-    struct id_client_list_entry *entry;
-
-    entry = malloc(sizeof(*entry));
-    entry->id_client = id_client;
-    LIST_INSERT_HEAD(&id_server->id_client_list, entry, link);
-    id_server->id_client_count++;
+    server_get_id(id_server->server,model,sn,mac,submodel,version);
 }
 
-void id_server_delete_id_client(struct id_server *id_server, struct id_client *id_client)
+/*
+ * One datagram holds one CMD=... line and gets one datagram back, no
+ * session is kept. Only GETEEPROM is served here, its reply is small; the
+ * kilobyte replies stay on TCP so the port can't be used for reflection.
+ */
+static void id_udp_read(struct uloop_fd *u_fd)
 {
-    struct id_client_list_entry *entry;
-    struct id_client_list_entry *temp;
-
-    LIST_FOREACH_SAFE(entry, &id_server->id_client_list, link, temp) {
-        if (entry->id_client == id_client) {
-            LIST_REMOVE(entry, link);
-            free(entry);
-            id_server->id_client_count--;
+    struct id_server *id_server = container_of(u_fd, struct id_server, udp_u_fd);
+    struct sockaddr_in from;
+    socklen_t fromlen;
+    char line[512];
+    char buf[ID_REPLY_MAX];
+    char *reply;
+    ssize_t count;
+    int len;
+    int i;
+
+    // bounded so a flood can't keep the loop here
+    for( i = 0; i < ID_UDP_BATCH; i++){
+        fromlen = sizeof(from);
+        count = recvfrom(u_fd->fd, line, sizeof(line) - 1, 0, (struct sockaddr *)&from, &fromlen);
+        if( count < 0 ){
+            if( errno != EINTR && errno != EAGAIN ) logprt(LOG_INFO,"id_udp recv error %d",errno);
+            return;
+        }
+        metrics_add(MET_BYTES_RX, count);
+        metrics_inc(MET_ID_UDP_QUERY);
+        line[count] = 0;
+        line[strcspn(line, "\r\n")] = 0;
+
+        len = id_proto_reply(id_server, line, ID_PROTO_RO, buf, sizeof(buf), &reply);
+        if( len <= 0 ) continue;
+        if( sendto(u_fd->fd, reply, len, 0, (struct sockaddr *)&from, fromlen) < 0 ){
+            logprt(LOG_DEBUG,"id_udp send error %d",errno);
         }
     }
 }
-void id_server_delete_id_client_all(struct id_server *id_server)
+LOOPPROF_FD_CB(id_udp_read_cb, id_udp_read, LP_ID_UDP)
+
+static void id_server_udp_create(struct id_server *id_server)
 {
-    struct id_client_list_entry *entry;
-    struct id_client_list_entry *temp;
-
-    entry = LIST_FIRST(&id_server->id_client_list);
-    LIST_FOREACH_SAFE(entry, &id_server->id_client_list, link, temp) {
-        LIST_REMOVE(entry, link);
-        free(entry);
-        id_server->id_client_count--;
+    struct sockaddr_in addr;
+    int v = 1;
+    int fd;
+
+    fd = socket(PF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        logprt(LOG_ERR, "error to udp socket");
+        return;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *)&v, sizeof(int));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(id_server->port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        logprt(LOG_ERR, "error to udp bind");
+        close(fd);
+        return;
     }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    id_server->udp_fd = fd;
+    id_server->udp_u_fd.cb = id_udp_read_cb;
+    id_server->udp_u_fd.fd = fd;
+    uloop_fd_add(&id_server->udp_u_fd, ULOOP_READ);
+    logprt(LOG_INFO,"id udp query on port %d",id_server->port);
 }
 
-struct id_server *id_server_create(struct server *server, int port)
+struct id_server *id_server_create(struct server *server, int port, int udp)
 {
     struct sigaction sa;
     struct id_server *id_server;
-    struct sockaddr_in addr;
-    int v = 1;
 
     logprt(LOG_DEBUG,"camifd id_server_create");
 
@@ -116,54 +137,50 @@ struct id_server *id_server_create(struct server *server, int port)
     memset(id_server, 0, sizeof(*id_server));
 
     id_server->server = server;
-    id_server->id_client_count = 0;
     id_server->port = port;
+    id_server->udp_fd = -1;
 
-    id_server->sock_fd = socket(PF_INET, SOCK_STREAM, 0);
-    if (id_server->sock_fd < 0) {
-        logprt(LOG_ERR, "error to socket");
+    id_server->tcp_server = tcp_server_create(&id_client_handler, port, id_server);
+    if (id_server->tcp_server == NULL) {
         free(id_server);
         return NULL;
     }
-    setsockopt(id_server->sock_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&v, sizeof(int));
 
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = INADDR_ANY;
-    if (bind(id_server->sock_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
-        logprt(LOG_ERR, "error to bind");
-        close(id_server->sock_fd);
-        free(id_server);
-        return NULL;
+    if( udp ){
+        id_server_udp_create(id_server);
     }
+    return id_server;
+}
 
-    if (fcntl(id_server->sock_fd, F_SETFL, fcntl(id_server->sock_fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
-        logprt(LOG_ERR, "error to fcntl");
-        close(id_server->sock_fd);
-        free(id_server);
-        return NULL;
-    }
+static void id_server_udp_close(struct id_server *id_server)
+{
+    if( id_server->udp_fd < 0 ) return;
+    uloop_fd_delete(&id_server->udp_u_fd);
+    close(id_server->udp_fd);
+    id_server->udp_fd = -1;
+}
 
-    if (listen(id_server->sock_fd, 3) < 0) {
-        logprt(LOG_ERR, "error to listen");
-        close(id_server->sock_fd);
-        free(id_server);
-        return NULL;
+// same as cam_server_rebind(), the udp listener follows the port and flag
+int id_server_rebind(struct id_server *id_server, int port, int udp)
+{
+    if( port != id_server->port ){
+        if( tcp_server_rebind(id_server->tcp_server, port) < 0 ) return -1;
+        id_server->port = port;
+        id_server_udp_close(id_server);
     }
 
-    id_server->sock_u_fd.cb = id_sock_io_cb;
-    id_server->sock_u_fd.fd = id_server->sock_fd;
-    uloop_fd_add(&id_server->sock_u_fd, ULOOP_READ);
-
-    return id_server;
+    if( !udp ){
+        id_server_udp_close(id_server);
+    } else if( id_server->udp_fd < 0 ){
+        id_server_udp_create(id_server);
+    }
+    return 0;
 }
 
 void id_server_destroy(struct id_server *id_server)
 {
-    uloop_fd_delete(&id_server->sock_u_fd);
-    id_server_delete_id_client_all(id_server);
-    close(id_server->sock_fd);
+    id_server_udp_close(id_server);
+    tcp_server_destroy(id_server->tcp_server);
     free(id_server);
 }
 
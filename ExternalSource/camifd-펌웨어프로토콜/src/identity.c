@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server.h"
+#include "cam_proto.h"
+#include "identity.h"
+
+// DISTRIB_REVISION='xxx' of FLASHFILE, empty when the file can't be read
+int identity_read_version(char *version, int size)
+{
+    char line[128], *result;
+    FILE *fp;
+
+    memset(version,0,size);
+    fp = fopen(FLASHFILE,"r");
+    if( fp == NULL ) return -1;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "DISTRIB_REVISION", 16) == 0) {
+            result = strtok(line, "'");
+            if (result != NULL) {
+                result = strtok(NULL, "'");
+                if (result != NULL) strncpy(version, result, size - 1);
+            }
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+/*
+ * Refresh the snapshot and serialize the GETEEPROM and CAMVERSION replies,
+ * so polling them costs a copy instead of a file parse.
+ */
+void identity_build(identity_t *id, char *model, char *sn, char *mac, char *loadversion)
+{
+    int n;
+
+    memset(id, 0, sizeof(*id));
+    strncpy(id->model, model, sizeof(id->model) - 1);
+    strncpy(id->sn, sn, sizeof(id->sn) - 1);
+    strncpy(id->mac, mac, sizeof(id->mac) - 1);
+    strncpy(id->loadversion, loadversion, sizeof(id->loadversion) - 1);
+    if( strlen(id->model) > 8 ){
+        strcpy(id->submodel, &id->model[9]);
+    }
+    identity_read_version(id->version, sizeof(id->version));
+
+    n = snprintf(id->eeprom, sizeof(id->eeprom), "MODEL=%s;SN=%s;MAC=%s;SUBMODEL=%s;VERSION=%s\r\n",
+        id->model, id->sn, id->mac, id->submodel, id->version);
+    id->eeprom_len = (n < (int)sizeof(id->eeprom)) ? n : (int)sizeof(id->eeprom) - 1;
+
+    n = snprintf(id->camversion, sizeof(id->camversion), "%s;LOADVERSION=%s;FLASHVERSION=%s;",
+        strncmp(id->version, "FLASHERASED", 11) == 0 ? RSP_FAIL : RSP_SUCCESS,
+        id->loadversion, id->version);
+    id->camversion_len = (n < (int)sizeof(id->camversion)) ? n : (int)sizeof(id->camversion) - 1;
+    id->camversion_sum = get_checksum(id->camversion, id->camversion_len);
+
+    id->valid = 1;
+}
+
+void identity_invalidate(identity_t *id)
+{
+    id->valid = 0;
+}
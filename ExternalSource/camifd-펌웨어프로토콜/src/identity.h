@@ -0,0 +1,23 @@
+#ifndef _IDENTITY_H
+#define _IDENTITY_H
+
+typedef struct _identity_t {
+    int valid;                  // cleared to have the next reader rebuild
+    char model[32];
+    char sn[32];
+    char mac[32];
+    char submodel[32];
+    char version[256];          // DISTRIB_REVISION of FLASHFILE
+    char loadversion[128];      // image handed to the last UPGRADE
+    char eeprom[512];           // GETEEPROM reply, \r\n terminated
+    int eeprom_len;
+    char camversion[512];       // CAMVERSION packet data
+    int camversion_len;
+    unsigned char camversion_sum;
+} identity_t;
+
+int identity_read_version(char *version, int size);
+void identity_build(identity_t *id, char *model, char *sn, char *mac, char *loadversion);
+void identity_invalidate(identity_t *id);
+
+#endif
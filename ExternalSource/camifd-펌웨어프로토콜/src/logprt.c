@@ -2,12 +2,46 @@
 #include <stdlib.h>
 #include <stdarg.h>             /* for va_arg */
 #include <string.h>
+#include <strings.h>
 #include <syslog.h>
+#include <time.h>
+#include <libubox/uloop.h>
+
 #include "logprt.h"
+#include "loopprof.h"
+
+#define LOGPRT_RING_SIZE    64  // records, power of two
+#define LOGPRT_REC_LEN      256
+#define LOGPRT_FLUSH_BATCH  16  // records written per flusher run
+
+typedef struct _logprt_rec_t {
+    int level;
+    char text[LOGPRT_REC_LEN];
+} logprt_rec_t;
 
-static int log_level = LOG_NOTICE;
 static int log_type = TYP_SYSLOG;
 int logprt_trace=0;
+int logprt_level[LM_MODULE_MAX] = { LOG_NOTICE, LOG_NOTICE, LOG_NOTICE, LOG_NOTICE };
+
+static char *ModuleName[] = {
+    "server",
+    "cam_client",
+    "cam_proto",
+    "id_client",
+    ""
+};
+
+/*
+ * Single producer (the loop) and single consumer (the flusher) ring.
+ * Head and tail are only ever advanced by their owner, so neither side
+ * takes a lock. A full ring drops the record and counts it.
+ */
+static logprt_rec_t Ring[LOGPRT_RING_SIZE];
+static unsigned int RingHead;
+static unsigned int RingTail;
+static unsigned long Dropped;
+static struct uloop_timeout Flusher;
+
 void logprt_set_trace(void)
 {
     logprt_trace = 1;
@@ -18,34 +52,148 @@ void set_log_type(int type)
 }
 void set_log_level(int level)
 {
-    log_level = level;
+    int i;
+
+    for( i = 0; i < LM_MODULE_MAX; i++){
+        logprt_level[i] = level;
+    }
 }
 
-void logprt(int level, char *format, ...)
-{                               
-  va_list  ap;
-  char buf[1024];
+int set_log_module_level(char *module, int level)
+{
+    int i;
 
+    if( level < LOG_EMERG || level > LOG_DEBUG ) return -1;
+    for( i = 0; i < LM_MODULE_MAX; i++){
+        if( strcasecmp(module, ModuleName[i]) == 0 ){
+            logprt_level[i] = level;
+            return 0;
+        }
+    }
+    return -1;
+}
 
-  /* Get the optional parameters if any */
-  va_start(ap, format);
-  vsprintf(buf,format,ap);
-  va_end(ap);
+char *logprt_module_name(int module)
+{
+    if( module < 0 || module >= LM_MODULE_MAX ) return "";
+    return ModuleName[module];
+}
+
+// module=level; list for the id port
+int logprt_format_levels(char *buf, int size)
+{
+    int len = 0;
+    int n;
+    int i;
+
+    for( i = 0; i < LM_MODULE_MAX; i++){
+        n = snprintf(buf + len, size - len, "%s=%d;", ModuleName[i], logprt_level[i]);
+        if( n < 0 || n >= size - len ) return -1;
+        len += n;
+    }
+    return len;
+}
 
+static void logprt_write(int level, char *text)
+{
   /* Send to syslog() if so configured */
   if( log_type == TYP_SYSLOG ){
-    if (level <= log_level)
-        syslog(level, "%s", buf);
-    }
+        syslog(level, "%s", text);
+  }
   /* Send to stderr if so configured */
   if( log_type == TYP_STDERR ){  
-      if (level <= log_level ) {
-        fprintf(stderr, "%s", buf);
+        fprintf(stderr, "%s", text);
         fprintf(stderr, "\n");
-      }
   }
 }
 
+// write out at most max records, returns how many are still queued
+static unsigned int logprt_drain(unsigned int max)
+{
+    unsigned int head, tail;
+    unsigned long dropped;
+    char tmp[64];
 
+    dropped = __atomic_exchange_n(&Dropped, 0, __ATOMIC_RELAXED);
+    if( dropped ){
+        snprintf(tmp, sizeof(tmp), "logprt : %lu records dropped", dropped);
+        logprt_write(LOG_WARNING, tmp);
+    }
 
+    tail = RingTail;
+    head = __atomic_load_n(&RingHead, __ATOMIC_ACQUIRE);
+    while( tail != head && max-- > 0 ){
+        logprt_write(Ring[tail % LOGPRT_RING_SIZE].level, Ring[tail % LOGPRT_RING_SIZE].text);
+        tail++;
+        __atomic_store_n(&RingTail, tail, __ATOMIC_RELEASE);
+    }
+    return head - tail;
+}
+
+void logprt_flush(void)
+{
+    while( logprt_drain(LOGPRT_RING_SIZE) > 0 );
+}
+
+// runs as a 0 ms timeout so pending socket events get a turn between batches
+static void logprt_flush_tick(struct uloop_timeout *t)
+{
+    if( logprt_drain(LOGPRT_FLUSH_BATCH) > 0 ){
+        uloop_timeout_set(t, 0);
+    }
+}
+LOOPPROF_TIMEOUT_CB(logprt_flush_cb, logprt_flush_tick, LP_LOG_FLUSH)
+
+static int logprt_ratelimit(logprt_site_t *site)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if( site->window != now.tv_sec ){
+        site->window = now.tv_sec;
+        site->count = 0;
+    }
+    if( ++site->count > LOGPRT_SITE_BURST ){
+        site->suppressed++;
+        return 1;
+    }
+    return 0;
+}
 
+void logprt_emit(logprt_site_t *site, int level, char *format, ...)
+{                               
+  va_list  ap;
+  logprt_rec_t *rec;
+  unsigned int head, tail;
+  int len;
+
+  if( logprt_ratelimit(site) ) return;
+
+  head = RingHead;
+  tail = __atomic_load_n(&RingTail, __ATOMIC_ACQUIRE);
+  if( head - tail >= LOGPRT_RING_SIZE ){
+      __atomic_fetch_add(&Dropped, 1, __ATOMIC_RELAXED);
+      return;
+  }
+  rec = &Ring[head % LOGPRT_RING_SIZE];
+  rec->level = level;
+
+  /* Get the optional parameters if any */
+  va_start(ap, format);
+  len = vsnprintf(rec->text, sizeof(rec->text), format, ap);
+  va_end(ap);
+
+  if( site->suppressed && len >= 0 && len < (int)sizeof(rec->text) ){
+      snprintf(rec->text + len, sizeof(rec->text) - len, " (%lu suppressed)", site->suppressed);
+  }
+  site->suppressed = 0;
+  __atomic_store_n(&RingHead, head + 1, __ATOMIC_RELEASE);
+
+  // errors often come right before exit(), don't leave them in the ring
+  if( level <= LOG_ERR ){
+      logprt_flush();
+  } else if( !Flusher.pending ){
+      Flusher.cb = logprt_flush_cb;
+      uloop_timeout_set(&Flusher, 0);
+  }
+}
@@ -20,16 +20,49 @@ enum {
 */
 #define LOC __FILE__,__LINE__
 
+// log modules, a source file picks its own with LOG_MODULE before including us
+enum {
+    LM_SERVER = 0,
+    LM_CAM_CLIENT,
+    LM_CAM_PROTO,
+    LM_ID_CLIENT,
+    LM_MODULE_MAX
+};
+#ifndef LOG_MODULE
+#define LOG_MODULE LM_SERVER
+#endif
+
+#define LOGPRT_SITE_BURST   20  // records per call site per second, the rest are counted
+
+typedef struct _logprt_site_t {
+    long window;                // second the burst count belongs to
+    int count;
+    unsigned long suppressed;
+} logprt_site_t;
+
 extern int logprt_trace;
+extern int logprt_level[LM_MODULE_MAX];
+
 #ifdef __DEBUG
 #define DBG(fmt, args...) if( logprt_trace ) fprintf(stderr, fmt, ## args)
 #else
 #define DBG(fmt, args...)
 #endif
 
+// the level test comes first so filtered records cost no formatting
+#define logprt(level, ...) do {                                     \
+        static logprt_site_t _logprt_site;                          \
+        if( (level) <= logprt_level[LOG_MODULE] )                   \
+            logprt_emit(&_logprt_site, (level), __VA_ARGS__);       \
+    } while(0)
+
 void set_log_type(int type);
 void set_log_level(int level);
+int set_log_module_level(char *module, int level);
+char *logprt_module_name(int module);
+int logprt_format_levels(char *buf, int size);
 void logprt_set_trace(void);
-void logprt(int level, char *format, ...);
+void logprt_emit(logprt_site_t *site, int level, char *format, ...);
+void logprt_flush(void);
 
 #endif
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "loopprof.h"
+#include "metrics.h"
+#include "logprt.h"
+
+static unsigned long Threshold;     // usec, 0 while the profiler is off
+static met_hist_t Site[LP_SITE_MAX];
+static unsigned long Slow[LP_SITE_MAX];
+
+static char *SiteName[] = {
+    "CAM_ACCEPT",
+    "CAM_READ",
+    "RUNNER_READ",
+    "RUNNER_EXIT",
+    "ID_ACCEPT",
+    "ID_READ",
+    "ID_UDP",
+    "SIGNAL",
+    "LOG_FLUSH",
+    "IDENTITY_WATCH",
+    "CONN_TIMER",
+#ifdef CAMIFD_DISCOVERY
+    "DISC_SOCK",
+    "DISC_REPLY",
+    "DISC_BEACON",
+    "DISC_UCI",
+    "DISC_NETCACHE",
+    "DISC_SAMPLER",
+    "DISC_CHILD",
+#endif
+    ""
+};
+
+void loopprof_enable(int threshold_ms)
+{
+    Threshold = threshold_ms > 0 ? (unsigned long)threshold_ms * 1000UL : 0;
+    if( Threshold ){
+        logprt(LOG_INFO,"loop profiler on, lag threshold %d ms",threshold_ms);
+    }
+}
+
+int loopprof_enabled(void)
+{
+    return Threshold != 0;
+}
+
+unsigned long loopprof_begin(void)
+{
+    if( !Threshold ) return 0;
+    return metrics_now_us();
+}
+
+void loopprof_end(int site, unsigned long t0)
+{
+    unsigned long d;
+
+    if( !Threshold || !t0 ) return;
+    if( site < 0 || site >= LP_SITE_MAX ) return;
+
+    d = metrics_now_us() - t0;
+    met_hist_observe(&Site[site], d);
+    if( d >= Threshold ){
+        Slow[site]++;
+        logprt(LOG_WARNING,"loop lag : %s took %lu us",SiteName[site],d);
+    }
+}
+
+/*
+ * ENABLED=0|1;THRESHOLD=ms;BUCKETS=...;NAME=count:sum:max:b0,...;NAME_SLOW=n;
+ * Returns the length written or -1 when buf is too small.
+ */
+int loopprof_format(char *buf, int size)
+{
+    int len;
+    int n;
+    int i;
+
+    len = snprintf(buf, size, "ENABLED=%d;THRESHOLD=%lu;", Threshold != 0, Threshold / 1000);
+    if( len < 0 || len >= size ) return -1;
+
+    n = met_bucket_format(buf + len, size - len);
+    if( n < 0 ) return -1;
+    len += n;
+
+    for( i = 0; i < LP_SITE_MAX; i++){
+        n = met_hist_format(buf + len, size - len, SiteName[i], &Site[i]);
+        if( n < 0 ) return -1;
+        len += n;
+
+        n = snprintf(buf + len, size - len, "%s_SLOW=%lu;", SiteName[i], Slow[i]);
+        if( n < 0 || n >= size - len ) return -1;
+        len += n;
+    }
+    return len;
+}
+
+// one log line per site, for SIGUSR1
+void loopprof_dump(void)
+{
+    met_hist_t *h;
+    int i;
+
+    for( i = 0; i < LP_SITE_MAX; i++){
+        h = &Site[i];
+        if( h->count == 0 ) continue;
+        logprt(LOG_INFO,"loopprof %s : count %lu avg %lu us max %lu us slow %lu",
+            SiteName[i], h->count, h->sum / h->count, h->max, Slow[i]);
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef _LOOPPROF_H
+#define _LOOPPROF_H
+
+// event loop callback sites
+enum {
+    LP_CAM_ACCEPT = 0,
+    LP_CAM_READ,
+    LP_RUNNER_READ,
+    LP_RUNNER_EXIT,
+    LP_ID_ACCEPT,
+    LP_ID_READ,
+    LP_ID_UDP,
+    LP_SIGNAL,
+    LP_LOG_FLUSH,
+    LP_IDENTITY_WATCH,
+    LP_CONN_TIMER,
+#ifdef CAMIFD_DISCOVERY
+    // ipinstall's callbacks, in ipinstall_module.h's IPINSTALL_LP_xxx order
+    LP_DISC_SOCK,
+    LP_DISC_REPLY,
+    LP_DISC_BEACON,
+    LP_DISC_UCI,
+    LP_DISC_NETCACHE,
+    LP_DISC_SAMPLER,
+    LP_DISC_CHILD,
+#endif
+    LP_SITE_MAX
+};
+
+void loopprof_enable(int threshold_ms);
+int loopprof_enabled(void);
+unsigned long loopprof_begin(void);
+void loopprof_end(int site, unsigned long t0);
+int loopprof_format(char *buf, int size);
+void loopprof_dump(void);
+
+/*
+ * Define the uloop callback 'name' as 'fn' timed against 'site'.
+ * With the profiler off this costs a flag test per dispatch. 'site' may
+ * be an expression of u_fd; it is taken before fn runs, as fn may free
+ * what u_fd belongs to.
+ */
+#define LOOPPROF_FD_CB(name, fn, site)                          \
+static void name(struct uloop_fd *u_fd, unsigned int events)  \
+{                                                               \
+    unsigned long t0 = loopprof_begin();                        \
+    int lp_site = (site);                                       \
+    (void)events;                                               \
+    fn(u_fd);                                                   \
+    loopprof_end(lp_site, t0);                                  \
+}
+
+// the same for an fn that needs the ULOOP_xxx events
+#define LOOPPROF_FD_EVENTS_CB(name, fn, site)                   \
+static void name(struct uloop_fd *u_fd, unsigned int events)  \
+{                                                               \
+    unsigned long t0 = loopprof_begin();                        \
+    int lp_site = (site);                                       \
+    fn(u_fd, events);                                           \
+    loopprof_end(lp_site, t0);                                  \
+}
+
+#define LOOPPROF_TIMEOUT_CB(name, fn, site)                     \
+static void name(struct uloop_timeout *t)                       \
+{                                                               \
+    unsigned long t0 = loopprof_begin();                        \
+    fn(t);                                                      \
+    loopprof_end(site, t0);                                     \
+}
+
+#define LOOPPROF_PROCESS_CB(name, fn, site)                     \
+static void name(struct uloop_process *p, int ret)              \
+{                                                               \
+    unsigned long t0 = loopprof_begin();                        \
+    fn(p, ret);                                                 \
+    loopprof_end(site, t0);                                     \
+}
+
+#endif
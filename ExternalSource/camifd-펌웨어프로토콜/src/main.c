@@ -12,15 +12,17 @@
 #include "typedef.h"
 #include "camifd_config.h"
 #include "logprt.h"
+#include "loopprof.h"
 
 void usage(void)
 {
     fprintf(stderr, "Usage:\n"
-        "camifd [-D] [-h] [-l loglevel] [-p pidfile] -e MACaddr -i bdid -s serialnum\n"
+        "camifd [-D] [-h] [-l loglevel] [-p pidfile] [-P lag_ms] -e MACaddr -i bdid -s serialnum\n"
         "  Options:\n"
         "    -D                 Run as Daemon\n"
         "    -p pidfile         Write PID to this file\n"
         "    -l loglevel        set loglevel\n"
+        "    -P lag_ms          profile loop callbacks, log those slower than lag_ms\n"
         "    -e MACaddr         specify the MAC address\n"
         "    -i bdid            specify the board id\n"
         "    -s serialnum       specify the serial number\n"
@@ -99,10 +101,10 @@ int main(int argc, char* argv[])
     int daemon = 0;
     int c;
     int param[16];
-    int signal_flag;
     int log_level = LOG_INFO;
+    int lag_ms = 0;
 
-    while ((c = getopt(argc, argv, "Dp:l:h:e:i:s:")) != -1) {
+    while ((c = getopt(argc, argv, "Dp:l:P:h:e:i:s:")) != -1) {
         switch (c) {
         case 'D':
             daemon = 1;
@@ -113,6 +115,9 @@ int main(int argc, char* argv[])
         case 'l':
             log_level = atoi(optarg);
             break;
+        case 'P':
+            lag_ms = atoi(optarg);
+            break;
         case 'e':
             ethaddr = strdup(optarg);
             break;
@@ -139,6 +144,8 @@ int main(int argc, char* argv[])
     openlog("[CAMIFD]", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL0);
     syslog(LOG_INFO, "Start camifd process with Pid : %d\n", getpid());
 
+    loopprof_enable(lag_ms);
+
     if (pidfile != NULL) {
         if (create_pidfile(pidfile) != 1) {
             logprt(LOG_ERR, "Generate pid file fail !!");
@@ -146,36 +153,32 @@ int main(int argc, char* argv[])
             exit(1);
         }
     }
-    while(1){
-        uloop_init();
-        if( LoadConfig() != S_OK ){
-            logprt(LOG_ERR, "LoadConfig Parsing Error!");
-            exit(1);
-
-        }
-
-        logprt(LOG_DEBUG,"camifd get config");
-        
-        if( cfg_camifdb_get(CFG_CAMIFDB_PORT,&param[0]) != 0 ) param[0] = 7061;
-        if( cfg_iddb_get(CFG_IDDB_PORT,&param[1]) != 0 ) param[1] = 7000; 
+    // SIGHUP reloads in place (server.c), the loop runs once for the process
+    uloop_init();
+    if( LoadConfig() != S_OK ){
+        logprt(LOG_ERR, "LoadConfig Parsing Error!");
+        exit(1);
 
-        logprt(LOG_DEBUG,"camifd server_create");
-        
-        server = server_create(param[0],param[1],ethaddr,bdid,sn);
-        printf("camifd server_set_initialized\n");
+    }
 
-        server_set_initialized(server);
-        printf("camifd uloop_run\n");
+    logprt(LOG_DEBUG,"camifd get config");
+    
+    if( cfg_camifdb_get(CFG_CAMIFDB_PORT,&param[0]) != 0 ) param[0] = 7061;
+    if( cfg_iddb_get(CFG_IDDB_PORT,&param[1]) != 0 ) param[1] = 7000; 
+    if( cfg_iddb_get(CFG_IDDB_UDP,&param[2]) != 0 ) param[2] = 0;
 
-        uloop_run();
-        signal_flag = server_get_flag(server);
-        sleep(1);
-        server_destroy(server);
+    logprt(LOG_DEBUG,"camifd server_create");
+    
+    server = server_create(param[0],param[1],param[2],ethaddr,bdid,sn);
+    printf("camifd server_set_initialized\n");
 
-        if(signal_flag != 1) break;
+    server_set_initialized(server);
+    printf("camifd uloop_run\n");
 
-        uloop_done();
-    }
+    uloop_run();
+    server_destroy(server);
+    logprt_flush();
+    uloop_done();
 
     if (pidfile != NULL) {
         remove_pidfile(pidfile);
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+
+// Updates are relaxed atomics on word sized values, so a reader never
+// blocks the loop and 32 bit targets don't need libatomic. Counters wrap
+// at 2^32 there, pollers are expected to work with deltas.
+#define MET_ADD(p,v)    __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define MET_SET(p,v)    __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define MET_GET(p)      __atomic_load_n((p), __ATOMIC_RELAXED)
+
+static unsigned long Counter[MET_COUNTER_MAX];
+static long Gauge[MET_GAUGE_MAX];
+static met_hist_t Hist[MET_HIST_MAX];
+
+// bucket upper bounds in usec, the last bucket takes everything above
+static const unsigned long HistBound[MET_HIST_BUCKETS - 1] = {
+    100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000
+};
+
+static char *CounterName[MET_COUNTER_MAX] = {
+    "FRAMES_RX",
+    "BYTES_RX",
+    "CHECKSUM_ERR",
+    "SEQUENCE_ERR",
+    "WRITE_ERR",
+    "SESSION_ACCEPT",
+    "SESSION_REJECT",
+    "UPGRADE_START",
+    "UPGRADE_REJECT",
+    "UPGRADE_ABORT",
+    "ID_UDP_QUERY"
+};
+
+static char *GaugeName[MET_GAUGE_MAX] = {
+    "CAM_CLIENTS",
+    "ID_CLIENTS",
+    "UPGRADE_STAGE"
+};
+
+static char *HistName[MET_HIST_MAX] = {
+    "LAT_FILEDOWNLOAD",
+    "LAT_DOWNDATA",
+    "LAT_UPGRADE",
+    "LAT_UPABORT",
+    "LAT_CAMVERSION",
+    "LAT_UPSTATUS",
+    "LAT_REBOOT",
+    "LAT_HARDDEFAULT",
+    "LAT_GETEEPROM",
+    "LAT_STAGE_WRITE"
+};
+
+void metrics_inc(int id)
+{
+    metrics_add(id, 1);
+}
+
+void metrics_add(int id, unsigned long v)
+{
+    if( id < 0 || id >= MET_COUNTER_MAX ) return;
+    MET_ADD(&Counter[id], v);
+}
+
+void metrics_gauge_set(int id, long v)
+{
+    if( id < 0 || id >= MET_GAUGE_MAX ) return;
+    MET_SET(&Gauge[id], v);
+}
+
+void metrics_gauge_add(int id, long v)
+{
+    if( id < 0 || id >= MET_GAUGE_MAX ) return;
+    MET_ADD(&Gauge[id], v);
+}
+
+void metrics_observe(int id, unsigned long usec)
+{
+    if( id < 0 || id >= MET_HIST_MAX ) return;
+    met_hist_observe(&Hist[id], usec);
+}
+
+unsigned long metrics_get(int id)
+{
+    if( id < 0 || id >= MET_COUNTER_MAX ) return 0;
+    return MET_GET(&Counter[id]);
+}
+
+long metrics_gauge_get(int id)
+{
+    if( id < 0 || id >= MET_GAUGE_MAX ) return 0;
+    return MET_GET(&Gauge[id]);
+}
+
+void met_hist_observe(met_hist_t *h, unsigned long usec)
+{
+    unsigned long max;
+    int i;
+
+    for( i = 0; i < MET_HIST_BUCKETS - 1; i++){
+        if( usec <= HistBound[i] ) break;
+    }
+    MET_ADD(&h->bucket[i], 1);
+    MET_ADD(&h->count, 1);
+    MET_ADD(&h->sum, usec);
+
+    max = MET_GET(&h->max);
+    while( usec > max && !__atomic_compare_exchange_n(&h->max, &max, usec, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) );
+}
+
+unsigned long metrics_now_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long)now.tv_sec * 1000000UL + now.tv_nsec / 1000;
+}
+
+#define MET_PRINT(...) do {                                 \
+        n = snprintf(buf + len, size - len, __VA_ARGS__);   \
+        if( n < 0 || n >= size - len ) return -1;           \
+        len += n;                                           \
+    } while(0)
+
+// BUCKETS=b0,b1,...,INF; the bounds every histogram is reported against
+int met_bucket_format(char *buf, int size)
+{
+    int len = 0;
+    int n;
+    int i;
+
+    MET_PRINT("BUCKETS=");
+    for( i = 0; i < MET_HIST_BUCKETS - 1; i++){
+        MET_PRINT("%lu,", HistBound[i]);
+    }
+    MET_PRINT("INF;");
+    return len;
+}
+
+// NAME=count:sum_us:max_us:b0,b1,...,b9;
+int met_hist_format(char *buf, int size, char *name, met_hist_t *h)
+{
+    int len = 0;
+    int n;
+    int j;
+
+    MET_PRINT("%s=%lu:%lu:%lu:", name, MET_GET(&h->count), MET_GET(&h->sum), MET_GET(&h->max));
+    for( j = 0; j < MET_HIST_BUCKETS; j++){
+        MET_PRINT(j ? ",%lu" : "%lu", MET_GET(&h->bucket[j]));
+    }
+    MET_PRINT(";");
+    return len;
+}
+
+/*
+ * KEY=VALUE; list for GETSTATS, histograms in met_hist_format() form
+ * against the bounds given in BUCKETS.
+ * Returns the length written or -1 when buf is too small.
+ */
+int metrics_format(char *buf, int size)
+{
+    int len = 0;
+    int n;
+    int i;
+
+    for( i = 0; i < MET_COUNTER_MAX; i++){
+        MET_PRINT("%s=%lu;", CounterName[i], MET_GET(&Counter[i]));
+    }
+    for( i = 0; i < MET_GAUGE_MAX; i++){
+        MET_PRINT("%s=%ld;", GaugeName[i], MET_GET(&Gauge[i]));
+    }
+
+    n = met_bucket_format(buf + len, size - len);
+    if( n < 0 ) return -1;
+    len += n;
+
+    for( i = 0; i < MET_HIST_MAX; i++){
+        n = met_hist_format(buf + len, size - len, HistName[i], &Hist[i]);
+        if( n < 0 ) return -1;
+        len += n;
+    }
+    return len;
+}
+#undef MET_PRINT
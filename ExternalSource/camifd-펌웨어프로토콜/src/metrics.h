@@ -0,0 +1,65 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+// counters, never reset while the daemon runs
+enum {
+    MET_FRAMES_RX = 0,      // complete cam packets
+    MET_BYTES_RX,           // bytes read on cam and id sockets
+    MET_CHECKSUM_ERR,
+    MET_SEQUENCE_ERR,
+    MET_WRITE_ERR,          // staging file write failures
+    MET_SESSION_ACCEPT,     // accepted connections
+    MET_SESSION_REJECT,     // failed accepts
+    MET_UPGRADE_START,      // FILEDOWNLOAD accepted
+    MET_UPGRADE_REJECT,     // FILEDOWNLOAD refused
+    MET_UPGRADE_ABORT,      // upgrade sessions torn down by UPABORT
+    MET_ID_UDP_QUERY,       // datagrams on the id udp port
+    MET_COUNTER_MAX
+};
+
+// gauges, current values
+enum {
+    MET_CAM_CLIENTS = 0,
+    MET_ID_CLIENTS,
+    MET_UPGRADE_STAGE,
+    MET_GAUGE_MAX
+};
+
+// latency histograms
+enum {
+    MET_LAT_FILEDOWNLOAD = 0,
+    MET_LAT_DOWNDATA,
+    MET_LAT_UPGRADE,
+    MET_LAT_UPABORT,
+    MET_LAT_CAMVERSION,
+    MET_LAT_UPSTATUS,
+    MET_LAT_REBOOT,
+    MET_LAT_HARDDEFAULT,
+    MET_LAT_GETEEPROM,
+    MET_LAT_STAGE_WRITE,    // fwrite of one DOWNDATA chunk
+    MET_HIST_MAX
+};
+
+#define MET_HIST_BUCKETS    10
+
+typedef struct _met_hist_t {
+    unsigned long count;
+    unsigned long sum;      // usec
+    unsigned long max;      // usec
+    unsigned long bucket[MET_HIST_BUCKETS];
+} met_hist_t;
+
+void metrics_inc(int id);
+void metrics_add(int id, unsigned long v);
+void metrics_gauge_set(int id, long v);
+void metrics_gauge_add(int id, long v);
+void metrics_observe(int id, unsigned long usec);
+unsigned long metrics_get(int id);
+long metrics_gauge_get(int id);
+unsigned long metrics_now_us(void);
+int metrics_format(char *buf, int size);
+void met_hist_observe(met_hist_t *h, unsigned long usec);
+int met_hist_format(char *buf, int size, char *name, met_hist_t *h);
+int met_bucket_format(char *buf, int size);
+
+#endif
@@ -16,6 +16,8 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <sys/inotify.h>
+#include <libubox/uloop.h>
 
 #include "typedef.h"
 #include "queue.h"
@@ -24,6 +26,12 @@
 #include "server.h"
 #include "id_server.h"
 #include "cam_server.h"
+#include "sigevent.h"
+#include "loopprof.h"
+#include "statpage.h"
+#ifdef CAMIFD_DISCOVERY
+#include <ipinstall_module.h>
+#endif
 
 #define offsetof(TYPE, MEMBER) ((size_t) &((TYPE *)0)->MEMBER)
 
@@ -36,11 +44,11 @@ struct server
     struct id_server *id_server;
     struct cam_server *cam_server;    
     wtt_eeprom_t eeprom;
-    char version[256];
-    char submodel[32]; 
+    identity_t identity;
+    struct uloop_fd release_fd;     // inotify on FLASHFILE_DIR
 
-    int signal_flag;
     int initialized;
+    int discovery;                  // ipinstall responder runs on our loop
 };
 struct server *pserver;
 
@@ -60,28 +68,33 @@ static void signal_term_cb(int signo)
     exit(0);
 }
 
+/*
+ * Runs from the loop through sigevent, so uci and malloc are fine here.
+ * Only listeners whose port changed are rebound, sessions stay up.
+ */
 static void signal_hup_cb(int signo)
 {
-    int param[16];
+    int param[3];
 
-    pserver->signal_flag =0;
+    identity_invalidate(&pserver->identity);
     if( LoadConfig() != S_OK ){
-        logprt(LOG_ERR, "camifd LoadConfig Parsing Error in SigHub!");
-        syslog(LOG_ERR, "camifd LoadConfig Parsing Error!\n");
-        exit(1);
+        logprt(LOG_ERR, "camifd LoadConfig Parsing Error in SigHup, keep running config");
+        return;
     }
-        
-    if( cfg_camifdb_get(CFG_CAMIFDB_PORT,&param[0]) != 0 ) {logprt(LOG_ERR,"camifdb port get error"); exit(1);}
-    if(cfg_iddb_get(CFG_IDDB_PORT,&param[1]) != 0 ) {logprt(LOG_ERR,"iddb port get error"); exit(1);}
-
-//    if( param[0] != server->port || param[1] != server->led.port ){
-    if( param[1] != id_server_get_port(pserver->id_server)){
-        pserver->signal_flag =1;
-        uloop_done();
-    } else {
-        pserver->signal_flag =0; 
-    }
-    logprt(LOG_DEBUG,"camifd called sig hup");
+
+    if( cfg_camifdb_get(CFG_CAMIFDB_PORT,&param[0]) != 0 ) param[0] = 7061;
+    if( cfg_iddb_get(CFG_IDDB_PORT,&param[1]) != 0 ) param[1] = 7000;
+    if( cfg_iddb_get(CFG_IDDB_UDP,&param[2]) != 0 ) param[2] = 0;
+
+    if( pserver->cam_server != NULL ) cam_server_rebind(pserver->cam_server, param[0]);
+    if( pserver->id_server != NULL ) id_server_rebind(pserver->id_server, param[1], param[2]);
+    logprt(LOG_INFO,"camifd reloaded");
+}
+
+static void signal_usr1_cb(int signo)
+{
+    (void)signo;
+    loopprof_dump();
 }
 
 void server_set_initialized(struct server *server)
@@ -89,28 +102,84 @@ void server_set_initialized(struct server *server)
     server->initialized = 1;
 }
 
-int server_get_flag(struct server *server)
+identity_t *server_get_identity(struct server *server)
 {
-    return server->signal_flag;
+    char loadversion[128];
+
+    if( !server->identity.valid ){
+        memset(loadversion,0,sizeof(loadversion));
+        if( server->cam_server != NULL ) cam_server_get_loadversion(server->cam_server,loadversion);
+        if( loadversion[0] == 0 ) strcpy(loadversion,"NONE");
+        identity_build(&server->identity,server->eeprom.model,server->eeprom.sn,server->eeprom.mac,loadversion);
+        statpage_versions(server->identity.loadversion,server->identity.version);
+        logprt(LOG_DEBUG,"identity rebuilt, version [%s]",server->identity.version);
+    }
+    return &server->identity;
+}
+
+// the status page shows the versions, so rebuild now rather than on the next read
+void server_invalidate_identity(struct server *server)
+{
+    identity_invalidate(&server->identity);
+    server_get_identity(server);
 }
 
 void server_get_id(struct server *server, char *model, char *sn, char *mac, char *submodel, char *version)
 {
-    if( model != NULL) strncpy(model,server->eeprom.model,31);
-    if( sn != NULL) strncpy(sn,server->eeprom.sn,31);
-    if( mac != NULL) strncpy(mac,server->eeprom.mac,18);
-    if( submodel != NULL) strncpy(submodel,server->submodel,31);
-    if( version != NULL) strncpy(version,server->version,255);
+    identity_t *id = server_get_identity(server);
+
+    if( model != NULL) strncpy(model,id->model,31);
+    if( sn != NULL) strncpy(sn,id->sn,31);
+    if( mac != NULL) strncpy(mac,id->mac,18);
+    if( submodel != NULL) strncpy(submodel,id->submodel,31);
+    if( version != NULL) strncpy(version,id->version,255);
+}
+
+static void server_release_read(struct uloop_fd *u_fd)
+{
+    struct server *server = container_of(u_fd, struct server, release_fd);
+    char buf[1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    ssize_t count;
+    char *p;
+
+    while( (count = read(u_fd->fd, buf, sizeof(buf))) > 0 ){
+        for( p = buf; p < buf + count; p += sizeof(*ev) + ev->len ){
+            ev = (struct inotify_event *)p;
+            if( ev->len && strcmp(ev->name, FLASHFILE_NAME) == 0 ){
+                server_invalidate_identity(server);
+            }
+        }
+    }
+}
+LOOPPROF_FD_CB(server_release_read_cb, server_release_read, LP_IDENTITY_WATCH)
+
+// watch the directory, the release file is replaced rather than rewritten
+static void server_watch_release(struct server *server)
+{
+    int fd;
+
+    server->release_fd.fd = -1;
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if( fd < 0 ){
+        logprt(LOG_INFO, "error to inotify_init, identity refreshed on SIGHUP only");
+        return;
+    }
+    if( inotify_add_watch(fd, FLASHFILE_DIR, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE) < 0 ){
+        logprt(LOG_INFO, "error to watch %s", FLASHFILE_DIR);
+        close(fd);
+        return;
+    }
+    server->release_fd.cb = server_release_read_cb;
+    server->release_fd.fd = fd;
+    uloop_fd_add(&server->release_fd, ULOOP_READ);
 }
 
-struct server *server_create(int cam_port, int id_port, char *ethaddr, char *bdid, char *sn)
+struct server *server_create(int cam_port, int id_port, int id_udp, char *ethaddr, char *bdid, char *sn)
 {
-    struct sigaction s1, s2, s3, sa;
+    struct sigaction s1, s2, sa;
     struct server *server;
     char *p;
-    char line[128], *result;
-    FILE *fp;
-    char version[128];
 
     memset(&sa, 0, sizeof(sa));
     sa.sa_handler = SIG_IGN;
@@ -131,33 +200,29 @@ struct server *server_create(int cam_port, int id_port, char *ethaddr, char *bdi
     p = getenv("BDID");
     if( p == NULL ) strcpy(server->eeprom.model,bdid);
 
-    memset(version,0,sizeof(version));
-    fp = fopen(FLASHFILE,"r");
-    if(fp){    
-        while (fgets(line, sizeof(line), fp) != NULL) {
-            if (strncmp(line, "DISTRIB_REVISION", 16) == 0) {
-                result = strtok(line, "'");
-                if (result != NULL) {
-                    result = strtok(NULL, "'");
-                    strcpy(version, result);
-                }
-                
-            }
-        }
-        fclose(fp);
-    }
-//    p = version + strlen("Firmware Version:  ");
-//    strcpy(server->version,p);
-    
-    strcpy(server->version,version);
-
-    if( strlen(server->eeprom.model) > 8 ){
-        strcpy(server->submodel,&server->eeprom.model[9]);
-    }
+    statpage_open(STATPAGE_PATH);
+    server_watch_release(server);
     logprt(LOG_INFO,"BDID:[%s], SN:[%s]",server->eeprom.model,server->eeprom.sn);
 
-    server->id_server = id_server_create(server,id_port);
+    sigevent_init();
+    sigevent_add(SIGUSR1, signal_usr1_cb);
+    sigevent_add(SIGHUP, signal_hup_cb);
+
+    server->id_server = id_server_create(server,id_port,id_udp);
     server->cam_server = cam_server_create(server,cam_port);    
+    // loadversion lives in cam_server, so only now is the identity complete
+    server_get_identity(server);
+
+#ifdef CAMIFD_DISCOVERY
+    cfg_discovery_get(CFG_DISCOVERY_ENABLED,&server->discovery);
+    if( server->discovery ){
+        if( ipinstall_init(server->eeprom.model,server->eeprom.sn,LP_DISC_SOCK) < 0 ){
+            logprt(LOG_ERR,"discovery responder has no socket");
+        } else {
+            logprt(LOG_INFO,"discovery responder started");
+        }
+    }
+#endif
 
     memset(&s1, 0, sizeof(s1));
     s1.sa_handler = signal_int_cb;
@@ -173,21 +238,23 @@ struct server *server_create(int cam_port, int id_port, char *ethaddr, char *bdi
     s2.sa_handler = SIG_IGN;
     sigaction(SIGPIPE, &s2, NULL);
 
-    memset(&s3, 0, sizeof(s3));
-    s3.sa_handler = signal_hup_cb;
-    s3.sa_flags = 0;
-    sigaction(SIGHUP, &s3, NULL);
-    s3.sa_handler = SIG_IGN;
-    sigaction(SIGPIPE, &s3, NULL);
-
     return server;
 }
 
 void server_destroy(struct server *server)
 {
 
+    sigevent_done();
+    if( server->release_fd.fd >= 0 ){
+        uloop_fd_delete(&server->release_fd);
+        close(server->release_fd.fd);
+    }
     id_server_destroy(server->id_server);
     cam_server_destroy(server->cam_server);    
+#ifdef CAMIFD_DISCOVERY
+    if( server->discovery ) ipinstall_done();
+#endif
+    statpage_close();
     free(server);
     logprt(LOG_INFO,"camifd destroy done");    
 }
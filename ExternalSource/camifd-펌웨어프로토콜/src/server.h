@@ -2,6 +2,10 @@
 #define _SERVER_H
 
 #define FLASHFILE "/etc/openwrt_release"
+#define FLASHFILE_DIR   "/etc"
+#define FLASHFILE_NAME  "openwrt_release"
+
+#include "identity.h"
 
 struct server;
 
@@ -11,11 +15,12 @@ typedef struct _wtt_eeprom_t {
     char model[32];
 } wtt_eeprom_t;
 
-struct server *server_create(int cam_port, int id_port, char *, char *, char *);
+struct server *server_create(int cam_port, int id_port, int id_udp, char *, char *, char *);
 void server_destroy(struct server *server);
 
 void server_set_initialized(struct server *server);
-int server_get_flag(struct server *server);
 void server_get_id(struct server *server, char *model, char *sn, char *mac, char *submodel, char *version);
+identity_t *server_get_identity(struct server *server);
+void server_invalidate_identity(struct server *server);
 
 #endif
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <libubox/uloop.h>
+
+#include "sigevent.h"
+#include "loopprof.h"
+#include "logprt.h"
+
+#define SIGEVENT_MAX    8
+
+/*
+ * Self-pipe: the handler only writes the signal number, the work runs from
+ * the loop where logging, malloc and uci are safe to use.
+ */
+static int SigPipe[2] = {-1, -1};
+static struct uloop_fd SigFd;
+static struct {
+    int signo;
+    sigevent_cb_t cb;
+} SigEvent[SIGEVENT_MAX];
+static int SigEventCount;
+
+static void sigevent_handler(int signo)
+{
+    unsigned char c = signo;
+    int saved = errno;
+
+    if( write(SigPipe[1], &c, 1) < 0 ){
+        // pipe full, the same signal is already queued
+    }
+    errno = saved;
+}
+
+static void sigevent_read(struct uloop_fd *u_fd)
+{
+    unsigned char c[16];
+    ssize_t count;
+    int i, j;
+
+    while( (count = read(u_fd->fd, c, sizeof(c))) > 0 ){
+        for( i = 0; i < count; i++){
+            for( j = 0; j < SigEventCount; j++){
+                if( SigEvent[j].signo == c[i] ) SigEvent[j].cb(c[i]);
+            }
+        }
+    }
+}
+LOOPPROF_FD_CB(sigevent_read_cb, sigevent_read, LP_SIGNAL)
+
+int sigevent_init(void)
+{
+    if( pipe(SigPipe) < 0 ){
+        logprt(LOG_ERR, "error to pipe");
+        return -1;
+    }
+    fcntl(SigPipe[0], F_SETFL, fcntl(SigPipe[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(SigPipe[1], F_SETFL, fcntl(SigPipe[1], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(SigPipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(SigPipe[1], F_SETFD, FD_CLOEXEC);
+
+    memset(&SigFd, 0, sizeof(SigFd));
+    SigFd.cb = sigevent_read_cb;
+    SigFd.fd = SigPipe[0];
+    uloop_fd_add(&SigFd, ULOOP_READ);
+    return 0;
+}
+
+void sigevent_done(void)
+{
+    struct sigaction sa;
+    int i;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_DFL;
+    for( i = 0; i < SigEventCount; i++){
+        sigaction(SigEvent[i].signo, &sa, NULL);
+    }
+    SigEventCount = 0;
+
+    if( SigPipe[0] >= 0 ){
+        uloop_fd_delete(&SigFd);
+        close(SigPipe[0]);
+        close(SigPipe[1]);
+        SigPipe[0] = SigPipe[1] = -1;
+    }
+}
+
+int sigevent_add(int signo, sigevent_cb_t cb)
+{
+    struct sigaction sa;
+
+    if( SigEventCount >= SIGEVENT_MAX ) return -1;
+    SigEvent[SigEventCount].signo = signo;
+    SigEvent[SigEventCount].cb = cb;
+    SigEventCount++;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigevent_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    return sigaction(signo, &sa, NULL);
+}
@@ -0,0 +1,10 @@
+#ifndef _SIGEVENT_H
+#define _SIGEVENT_H
+
+typedef void (*sigevent_cb_t)(int signo);
+
+int sigevent_init(void);
+void sigevent_done(void);
+int sigevent_add(int signo, sigevent_cb_t cb);
+
+#endif
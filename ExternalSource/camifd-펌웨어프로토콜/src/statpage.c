@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "statpage.h"
+#include "metrics.h"
+#include "logprt.h"
+
+static statpage_t *Page;
+
+// every update runs between these two, readers retry while seq is odd
+static void statpage_begin(void)
+{
+    __atomic_store_n(&Page->seq, Page->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void statpage_end(void)
+{
+    __atomic_store_n(&Page->seq, Page->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void statpage_copy(char *d, char *s, int size)
+{
+    strncpy(d, s ? s : "", size - 1);
+    d[size - 1] = 0;
+}
+
+/*
+ * Map the page and start it over. The file is reused rather than
+ * replaced, so a reader that mapped it before a restart sees the new
+ * daemon without opening it again.
+ */
+int statpage_open(char *path)
+{
+    uint32_t seq;
+    void *p;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if( fd < 0 ){
+        logprt(LOG_ERR,"error to open %s",path);
+        return -1;
+    }
+    if( ftruncate(fd, sizeof(statpage_t)) < 0 ){
+        logprt(LOG_ERR,"error to size %s",path);
+        close(fd);
+        return -1;
+    }
+    p = mmap(NULL, sizeof(statpage_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if( p == MAP_FAILED ){
+        logprt(LOG_ERR,"error to map %s",path);
+        return -1;
+    }
+    Page = p;
+
+    // seq counts on from the last run, which may have died mid update
+    seq = Page->seq | 1;
+    __atomic_store_n(&Page->seq, seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memset(&Page->pid, 0, sizeof(*Page) - offsetof(statpage_t, pid));
+    Page->version = STATPAGE_VERSION;
+    Page->size = sizeof(statpage_t);
+    Page->pid = getpid();
+    __atomic_store_n(&Page->magic, STATPAGE_MAGIC, __ATOMIC_RELAXED);
+    __atomic_store_n(&Page->seq, seq + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void statpage_close(void)
+{
+    if( Page == NULL ) return;
+    statpage_begin();
+    Page->pid = 0;
+    statpage_end();
+    munmap(Page, sizeof(*Page));
+    Page = NULL;
+}
+
+void statpage_upgrade(upstatus_t *us)
+{
+    if( Page == NULL ) return;
+    statpage_begin();
+    Page->stage = us->stage;
+    Page->result = us->result;
+    Page->filesize = us->filesize;
+    Page->staged = us->staged;
+    Page->rate = us->rate;
+    statpage_end();
+}
+
+void statpage_versions(char *loadversion, char *flashversion)
+{
+    if( Page == NULL ) return;
+    statpage_begin();
+    statpage_copy(Page->loadversion, loadversion, sizeof(Page->loadversion));
+    statpage_copy(Page->flashversion, flashversion, sizeof(Page->flashversion));
+    statpage_end();
+}
+
+// session figures are kept by metrics, this only mirrors them
+void statpage_sessions(void)
+{
+    if( Page == NULL ) return;
+    statpage_begin();
+    Page->cam_clients = metrics_gauge_get(MET_CAM_CLIENTS);
+    Page->id_clients = metrics_gauge_get(MET_ID_CLIENTS);
+    Page->sessions = metrics_get(MET_SESSION_ACCEPT);
+    statpage_end();
+}
+
+void statpage_error(char *fmt, ...)
+{
+    va_list ap;
+
+    if( Page == NULL ) return;
+    statpage_begin();
+    Page->errors++;
+    Page->error_time = time(NULL);
+    va_start(ap, fmt);
+    vsnprintf(Page->error, sizeof(Page->error), fmt, ap);
+    va_end(ap);
+    statpage_end();
+}
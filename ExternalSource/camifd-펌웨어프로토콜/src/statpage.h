@@ -0,0 +1,45 @@
+#ifndef _STATPAGE_H
+#define _STATPAGE_H
+#include <stdint.h>
+
+#include "upstatus.h"
+
+#define STATPAGE_PATH       "/var/run/camifd.status"
+#define STATPAGE_MAGIC      0x54534d43  // "CMST"
+#define STATPAGE_VERSION    1
+
+/*
+ * Status record other daemons map read-only. seq is odd while camifd
+ * writes; a reader copies the record and keeps the copy only if seq read
+ * the same even value before and after. Fields only ever get appended,
+ * a reader checks size before using the ones it knows.
+ */
+typedef struct _statpage_t {
+    uint32_t magic;             // STATPAGE_MAGIC
+    uint16_t version;           // STATPAGE_VERSION
+    uint16_t size;              // sizeof(statpage_t)
+    uint32_t seq;
+    uint32_t pid;               // 0 once camifd stopped cleanly
+    uint32_t stage;             // UPDATE_xxx
+    uint32_t result;            // UPRESULT_xxx of the last runner
+    uint32_t filesize;          // declared by FILEDOWNLOAD
+    uint32_t staged;            // bytes written to the staging file
+    uint32_t rate;              // bytes/sec over the last full window
+    uint32_t cam_clients;       // sessions open now
+    uint32_t id_clients;
+    uint32_t sessions;          // accepted since start
+    uint32_t errors;            // errors since start, the last one below
+    uint32_t error_time;        // seconds since the epoch
+    char loadversion[64];       // image handed to the last UPGRADE
+    char flashversion[64];      // DISTRIB_REVISION of FLASHFILE
+    char error[96];
+} statpage_t;
+
+int statpage_open(char *path);
+void statpage_close(void);
+void statpage_upgrade(upstatus_t *us);
+void statpage_versions(char *loadversion, char *flashversion);
+void statpage_sessions(void);
+void statpage_error(char *fmt, ...);
+
+#endif
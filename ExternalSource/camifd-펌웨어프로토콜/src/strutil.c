@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+
+#include "strutil.h"
 int str_fine(char *data,char sch, int endsize)
 {
     int i;
@@ -27,3 +29,20 @@ int get_str_data(char *data_buf, char *sch_str, char *target){
     }    
     return 1;
 }
+
+// get_str_data() bounded to size, target is always terminated
+int get_str_data_n(char *data_buf, char *sch_str, char *target, int size){
+    int lensize;
+    int strindex;
+    char *str_s;
+
+    str_s = strstr(data_buf, sch_str);
+    if(str_s == NULL) return 0;
+
+    lensize = strlen(sch_str) + 1;
+    if(str_s[lensize - 1] != '=') return 0;
+    strindex = str_fine(str_s + lensize, ';', size - 1);
+    memcpy(target, str_s + lensize, strindex);
+    target[strindex] = 0;
+    return 1;
+}
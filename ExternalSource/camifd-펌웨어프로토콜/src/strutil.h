@@ -1,4 +1,5 @@
 #ifndef _STRUTIL_H
 #define _STRUTIL_H
 int get_str_data(char *data_buf, char *sch_str, char *target);
+int get_str_data_n(char *data_buf, char *sch_str, char *target, int size);
 #endif
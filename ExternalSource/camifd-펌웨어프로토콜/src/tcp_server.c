@@ -0,0 +1,442 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <libubox/uloop.h>
+
+#include "queue.h"
+#include "tcp_server.h"
+#include "metrics.h"
+#include "loopprof.h"
+#include "logprt.h"
+#include "statpage.h"
+
+#define offsetof(TYPE, MEMBER) ((size_t) &((TYPE *)0)->MEMBER)
+
+#define container_of(ptr, type, member) ({                  \
+    const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
+    (type *)( (char *)__mptr - offsetof(type,member) );})
+
+struct tcp_pool_entry
+{
+    LIST_ENTRY(tcp_pool_entry) link;
+};
+
+/*
+ * Listening socket and the sessions accepted on it. The protocol only
+ * sees its handler hooks; accept, output queueing, timeouts and session
+ * teardown are the same for every port.
+ */
+struct tcp_server
+{
+    struct uloop_fd sock_u_fd;
+    int sock_fd;
+    int port;
+    struct tcp_handler *handler;
+    void *owner;
+    int conn_count;
+    LIST_HEAD(tcp_conn_list, tcp_conn) conn_list;
+    LIST_HEAD(tcp_pool_list, tcp_pool_entry) pool;
+    int pool_count;
+};
+
+// bound, non-blocking listening socket on port, -1 on failure
+static int tcp_server_listen(int port)
+{
+    struct sockaddr_in addr;
+    int v = 1;
+    int fd;
+
+    fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        logprt(LOG_ERR, "error to socket");
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *)&v, sizeof(int));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        logprt(LOG_ERR, "error to bind");
+        close(fd);
+        return -1;
+    }
+
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+        logprt(LOG_ERR, "error to fcntl");
+        close(fd);
+        return -1;
+    }
+
+    if (listen(fd, 3) < 0) {
+        logprt(LOG_ERR, "error to listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void tcp_conn_free(struct tcp_conn *conn)
+{
+    struct tcp_server *tcp_server = conn->tcp_server;
+    struct tcp_pool_entry *entry;
+
+    if( tcp_server->handler->close ) tcp_server->handler->close(conn);
+
+    uloop_timeout_cancel(&conn->timer);
+    uloop_fd_delete(&conn->u_fd);
+    close(conn->u_fd.fd);
+    LIST_REMOVE(conn, link);
+    tcp_server->conn_count--;
+    metrics_gauge_add(tcp_server->handler->gauge, -1);
+    statpage_sessions();
+    free(conn->obuf);
+    logprt(LOG_DEBUG,"%s session closed",tcp_server->handler->name);
+
+    if( tcp_server->pool_count < TCP_POOL_MAX ){
+        entry = (struct tcp_pool_entry *)conn;
+        LIST_INSERT_HEAD(&tcp_server->pool, entry, link);
+        tcp_server->pool_count++;
+    } else {
+        free(conn);
+    }
+}
+
+// idle when nothing is queued, otherwise the peer has send_ms to read it
+static void tcp_conn_arm(struct tcp_conn *conn)
+{
+    struct tcp_handler *handler = conn->tcp_server->handler;
+
+    if( conn->dead ) return;
+    if( conn->olen > 0 ){
+        if( handler->send_ms ) uloop_timeout_set(&conn->timer, handler->send_ms);
+    } else if( handler->idle_ms ){
+        uloop_timeout_set(&conn->timer, handler->idle_ms);
+    } else {
+        uloop_timeout_cancel(&conn->timer);
+    }
+}
+
+static void tcp_conn_timer(struct uloop_timeout *t)
+{
+    struct tcp_conn *conn = container_of(t, struct tcp_conn, timer);
+
+    if( !conn->dead ){
+        logprt(LOG_INFO,"%s session %s timeout",conn->tcp_server->handler->name,conn->olen ? "send" : "idle");
+        conn->dead = 1;
+    }
+    tcp_conn_free(conn);
+}
+LOOPPROF_TIMEOUT_CB(tcp_conn_timer_cb, tcp_conn_timer, LP_CONN_TIMER)
+
+// push queued output, returns -1 once the session is dead
+static int tcp_conn_flush(struct tcp_conn *conn)
+{
+    int ret;
+
+    while( conn->olen > 0 ){
+        ret = send(conn->u_fd.fd, conn->obuf, conn->olen, MSG_NOSIGNAL);
+        if( ret < 0 ){
+            if( errno == EINTR ) continue;
+            if( errno == EAGAIN || errno == EWOULDBLOCK ) return 0;
+            tcp_conn_close(conn);
+            return -1;
+        }
+        conn->olen -= ret;
+        memmove(conn->obuf, conn->obuf + ret, conn->olen);
+    }
+    // drained, stop asking for write events
+    uloop_fd_add(&conn->u_fd, ULOOP_READ);
+    tcp_conn_arm(conn);
+    return 0;
+}
+
+// LP_xxx of the handler, the sessions of each server are timed apart
+static int tcp_conn_site(struct uloop_fd *u_fd)
+{
+    return container_of(u_fd, struct tcp_conn, u_fd)->tcp_server->handler->site_read;
+}
+
+static void tcp_conn_io(struct uloop_fd *u_fd, unsigned int events)
+{
+    struct tcp_conn *conn = container_of(u_fd, struct tcp_conn, u_fd);
+    struct tcp_handler *handler = conn->tcp_server->handler;
+
+    if( events & ULOOP_WRITE ){
+        tcp_conn_flush(conn);
+    }
+    if( !conn->dead && (events & ULOOP_READ) ){
+        if( conn->olen == 0 ) tcp_conn_arm(conn);
+        handler->read(conn);
+    }
+
+    // nothing of ours is on the stack any more
+    if( conn->dead ) tcp_conn_free(conn);
+}
+LOOPPROF_FD_EVENTS_CB(tcp_conn_io_cb, tcp_conn_io, tcp_conn_site(u_fd))
+
+static void tcp_server_accept(struct tcp_server *tcp_server, int fd)
+{
+    struct tcp_handler *handler = tcp_server->handler;
+    struct tcp_pool_entry *entry;
+    struct tcp_conn *conn;
+
+    entry = LIST_FIRST(&tcp_server->pool);
+    if( entry != NULL ){
+        LIST_REMOVE(entry, link);
+        tcp_server->pool_count--;
+        conn = (struct tcp_conn *)entry;
+    } else {
+        conn = malloc(handler->conn_size);
+        if( conn == NULL ){
+            logprt(LOG_ERR,"%s session alloc fail",handler->name);
+            close(fd);
+            return;
+        }
+    }
+    memset(conn, 0, handler->conn_size);
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    conn->tcp_server = tcp_server;
+    conn->timer.cb = tcp_conn_timer_cb;
+    conn->u_fd.cb = tcp_conn_io_cb;
+    conn->u_fd.fd = fd;
+    uloop_fd_add(&conn->u_fd, ULOOP_READ);
+    LIST_INSERT_HEAD(&tcp_server->conn_list, conn, link);
+    tcp_server->conn_count++;
+    metrics_gauge_add(handler->gauge, 1);
+    statpage_sessions();
+    tcp_conn_arm(conn);
+
+    if( handler->open && handler->open(conn) < 0 ){
+        tcp_conn_close(conn);
+    }
+    logprt(LOG_DEBUG,"%s session open",handler->name);
+}
+
+static int tcp_server_site(struct uloop_fd *u_fd)
+{
+    return container_of(u_fd, struct tcp_server, sock_u_fd)->handler->site_accept;
+}
+
+static void tcp_server_io(struct uloop_fd *u_fd)
+{
+    struct tcp_server *tcp_server = container_of(u_fd, struct tcp_server, sock_u_fd);
+    struct sockaddr_in addr;
+    socklen_t addrlen;
+    int fd;
+    int i;
+
+    for( i = 0; i < TCP_ACCEPT_BATCH; i++){
+        addrlen = sizeof(addr);
+        fd = accept(u_fd->fd, (struct sockaddr *)&addr, &addrlen);
+        if( fd < 0 ){
+            if( errno != EAGAIN && errno != EWOULDBLOCK ){
+                metrics_inc(MET_SESSION_REJECT);
+                logprt(LOG_INFO,"%s accept error",tcp_server->handler->name);
+            }
+            break;
+        }
+        metrics_inc(MET_SESSION_ACCEPT);
+        tcp_server_accept(tcp_server, fd);
+    }
+}
+LOOPPROF_FD_CB(tcp_server_io_cb, tcp_server_io, tcp_server_site(u_fd))
+
+/*
+ * Up to size bytes from the session. Returns the count, 0 when nothing
+ * is waiting, or -1 once the peer is gone (the session is then closed).
+ */
+int tcp_conn_recv(struct tcp_conn *conn, void *buf, int size)
+{
+    ssize_t count;
+
+    if( conn->dead ) return -1;
+    count = recv(conn->u_fd.fd, buf, size, 0);
+    if( count > 0 ){
+        metrics_add(MET_BYTES_RX, count);
+        return count;
+    }
+    if( count < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) ){
+        return 0;
+    }
+    tcp_conn_close(conn);
+    return -1;
+}
+
+/*
+ * Never blocks: what the socket doesn't take now is queued and written
+ * as the peer reads. Returns -1 if the session is (now) closed.
+ */
+int tcp_conn_send(struct tcp_conn *conn, void *data, int size)
+{
+    char *p;
+    int ret;
+    int cap;
+
+    if( conn->dead ) return -1;
+
+    if( conn->olen == 0 ){
+        while( size > 0 ){
+            ret = send(conn->u_fd.fd, data, size, MSG_NOSIGNAL);
+            if( ret < 0 ){
+                if( errno == EINTR ) continue;
+                if( errno == EAGAIN || errno == EWOULDBLOCK ) break;
+                tcp_conn_close(conn);
+                return -1;
+            }
+            data = (char *)data + ret;
+            size -= ret;
+        }
+        if( size == 0 ) return 0;
+    }
+
+    if( conn->olen + size > TCP_OBUF_MAX ){
+        logprt(LOG_INFO,"%s session output overflow",conn->tcp_server->handler->name);
+        tcp_conn_close(conn);
+        return -1;
+    }
+    if( conn->olen + size > conn->ocap ){
+        for( cap = conn->ocap ? conn->ocap : 1024; cap < conn->olen + size; cap *= 2 );
+        p = realloc(conn->obuf, cap);
+        if( p == NULL ){
+            tcp_conn_close(conn);
+            return -1;
+        }
+        conn->obuf = p;
+        conn->ocap = cap;
+    }
+    memcpy(conn->obuf + conn->olen, data, size);
+    if( conn->olen == 0 ){
+        uloop_fd_add(&conn->u_fd, ULOOP_READ | ULOOP_WRITE);
+        conn->olen = size;
+        tcp_conn_arm(conn);
+    } else {
+        conn->olen += size;
+    }
+    return 0;
+}
+
+/*
+ * Safe from any hook: the session stops getting events at once and its
+ * memory is released after the current callback has returned.
+ */
+void tcp_conn_close(struct tcp_conn *conn)
+{
+    if( conn->dead ) return;
+    conn->dead = 1;
+    uloop_fd_delete(&conn->u_fd);
+    uloop_timeout_set(&conn->timer, 0);
+}
+
+void *tcp_conn_owner(struct tcp_conn *conn)
+{
+    return conn->tcp_server->owner;
+}
+
+int tcp_server_get_port(struct tcp_server *tcp_server)
+{
+    return tcp_server->port;
+}
+
+void *tcp_server_get_owner(struct tcp_server *tcp_server)
+{
+    return tcp_server->owner;
+}
+
+int tcp_server_get_count(struct tcp_server *tcp_server)
+{
+    return tcp_server->conn_count;
+}
+
+// cb may close the session it is given
+void tcp_server_foreach(struct tcp_server *tcp_server, void (*cb)(struct tcp_conn *conn, void *arg), void *arg)
+{
+    struct tcp_conn *conn;
+    struct tcp_conn *temp;
+
+    LIST_FOREACH_SAFE(conn, &tcp_server->conn_list, link, temp) {
+        if( !conn->dead ) cb(conn, arg);
+    }
+}
+
+struct tcp_server *tcp_server_create(struct tcp_handler *handler, int port, void *owner)
+{
+    struct tcp_server *tcp_server;
+
+    tcp_server = malloc(sizeof(*tcp_server));
+    memset(tcp_server, 0, sizeof(*tcp_server));
+
+    tcp_server->handler = handler;
+    tcp_server->owner = owner;
+    tcp_server->port = port;
+    LIST_INIT(&tcp_server->conn_list);
+    LIST_INIT(&tcp_server->pool);
+
+    tcp_server->sock_fd = tcp_server_listen(port);
+    if (tcp_server->sock_fd < 0) {
+        free(tcp_server);
+        return NULL;
+    }
+
+    tcp_server->sock_u_fd.cb = tcp_server_io_cb;
+    tcp_server->sock_u_fd.fd = tcp_server->sock_fd;
+    uloop_fd_add(&tcp_server->sock_u_fd, ULOOP_READ);
+    logprt(LOG_DEBUG,"%s listen on %d",handler->name,port);
+
+    return tcp_server;
+}
+
+/*
+ * Move the listener to a new port. The new socket is bound before the old
+ * one goes, and accepted sessions keep their own sockets, so a running
+ * transfer is not touched. On failure the old port stays in service.
+ */
+int tcp_server_rebind(struct tcp_server *tcp_server, int port)
+{
+    int fd;
+
+    if( port == tcp_server->port ) return 0;
+
+    fd = tcp_server_listen(port);
+    if( fd < 0 ){
+        logprt(LOG_ERR,"%s port %d rebind failed, keep %d",tcp_server->handler->name,port,tcp_server->port);
+        return -1;
+    }
+    uloop_fd_delete(&tcp_server->sock_u_fd);
+    close(tcp_server->sock_fd);
+
+    tcp_server->sock_fd = fd;
+    tcp_server->sock_u_fd.fd = fd;
+    uloop_fd_add(&tcp_server->sock_u_fd, ULOOP_READ);
+    logprt(LOG_INFO,"%s port %d -> %d",tcp_server->handler->name,tcp_server->port,port);
+    tcp_server->port = port;
+    return 0;
+}
+
+void tcp_server_destroy(struct tcp_server *tcp_server)
+{
+    struct tcp_conn *conn;
+    struct tcp_conn *temp;
+    struct tcp_pool_entry *entry;
+
+    uloop_fd_delete(&tcp_server->sock_u_fd);
+    close(tcp_server->sock_fd);
+
+    LIST_FOREACH_SAFE(conn, &tcp_server->conn_list, link, temp) {
+        conn->dead = 1;
+        tcp_conn_free(conn);
+    }
+    while( (entry = LIST_FIRST(&tcp_server->pool)) != NULL ){
+        LIST_REMOVE(entry, link);
+        free(entry);
+    }
+    free(tcp_server);
+}
@@ -0,0 +1,55 @@
+#ifndef _TCP_SERVER_H
+#define _TCP_SERVER_H
+#include <libubox/uloop.h>
+#include "queue.h"
+
+#define TCP_POOL_MAX        4           // closed sessions kept for reuse
+#define TCP_OBUF_MAX        (64 * 1024) // queued output before a peer is dropped
+#define TCP_ACCEPT_BATCH    16
+
+struct tcp_server;
+
+/*
+ * One accepted session. A protocol puts this first in its own client
+ * struct, the engine allocates handler->conn_size bytes for it.
+ */
+struct tcp_conn
+{
+    struct uloop_fd u_fd;
+    struct uloop_timeout timer;     // idle, send or deferred close
+    struct tcp_server *tcp_server;
+    LIST_ENTRY(tcp_conn) link;
+    int dead;                       // closed, freed once off the stack
+    char *obuf;                     // output the socket didn't take yet
+    int olen;
+    int ocap;
+};
+
+struct tcp_handler
+{
+    char *name;
+    int conn_size;                  // protocol client struct size
+    int idle_ms;                    // 0 never drops an idle session
+    int send_ms;                    // time queued output may wait for the peer
+    int gauge;                      // MET_xxx gauge of open sessions
+    int site_accept;                // LP_xxx
+    int site_read;
+    int (*open)(struct tcp_conn *conn);     // after accept, < 0 closes
+    void (*read)(struct tcp_conn *conn);    // socket readable
+    void (*close)(struct tcp_conn *conn);   // before the memory is released
+};
+
+struct tcp_server *tcp_server_create(struct tcp_handler *handler, int port, void *owner);
+void tcp_server_destroy(struct tcp_server *tcp_server);
+int tcp_server_rebind(struct tcp_server *tcp_server, int port);
+int tcp_server_get_port(struct tcp_server *tcp_server);
+void *tcp_server_get_owner(struct tcp_server *tcp_server);
+int tcp_server_get_count(struct tcp_server *tcp_server);
+void tcp_server_foreach(struct tcp_server *tcp_server, void (*cb)(struct tcp_conn *conn, void *arg), void *arg);
+
+void *tcp_conn_owner(struct tcp_conn *conn);
+int tcp_conn_recv(struct tcp_conn *conn, void *buf, int size);
+int tcp_conn_send(struct tcp_conn *conn, void *data, int size);
+void tcp_conn_close(struct tcp_conn *conn);
+
+#endif
@@ -10,6 +10,7 @@ static struct uci_context *context = NULL;
 char *conf_get(char *key)
 {
     struct uci_ptr ptr = { 0 };
+    struct uci_element *e;
     char str[1024];
 
     sprintf(str, "%s", key);
@@ -19,6 +20,12 @@ char *conf_get(char *key)
     if (!(ptr.flags & UCI_LOOKUP_COMPLETE))
         return NULL;
 
+    // a list gives its first value, as ipinstall expects of network.lan.dns
+    if (ptr.o->type == UCI_TYPE_LIST) {
+        uci_foreach_element(&ptr.o->v.list, e)
+            return e->name;
+        return NULL;
+    }
     if (ptr.o->type != UCI_TYPE_STRING)
         return NULL;
 
@@ -68,13 +75,32 @@ int conf_save(char *name)
     return 0;
 }
 
+/* Write a loaded package back in one go, without a delta file. */
+int conf_commit(char *name)
+{
+    struct uci_package *p;
+
+    p = uci_lookup_package(context, name);
+    if (!p)
+        return -1;
+
+    if (uci_commit(context, &p, false))
+        return -1;
+    return 0;
+}
+
 int conf_init(char *name)
 {
-    context = uci_alloc_context();
+    // LoadConfig runs again on every reload. The context is kept, the
+    // ipinstall module looks its packages up in it too; conf_load
+    // replaces the package with what is on disk now.
     if (!context) {
-        return -1;
+        context = uci_alloc_context();
+        if (!context) {
+            return -1;
+        }
+        context->flags &= ~UCI_FLAG_STRICT;
     }
-    context->flags &= ~UCI_FLAG_STRICT;
 
     if (name)
         return conf_load(name);
@@ -85,5 +111,6 @@ void conf_exit(void)
 {
     if (context)
         uci_free_context(context);
+    context = NULL;
 }
 
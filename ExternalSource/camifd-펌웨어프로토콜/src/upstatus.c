@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cam_proto.h"
+#include "upstatus.h"
+#include "statpage.h"
+
+static char *StageName[] = {
+    "IDLE",         // UPDATE_IDLE
+    "FILESET",      // UPDATE_FILESET
+    "DOWNDATA",     // UPDATE_DOWNDATA
+    "UPGRADE",      // UPDATE_UPGRADE
+    "VERIFY",       // UPDATE_VERIFY
+    "FLASH",        // UPDATE_FLASH
+    "REBOOT",       // UPDATE_REBOOT
+    ""
+};
+
+static char *ResultName[] = {
+    "NONE",         // UPRESULT_NONE
+    "OK",           // UPRESULT_OK
+    "FAIL",         // UPRESULT_FAIL
+    ""
+};
+
+static long diff_ms(struct timespec *from, struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000L + (to->tv_nsec - from->tv_nsec) / 1000000L;
+}
+
+// close the rate window once it is at least UPSTATUS_RATE_WINDOW long
+static void upstatus_roll(upstatus_t *us, struct timespec *now)
+{
+    long ms;
+
+    ms = diff_ms(&us->win_start, now);
+    if( ms < UPSTATUS_RATE_WINDOW ) return;
+
+    us->rate = (long)(us->win_bytes * 1000 / ms);
+    us->win_bytes = 0;
+    us->win_start = *now;
+}
+
+void upstatus_start(upstatus_t *us, int filesize)
+{
+    memset(us, 0, sizeof(*us));
+    us->stage = UPDATE_FILESET;
+    us->filesize = filesize;
+    clock_gettime(CLOCK_MONOTONIC, &us->start);
+    us->win_start = us->start;
+    statpage_upgrade(us);
+}
+
+void upstatus_set_stage(upstatus_t *us, int stage)
+{
+    us->stage = stage;
+    statpage_upgrade(us);
+}
+
+void upstatus_set_result(upstatus_t *us, int result)
+{
+    us->result = result;
+    statpage_upgrade(us);
+}
+
+void upstatus_add_bytes(upstatus_t *us, int n)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us->staged += n;
+    us->win_bytes += n;
+    upstatus_roll(us, &now);
+    statpage_upgrade(us);
+}
+
+void upstatus_add_line(upstatus_t *us, char *line)
+{
+    char *d;
+    int i;
+
+    d = us->tail[us->tail_head];
+    // ';' and '=' are field separators in the reply, keep them out of the text
+    for( i = 0; line[i] && i < UPSTATUS_LINE_LEN - 1; i++){
+        d[i] = (line[i] == ';' || line[i] == '=') ? ',' : line[i];
+    }
+    d[i] = 0;
+
+    us->tail_head = (us->tail_head + 1) % UPSTATUS_TAIL_LINES;
+    if( us->tail_count < UPSTATUS_TAIL_LINES ) us->tail_count++;
+}
+
+// idx 0 is the oldest line still kept
+char *upstatus_get_line(upstatus_t *us, int idx)
+{
+    if( idx < 0 || idx >= us->tail_count ) return NULL;
+    return us->tail[(us->tail_head - us->tail_count + idx + UPSTATUS_TAIL_LINES) % UPSTATUS_TAIL_LINES];
+}
+
+long upstatus_elapsed(upstatus_t *us)
+{
+    struct timespec now;
+
+    if( us->start.tv_sec == 0 && us->start.tv_nsec == 0 ) return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return diff_ms(&us->start, &now);
+}
+
+long upstatus_avgrate(upstatus_t *us)
+{
+    long ms;
+
+    ms = upstatus_elapsed(us);
+    if( ms <= 0 ) return 0;
+    return (long)(us->staged * 1000 / ms);
+}
+
+long upstatus_rate(upstatus_t *us)
+{
+    struct timespec now;
+
+    // rolling here lets a stalled transfer decay to 0 instead of
+    // reporting the last good window forever
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    upstatus_roll(us, &now);
+    return us->rate;
+}
+
+char *upstatus_stage_name(int stage)
+{
+    if( stage < UPDATE_IDLE || stage > UPDATE_REBOOT ) return "UNKNOWN";
+    return StageName[stage];
+}
+
+char *upstatus_result_name(int result)
+{
+    if( result < UPRESULT_NONE || result > UPRESULT_FAIL ) return "UNKNOWN";
+    return ResultName[result];
+}
@@ -0,0 +1,39 @@
+#ifndef _UPSTATUS_H
+#define _UPSTATUS_H
+#include <time.h>
+
+#define UPSTATUS_TAIL_LINES     4
+#define UPSTATUS_LINE_LEN       96
+#define UPSTATUS_RATE_WINDOW    1000 // ms, instantaneous throughput window
+
+#define UPRESULT_NONE   0
+#define UPRESULT_OK     1
+#define UPRESULT_FAIL   2
+
+typedef struct _upstatus_t {
+    int stage;                  // UPDATE_xxx
+    long long staged;           // bytes written to the staging file
+    int filesize;               // size declared by FILEDOWNLOAD
+    struct timespec start;      // FILEDOWNLOAD accepted
+    struct timespec win_start;  // start of the current rate window
+    long long win_bytes;
+    long rate;                  // bytes/sec over the last full window
+    char tail[UPSTATUS_TAIL_LINES][UPSTATUS_LINE_LEN]; // last runner lines
+    int tail_head;
+    int tail_count;
+    int result;                 // UPRESULT_xxx of the last runner
+} upstatus_t;
+
+void upstatus_start(upstatus_t *us, int filesize);
+void upstatus_set_stage(upstatus_t *us, int stage);
+void upstatus_add_bytes(upstatus_t *us, int n);
+void upstatus_add_line(upstatus_t *us, char *line);
+void upstatus_set_result(upstatus_t *us, int result);
+long upstatus_elapsed(upstatus_t *us);
+long upstatus_avgrate(upstatus_t *us);
+long upstatus_rate(upstatus_t *us);
+char *upstatus_stage_name(int stage);
+char *upstatus_result_name(int result);
+char *upstatus_get_line(upstatus_t *us, int idx);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE        /* for recvmmsg, sendmmsg */
 #include <stdio.h>
 #include <stdlib.h>        /* for malloc, free */
 #include <stdint.h>        /* for uint32_t */
@@ -8,16 +9,32 @@
 #include <errno.h>         /* for errno, EINVAL */
 #include <asm/types.h>     /* for linux/netlink.h */
 #include <sys/ioctl.h>     /* for SIOCGIFCONF */
+#include <sys/socket.h>    /* for recvmmsg */
 #include <arpa/inet.h>     /* for inet_ntoa */
 #include <net/if.h>        /* for IFNAMSIZ, ifreq */
 #include <netinet/in.h>    /* for sockaddr */
 #include <linux/netlink.h> /* for sockaddr_nl */
+#include <linux/rtnetlink.h> /* for RTMGRP_xxx */
+#include <fcntl.h>         /* for O_NONBLOCK */
+#include <sys/inotify.h>   /* for inotify_init1 */
+#include <time.h>          /* for time */
+#include <sys/wait.h>      /* for WEXITSTATUS */
+#include <sys/mman.h>      /* for mmap */
+#include <sys/stat.h>      /* for fstat */
+#include <signal.h>        /* for kill */
+
+#include <libubox/uloop.h>
 
 #include <uci.h>
 
 #include "ipinstall.h"
 #include "network_util.h"
 #include "uci_conf.h"
+#include "netcache.h"
+#include "routing.h"
+#include "sampler.h"
+#include "ipinstall_module.h"
+#include "ipinstall_prof.h"
 
 #define _(x) x
 
@@ -48,6 +65,25 @@
 #define FLAG_WLAN 1
 #define FLAG_BROA   2
 
+#define CFG_RECV_BATCH  16  /* requests per recvmmsg, replies per sendmmsg */
+#define CFG_DELAY_MAX   8   /* jittered replies waiting at once */
+#define CFG_DUP_SLOTS   64  /* recent probes remembered, a power of two */
+#define CFG_DUP_PROBE   4   /* slots looked at per probe */
+#define CFG_DUP_WINDOW  500 /* ms, default suppression window */
+#define CFG_BEACON_SPREAD 1000  /* ms, spread of the beacon sent on a change */
+#define CFG_RELEASE_FILE "/etc/openwrt_release"
+#define CFG_CAM_RETRY   5000    /* ms between looks for camifd's status page */
+#define CFG_CAM_TRIES   4       /* copies of it tried while camifd writes */
+#define CFG_DNS_DEFAULT "168.126.63.1"  /* resolver SETCONFIG writes to network.lan */
+#define CFG_STATS_GAP   200     /* ms, at least this between GETSTATS replies */
+
+/* network.lan keys cfgSetDataAll changed */
+#define CFG_CHG_PROTO   0x01
+#define CFG_CHG_IPADDR  0x02
+#define CFG_CHG_NETMASK 0x04
+#define CFG_CHG_GATEWAY 0x08
+#define CFG_CHG_DNS     0x10
+
 //#define WLAN
 //#define IFWLAN
 
@@ -79,118 +115,432 @@ typedef struct rt_info {
     unsigned int gw;
 } rt_info_t;
 
-int sConfig = INVALID_SOCKET;
-CFG_NVRAM_STRUCT cfgNvRam, cfgNvRam_w;
+static int sConfig = INVALID_SOCKET;
+static struct uloop_fd cfgUfd;
+static struct uloop_fd uciUfd;	/* inotify on /etc/config */
+
+/* Per batch bookkeeping, one slot per request and per reply. */
+static struct mmsghdr cfgRecvMsg[CFG_RECV_BATCH];
+static struct iovec cfgRecvIov[CFG_RECV_BATCH];
+static union {
+	REMOTE_CFG_STRUCT cfg;
+	CFG_BULK_STRUCT bulk;
+} cfgRecvBuf[CFG_RECV_BATCH];
+static struct sockaddr_in cfgRecvFrom[CFG_RECV_BATCH];
+static char cfgRecvCtl[CFG_RECV_BATCH][CMSG_SPACE(sizeof(struct in_pktinfo))];
+static struct mmsghdr cfgReplyMsg[CFG_RECV_BATCH];
+static struct iovec cfgReplyIov[CFG_RECV_BATCH];
+static CFG_REPLY_V4 cfgReplyBuf[CFG_RECV_BATCH];
+static int cfgReplyLen[CFG_RECV_BATCH];
+static struct sockaddr_in cfgReplyTo[CFG_RECV_BATCH];
+static struct in_pktinfo cfgReplyPi[CFG_RECV_BATCH];	/* ifindex 0: routing table decides */
+static char cfgReplyCtl[CFG_RECV_BATCH][CMSG_SPACE(sizeof(struct in_pktinfo))];
+static int cfgReplyCount;
+
+/* GETCONFIG answer, rebuilt only when the network or the config changes */
+static REMOTE_CFG_STRUCT cfgReply;
+
+/* identity TLVs of the version 4 reply, fixed for the life of the process */
+static char cfgModel[32];
+static char cfgSerialNo[32];
+static UINT8 cfgTlv[CFG_TLV_MAX];
+static int cfgTlvLen;
+
+/* camifd status page, mapped once it exists */
+static CAM_STATUS_STRUCT *cfgCamPage;
+static UINT32 cfgCamLook;	/* cfgNowMs of the last look for it */
+
+/* GETSTATS replies, paced as a spoofed request would reflect them */
+static UINT32 cfgStatsLast;	/* cfgNowMs of the last one sent */
+static int cfgStatsSent;
+
+/* ports from uci, read once and again when their package is written */
+static char cfgWebPort[18];
+static UINT32 cfgRtspPort;
+static UINT32 cfgJpegPort;
+
+/*
+ * GETCONFIG replies held back by the requester's window. The delay comes
+ * from a hash of our MAC, so on a segment full of cameras the replies
+ * spread evenly over the window and every scan sees the same order.
+ */
+typedef struct cfg_delayed {
+	struct uloop_timeout timer;
+	int used;
+	CFG_REPLY_V4 reply;
+	int len;
+	struct sockaddr_in to;
+	struct in_pktinfo pi;
+} cfg_delayed_t;
+
+static cfg_delayed_t cfgDelayed[CFG_DELAY_MAX];
+static UINT32 cfgMacHash;	/* FNV-1a of the MAC in cfgReply */
+
+/* uci copy of the last SETCONFIG, written by a child off the loop */
+static struct uloop_process cfgSaveProc;
+static CFG_NVRAM_STRUCT cfgSavePending;
+static int cfgSaveQueued;
+
+/* netifd reload after a save that changed network.lan.proto */
+static struct uloop_process cfgReloadProc;
+static int cfgReloadQueued;
+
+/*
+ * Probes seen lately. A controller sends every probe to the subnet and the
+ * limited broadcast address, out of each of its NICs; the copies from one
+ * source inside the window get one answer. Lookups probe a few slots from
+ * the hash and replace the stalest, nothing is ever allocated.
+ */
+typedef struct cfg_dup {
+	UINT32 addr;
+	UINT16 port;
+	UINT32 msg;		/* 0 for an empty slot */
+	UINT32 nonce;
+	UINT32 seen;	/* ms */
+} cfg_dup_t;
+
+static cfg_dup_t cfgDup[CFG_DUP_SLOTS];
+static UINT32 cfgDupWindow = CFG_DUP_WINDOW;
+
+/* unsolicited GETCONFIGOK for controllers that only listen */
+static struct uloop_timeout cfgBeaconTimer;
+static UINT32 cfgBeaconPeriod;	/* s, 0 = off */
+static UINT32 cfgBeaconJitter;	/* s, up to this much is added to each period */
+static struct sockaddr_in cfgBeaconTo;
+static unsigned int cfgBeaconSeed;
+
+/* our entry of the last bulk table, applied when our slot comes */
+static struct uloop_timeout cfgBulkTimer;
+static CFG_NVRAM_STRUCT cfgBulkCfg;
+
+/* configuration generation and the settings it was taken from */
+static UINT32 cfgGeneration;
+static CFG_NVRAM_STRUCT cfgGenNvRam, cfgGenNvRam_w;
+
+static CFG_NVRAM_STRUCT cfgNvRam, cfgNvRam_w;
 
 static rt_info_t rtinfo;
-int selecteth = FLAG_ELAN;
-char GateWay[16];
-
-void show_usage(char *s)
-{
-	printf("show usage %s\n",s);
-	return;
-}
-
-void cfgSockClose(void)
+static int selecteth = FLAG_ELAN;
+static char GateWay[16];
+
+int ipiLpSite;
+
+static void cfgSockRead(struct uloop_fd *u_fd, unsigned int events);
+static void cfgBeaconSend(struct uloop_timeout *t);
+static void cfgDelayedFire(struct uloop_timeout *t);
+static void cfgBulkFire(struct uloop_timeout *t);
+static void cfgSaveDone(struct uloop_process *p, int ret);
+static void cfgReloadDone(struct uloop_process *p, int ret);
+static void uciWatchRead(struct uloop_fd *u_fd, unsigned int events);
+
+IPI_FD_CB(cfgSockReadCb, cfgSockRead, IPINSTALL_LP_SOCK)
+IPI_TIMEOUT_CB(cfgBeaconSendCb, cfgBeaconSend, IPINSTALL_LP_BEACON)
+IPI_TIMEOUT_CB(cfgDelayedFireCb, cfgDelayedFire, IPINSTALL_LP_REPLY)
+IPI_TIMEOUT_CB(cfgBulkFireCb, cfgBulkFire, IPINSTALL_LP_REPLY)
+IPI_PROCESS_CB(cfgSaveDoneCb, cfgSaveDone, IPINSTALL_LP_CHILD)
+IPI_PROCESS_CB(cfgReloadDoneCb, cfgReloadDone, IPINSTALL_LP_CHILD)
+IPI_FD_CB(uciWatchReadCb, uciWatchRead, IPINSTALL_LP_UCI)
+static UINT32 cfgNowMs(void);
+
+static void cfgSockClose(void)
 {
+	if (sConfig == INVALID_SOCKET)
+		return;
+	uloop_fd_delete(&cfgUfd);
 	close(sConfig);
 	sConfig = INVALID_SOCKET;
 }
 
-void cfgSockCreate(void)
+/* Bound, non-blocking discovery socket, INVALID_SOCKET on failure. */
+static int cfgSockCreate(void)
 {
 	int optval = 1;
 	struct sockaddr_in sin;
+	int s;
 
 	/* Create socket. */
-	sConfig = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	if (sConfig == INVALID_SOCKET)
+	s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (s == INVALID_SOCKET)
 	{
 		printf("ERROR\n    Failed to create configuration socket\n");
-		return;
+		return INVALID_SOCKET;
 	}
 
 	/* Enable Broadcast. */
-	if (setsockopt(sConfig, SOL_SOCKET, SO_BROADCAST, (char *)&optval, sizeof(optval)) == ERROR)
+	if (setsockopt(s, SOL_SOCKET, SO_BROADCAST, (char *)&optval, sizeof(optval)) == ERROR)
 	{
 		printf("Failed to set configuration socket option\n");
-		cfgSockClose();
-		return;
+		close(s);
+		return INVALID_SOCKET;
 	}
+	/* Lets a rebind overlap the socket it replaces. */
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (char *)&optval, sizeof(optval));
+	/* Ingress interface of each request, replies leave the same way. */
+	setsockopt(s, IPPROTO_IP, IP_PKTINFO, (char *)&optval, sizeof(optval));
 
+	memset(&sin, 0, sizeof(sin));
 	sin.sin_family = AF_INET;
 	sin.sin_addr.s_addr = INADDR_ANY;
 	sin.sin_port = htons(DEFAULT_CONFIG_PORT);
 
 	/* Bind socket. */
-	if (bind(sConfig, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+	if (bind(s, (struct sockaddr *)&sin, sizeof(sin)) < 0)
 	{
 		printf("ERROR\n    Failed to bind configuration socket\n");
-		cfgSockClose();
-		return;
+		close(s);
+		return INVALID_SOCKET;
 	}
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+	return s;
 }
 
+/*
+ * Swap in a fresh socket. The old one is kept until the new one is bound,
+ * so there is never a moment with nothing listening on the port.
+ */
+static void cfgSockRebind(void)
+{
+	int s;
 
-int cfgGetInfo()
+	s = cfgSockCreate();
+	if (s == INVALID_SOCKET)
+		return;
+
+	cfgSockClose();
+	sConfig = s;
+	cfgUfd.cb = cfgSockReadCb;
+	cfgUfd.fd = s;
+	uloop_fd_add(&cfgUfd, ULOOP_READ);
+}
+
+
+static void cfgGetInfo()
 {
     memset(&rtinfo,0,sizeof(rt_info_t));
     memset(&cfgNvRam, 0, sizeof(cfgNvRam));
     memset(&cfgNvRam_w, 0, sizeof(cfgNvRam_w));
 }
 
-int GetGw(int type,unsigned char *gw)
+/*
+ * LAN the default gateway sits on. WIPIFNAME may be an alias sharing the
+ * link with EIPIFNAME, so the answer comes from the source address the
+ * kernel uses towards the gateway rather than from the interface.
+ */
+static int GetGwIf()
 {
-    int lan;
-    unsigned char *p;
-    int i;
-    if( type == LANTYPE_ELAN ){
-        lan = (rtinfo.elanip & rtinfo.elanmask) | 0x01000000;
-    } else {
-        lan = (rtinfo.wlanip & rtinfo.wlanmask) | 0x01000000;
-    }
-    p = ( unsigned char *)&lan;
-    sprintf(gw,"%d.%d.%d.%d",p[0],p[1],p[2],p[3]);
-    return 0;
-}
-
-int GetGwIf()
-{
-	int elan,wlan;
+	struct in_addr gw, src, addr, mask;
+	unsigned char mac[6];
 #ifndef IFWLAN
 	return LANTYPE_ELAN;
 #endif
 
-	elan = rtinfo.elanip & rtinfo.elanmask;
-	wlan = rtinfo.wlanip & rtinfo.wlanmask;
+	if (netcache_get_gateway(&gw, NULL) < 0)
+		return LANTYPE_ELAN;
+	if (netcache_route(gw, NULL, NULL, &src) < 0 || src.s_addr == 0)
+		return -1;
 
-	if( elan == (rtinfo.gw & rtinfo.elanmask) )
+	netcache_get_if(EIPIFNAME, &addr, &mask, mac);
+	if (addr.s_addr == src.s_addr)
 		return LANTYPE_ELAN;
-	else if( wlan == (rtinfo.gw & rtinfo.wlanmask) )
+	netcache_get_if(WIPIFNAME, &addr, &mask, mac);
+	if (addr.s_addr == src.s_addr)
 		return LANTYPE_WLAN;
+	return -1;
+}
+
+/* Interface fields from the netlink cache, in the form the ioctl readers gave. */
+static void cfgReadInterface(char *ifname, Interface *inf)
+{
+	struct in_addr addr, mask;
+	unsigned char mac[6];
+
+	memset(inf, 0, sizeof(*inf));
+	strncpy(inf->name, ifname, IFNAMSIZ - 1);
+	netcache_get_if(ifname, &addr, &mask, mac);
+	strcpy(inf->IpAddress, inet_ntoa(addr));
+	strcpy(inf->Mask, inet_ntoa(mask));
+	sprintf(inf->MacAddress, "%02x:%02x:%02x:%02x:%02x:%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+static void cfgReadGateway(HostRow *h)
+{
+	struct in_addr gw;
+
+	if (netcache_get_gateway(&gw, NULL) < 0)
+		h->gateway[0] = 0;
 	else
-		return -1;
+		strcpy(h->gateway, inet_ntoa(gw));
+}
+
+/* Point the default route at gateway through oif, -1 lets the kernel pick. */
+static int cfgWriteGateway(struct rtsock *s, UINT32 gateway, int oif)
+{
+	struct route r;
+
+	memset(&r, 0, sizeof(r));
+	r.gateway_valid = 1;
+	r.gateway.s_addr = gateway;
+	r.oif = oif;
+	r.rtmsg.rtm_family = AF_INET;
+	r.rtmsg.rtm_table = RT_TABLE_MAIN;
+	r.rtmsg.rtm_protocol = RTPROT_BOOT;
+	r.rtmsg.rtm_scope = RT_SCOPE_UNIVERSE;
+	r.rtmsg.rtm_type = RTN_UNICAST;
+	return write_route(s, &r);
+}
+
+/* cfgGetData found no default route, add one through the guessed gateway. */
+static void cfgAddGateway(UINT32 gateway)
+{
+	struct rtsock *s;
+
+	s = open_route_socket();
+	if (s == NULL)
+		return;
+	if (cfgWriteGateway(s, gateway, -1) < 0)
+		printf("default route failed\n");
+	close_route_socket(s);
+	free(s);
+}
+
+/*
+ * uci around a burst of lookups, each package conf_load'ed first. Standalone
+ * the context lasts the burst. In a host it is the host's and outlives us,
+ * so it is never rebuilt or freed here; the conf_load is what makes a
+ * lookup see a changed file rather than the copy loaded the time before.
+ */
+static void cfgConfOpen(void)
+{
+#ifndef IPINSTALL_MODULE
+	conf_init(NULL);
+#endif
 }
 
+static void cfgConfClose(void)
+{
+#ifndef IPINSTALL_MODULE
+	conf_exit();
+#endif
+}
+
+/* The uci lookups cfgGetData needs, done once per config change. */
+static void cfgLoadPorts(void)
+{
+	char *config_return;
+	char *colon;
+
+	cfgConfOpen();
+
+	conf_load("uhttpd");
+	config_return = conf_get("uhttpd.main.listen_http");
+	if (config_return)
+	{
+		colon = strchr(config_return, ':');
+		snprintf(cfgWebPort, sizeof(cfgWebPort), "%s", colon ? colon + 1 : config_return);
+	}
+	else
+		strcpy(cfgWebPort, "4011");
+
 #ifdef WLAN
-int cfgGetData()
+	conf_load("rtsp");
+	config_return = conf_get("rtsp.@server[0].port");
+	cfgRtspPort = config_return ? atoi(config_return) : 554;
+	conf_load("nexpa");
+	config_return = conf_get("nexpa.jpeg.http_port");
+	cfgJpegPort = config_return ? atoi(config_return) : 8080;
+#else
+	conf_load("media");
+	config_return = conf_get("media.@server[0].port");
+	cfgRtspPort = config_return ? atoi(config_return) : 554;
+	conf_load("jpeg_send");
+	config_return = conf_get("jpeg_send.@led[0].tcp_port");
+	cfgJpegPort = config_return ? atoi(config_return) : 8080;
+#endif
+
+	cfgConfClose();
+}
+
+/* ipinstall.discovery options */
+static void cfgLoadDiscovery(void)
+{
+	char *config_return;
+
+	cfgConfOpen();
+	conf_load("ipinstall");
+	config_return = conf_get("ipinstall.discovery.dedup_window");
+	cfgDupWindow = config_return ? atoi(config_return) : CFG_DUP_WINDOW;
+	cfgConfClose();
+}
+
+/* ipinstall.beacon options, off unless a period is set */
+static void cfgLoadBeacon(void)
+{
+	char *config_return;
+
+	cfgConfOpen();
+	conf_load("ipinstall");
+	config_return = conf_get("ipinstall.beacon.period");
+	cfgBeaconPeriod = config_return ? atoi(config_return) : 0;
+	config_return = conf_get("ipinstall.beacon.jitter");
+	cfgBeaconJitter = config_return ? (UINT32)atoi(config_return) : cfgBeaconPeriod / 10;
+
+	memset(&cfgBeaconTo, 0, sizeof(cfgBeaconTo));
+	cfgBeaconTo.sin_family = AF_INET;
+	cfgBeaconTo.sin_addr.s_addr = INADDR_BROADCAST;
+	config_return = conf_get("ipinstall.beacon.dest");
+	if (config_return && inet_aton(config_return, &cfgBeaconTo.sin_addr) == 0)
+	{
+		printf("beacon dest %s invalid\n", config_return);
+		cfgBeaconTo.sin_addr.s_addr = INADDR_BROADCAST;
+	}
+	config_return = conf_get("ipinstall.beacon.port");
+	cfgBeaconTo.sin_port = htons(config_return ? atoi(config_return) : DEFAULT_CONFIG_PORT);
+	cfgConfClose();
+
+	cfgBeaconSeed = cfgMacHash ^ time(NULL);
+	cfgBeaconTimer.cb = cfgBeaconSendCb;
+	if (cfgBeaconPeriod == 0)
+		uloop_timeout_cancel(&cfgBeaconTimer);
+	else
+		uloop_timeout_set(&cfgBeaconTimer, cfgMacHash % CFG_BEACON_SPREAD);
+}
+
+/* ipinstall.sampler options, a missing one keeps the sampler default */
+static void cfgLoadSampler(void)
+{
+	char *config_return;
+	char path[64];
+	int slots = SMP_SLOTS;
+	int interval = SMP_INTERVAL;
+
+	strcpy(path, SMP_PATH);
+	cfgConfOpen();
+	conf_load("ipinstall");
+	if ((config_return = conf_get("ipinstall.sampler.path")) != NULL)
+		snprintf(path, sizeof(path), "%s", config_return);
+	if ((config_return = conf_get("ipinstall.sampler.slots")) != NULL)
+		slots = atoi(config_return);
+	if ((config_return = conf_get("ipinstall.sampler.interval")) != NULL)
+		interval = atoi(config_return);
+	cfgConfClose();
+
+	sampler_init(path, slots, interval);
+}
+
+#ifdef WLAN
+static void cfgGetData()
 {
 	int i;		/* generic loop counter */
-	char buf[128];
 	char Serial[18];
 	char WebPort[18];
 	unsigned char *p;
-	char *config_return;
 	CFG_NVRAM_STRUCT *cfg = &cfgNvRam, *cfg_w = &cfgNvRam_w;
 	cfg->sig = CFG_SIG;
 	cfg_w->sig = CFG_SIG;
 	Interface Interface_data;
 	HostRow Host_data;
 
-	readIpAddress(EIPIFNAME, &Interface_data);
-	readNetmask(EIPIFNAME, &Interface_data);
-	readMacAddress(EIPIFNAME,&Interface_data);
+	cfgReadInterface(EIPIFNAME, &Interface_data);
 	printf("EMAC : %s\n", Interface_data.MacAddress);
 	cfg->ipAddress = inet_addr(Interface_data.IpAddress);
 	cfg->ipMask = inet_addr(Interface_data.Mask);
@@ -202,10 +552,7 @@ int cfgGetData()
 	rtinfo.elanmask = cfg->ipMask;
 	memcpy(rtinfo.elanmac, cfg->ipMacAddress, sizeof(rtinfo.elanmac));
 
-	memset(&Interface_data, 0, sizeof(Interface_data));
-	readIpAddress(WIPIFNAME, &Interface_data);
-	readNetmask(WIPIFNAME, &Interface_data);
-	readMacAddress(WIPIFNAME,&Interface_data);
+	cfgReadInterface(WIPIFNAME, &Interface_data);
 	printf("WMAC : %s\n", Interface_data.MacAddress);
 	cfg_w->ipAddress = inet_addr(Interface_data.IpAddress);
 	cfg_w->ipMask = inet_addr(Interface_data.Mask);
@@ -218,13 +565,12 @@ int cfgGetData()
 	memcpy(rtinfo.wlanmac, cfg_w->ipMacAddress, sizeof(rtinfo.wlanmac));
 
 	readSerial(&Host_data);
-	readGateway(&Host_data);
-	if(!strcmp(Host_data.gateway, "")) {
+	cfgReadGateway(&Host_data);
+	if(!strcmp(Host_data.gateway, "") && rtinfo.elanip) {
 		rtinfo.gw = (rtinfo.elanip & rtinfo.elanmask) | 0x01000000;
 		p = (unsigned char *)&rtinfo.gw;
-		sprintf(Host_data.gateway, "%d.%d.%d.%d",p[0],p[1],p[2],p[2]);
-		sprintf(buf,"route add default gw %s",Host_data.gateway);
-		system(buf);
+		sprintf(Host_data.gateway, "%d.%d.%d.%d",p[0],p[1],p[2],p[3]);
+		cfgAddGateway(rtinfo.gw);
 	}
 
 	cfg->ipGateway = inet_addr(Host_data.gateway);
@@ -242,19 +588,7 @@ int cfgGetData()
 	strcpy(cfg_w->targetUserName, "admin");
 	strcpy(cfg_w->targetPassword, "admin");
 
-	conf_init(NULL);
-
-	config_return = conf_get("uhttpd.main.listen_http");
-	if(config_return) {
-		if(strchr(conf_get("uhttpd.main.listen_http"), ':'))
-			strcpy(WebPort, strchr(conf_get("uhttpd.main.listen_http"), ':')+1);
-		else
-		{
-			strcpy(WebPort, conf_get("uhttpd.main.listen_http"));
-		}
-	}
-	else
-		strcpy(WebPort, "4011");
+	strcpy(WebPort, cfgWebPort);
 
 	sprintf(cfg->targetName,"%s:%s",Serial,WebPort);
 	sprintf(cfg_w->targetName,"%s:%s",Serial,WebPort);
@@ -263,45 +597,27 @@ int cfgGetData()
 	cfg_w->useWlan = LANTYPE_WLAN;
 	cfg_w->httpport = atoi(WebPort);
 
-	config_return = conf_get("rtsp.@server[0].port");
-	cfg->rtspport = config_return ? atoi(config_return) : 554;
+	cfg->rtspport = cfgRtspPort;
 	cfg_w->rtspport = cfg->rtspport;
-	config_return = conf_get("nexpa.jpeg.http_port");
-	cfg->httpjpegport = config_return ? atoi(config_return) : 8080;
+	cfg->httpjpegport = cfgJpegPort;
 	cfg_w->httpjpegport = cfg->httpjpegport;
 
-	conf_exit();
-
 	printf("get if %d\n",GetGwIf());
 }
 
 #else
-int cfgGetData()
+static void cfgGetData()
 {
 	int i;		/* generic loop counter */
-	char buf[128];
 	char Serial[18];
 	char WebPort[18];
 	unsigned char *p;
-	char *config_return;
 	CFG_NVRAM_STRUCT *cfg = &cfgNvRam;
 	cfg->sig = CFG_SIG;
 	Interface Interface_data;
 	HostRow Host_data;
 
-	readIpAddress(EIPIFNAME, &Interface_data);
-	readNetmask(EIPIFNAME, &Interface_data);
-	readMacAddress(EIPIFNAME,&Interface_data);
-	readSerial(&Host_data);
-	readGateway(&Host_data);
-	if(!strcmp(Host_data.gateway, "")) {
-		rtinfo.gw = (rtinfo.elanip & rtinfo.elanmask) | 0x01000000;
-		p = (unsigned char *)&rtinfo.gw;
-		sprintf(Host_data.gateway, "%d.%d.%d.%d",p[0],p[1],p[2],p[2]);
-		sprintf(buf,"route add default gw %s",Host_data.gateway);
-		system(buf);
-	}
-
+	cfgReadInterface(EIPIFNAME, &Interface_data);
 	cfg->ipAddress = inet_addr(Interface_data.IpAddress);
 	cfg->ipMask = inet_addr(Interface_data.Mask);
 	sscanf(Interface_data.MacAddress, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &cfg->ipMacAddress[0],
@@ -312,6 +628,16 @@ int cfgGetData()
 	rtinfo.elanmask = cfg->ipMask;
 	memcpy(rtinfo.elanmac, cfg->ipMacAddress, sizeof(rtinfo.elanmac));
 
+	/* the guessed gateway is the subnet's .1, so it needs the address above */
+	readSerial(&Host_data);
+	cfgReadGateway(&Host_data);
+	if(!strcmp(Host_data.gateway, "") && rtinfo.elanip) {
+		rtinfo.gw = (rtinfo.elanip & rtinfo.elanmask) | 0x01000000;
+		p = (unsigned char *)&rtinfo.gw;
+		sprintf(Host_data.gateway, "%d.%d.%d.%d",p[0],p[1],p[2],p[3]);
+		cfgAddGateway(rtinfo.gw);
+	}
+
 	cfg->ipGateway = inet_addr(Host_data.gateway);
 	strcpy(GateWay,Host_data.gateway);
 	strcpy(Serial, Host_data.hostname);
@@ -323,425 +649,1272 @@ int cfgGetData()
 	strcpy(cfg->targetUserName, "admin");
 	strcpy(cfg->targetPassword, "admin");
 
-	conf_init(NULL);
-
-	config_return = conf_get("uhttpd.main.listen_http");
-	if(config_return) {
-		if(strchr(conf_get("uhttpd.main.listen_http"), ':'))
-			strcpy(WebPort, strchr(conf_get("uhttpd.main.listen_http"), ':')+1);
-		else
-		{
-			strcpy(WebPort, conf_get("uhttpd.main.listen_http"));
-		}
-	}
-	else
-		strcpy(WebPort, "4011");
+	strcpy(WebPort, cfgWebPort);
 
 	sprintf(cfg->targetName,"%s:%s",Serial,WebPort);
 	cfg->useWlan = LANTYPE_ELAN;
 	cfg->httpport = atoi(WebPort);
 
-	config_return = conf_get("media.@server[0].port");
-	cfg->rtspport = config_return ? atoi(config_return) : 554;
-	config_return = conf_get("jpeg_send.@led[0].tcp_port");
-	cfg->httpjpegport = config_return ? atoi(config_return) : 8080;
+	cfg->rtspport = cfgRtspPort;
+	cfg->httpjpegport = cfgJpegPort;
 
 	// config_return = PQgetvalue(res, 0, 0);
 	// cfg->ptzport = config_return ? atoi(config_return) : 0;
 
-	conf_exit();
-
 	printf("get if %d\n",GetGwIf());
 }
 #endif
 
-static struct uci_context *ctx;
+/*
+ * Move the generation on if anything a reply carries changed since it was
+ * last stamped. The stamp lives in the settings themselves, so it is part
+ * of what gets compared next time.
+ */
+static void cfgNextGeneration(void)
+{
+	int fd;
+
+	if (cfgGeneration == 0) {
+		fd = open("/dev/urandom", O_RDONLY);
+		if (fd < 0 || read(fd, &cfgGeneration, sizeof(cfgGeneration)) != sizeof(cfgGeneration))
+			cfgGeneration = (UINT32)time(NULL) ^ ((UINT32)getpid() << 16);
+		if (fd >= 0)
+			close(fd);
+	} else if (!memcmp(&cfgGenNvRam, &cfgNvRam, sizeof(cfgNvRam)) &&
+		!memcmp(&cfgGenNvRam_w, &cfgNvRam_w, sizeof(cfgNvRam_w))) {
+		return;
+	} else {
+		cfgGeneration++;
+	}
+	if (cfgGeneration == 0)
+		cfgGeneration = 1;
+
+	CFG_REPLY_EXT(&cfgNvRam)->sig = CFG_GEN_SIG;
+	CFG_REPLY_EXT(&cfgNvRam)->generation = cfgGeneration;
+	CFG_REPLY_EXT(&cfgNvRam_w)->sig = CFG_GEN_SIG;
+	CFG_REPLY_EXT(&cfgNvRam_w)->generation = cfgGeneration;
+	memcpy(&cfgGenNvRam, &cfgNvRam, sizeof(cfgNvRam));
+	memcpy(&cfgGenNvRam_w, &cfgNvRam_w, sizeof(cfgNvRam_w));
+#ifdef DEBUG_TRACE
+	printf("config generation %08x\n", cfgGeneration);
+#endif
+}
+
+/* Refresh cfgNvRam and the prebuilt GETCONFIG reply from the caches. */
+static void cfgBuildReply(void)
+{
+	UINT32 generation = cfgGeneration;
+	int i;
+
+	cfgGetData();
+	cfgNextGeneration();
 
-void cli_perror(){
+	memset(&cfgReply, 0, sizeof(cfgReply));
+	cfgReply.msg = RCFG_GETCONFIGOK;
+	cfgReply.version = FW_VERSION;
+	if( GetGwIf() == LANTYPE_ELAN )
+		memcpy((void *)&cfgReply.cfgNvRam, (void *)&cfgNvRam, sizeof(cfgNvRam));
+	else
+		memcpy((void *)&cfgReply.cfgNvRam, (void *)&cfgNvRam_w, sizeof(cfgNvRam_w));
+
+	cfgMacHash = 2166136261U;
+	for (i = 0; i < 6; i++)
+		cfgMacHash = (cfgMacHash ^ cfgReply.cfgNvRam.ipMacAddress[i]) * 16777619U;
+
+	/* listeners hear about a change at once, spread a little by MAC */
+	if (cfgBeaconPeriod && generation != cfgGeneration)
+		uloop_timeout_set(&cfgBeaconTimer, cfgMacHash % CFG_BEACON_SPREAD);
 }
 
-static int uci_rpc_commit(char *tuple)
+/* Append one TLV entry at *len, dropping it if it does not fit. */
+static void cfgTlvPut(UINT8 *tlv, int *len, UINT8 type, void *val, int vlen)
 {
-	struct uci_element *e = NULL;
-	struct uci_ptr ptr;
-	int ret = 0;
+	if (vlen > 255 || *len + 2 + vlen > CFG_TLV_MAX)
+		return;
+	tlv[*len] = type;
+	tlv[*len + 1] = vlen;
+	memcpy(tlv + *len + 2, val, vlen);
+	*len += 2 + vlen;
+}
 
-	if (uci_lookup_ptr(ctx, &ptr, tuple, true) != UCI_OK) {
-		cli_perror();
-		return 1;
-	}
+/* DISTRIB_REVISION='xxx' of the release file, empty if it can't be read */
+static void cfgReadRelease(char *version, int size)
+{
+	char line[128], *s, *e;
+	FILE *fp;
 
-	if (uci_commit(ctx, &ptr.p, false) != UCI_OK) {
-		cli_perror();
-		ret = 1;
+	version[0] = 0;
+	if ((fp = fopen(CFG_RELEASE_FILE, "r")) == NULL)
+		return;
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		if (strncmp(line, "DISTRIB_REVISION=", 17))
+			continue;
+		s = strchr(line, '\'');
+		e = s ? strchr(s + 1, '\'') : NULL;
+		if (e)
+			snprintf(version, size, "%.*s", (int)(e - s - 1), s + 1);
 	}
+	fclose(fp);
+}
 
-	if (ptr.p)
-		uci_unload(ctx, ptr.p);
-
-	return ret;
+/*
+ * Build the identity TLVs once. Model and serial come from the command
+ * line, the firmware from the release file; none of them change without
+ * a restart.
+ */
+static void cfgBuildTlv(void)
+{
+	char version[128];
+
+	cfgReadRelease(version, sizeof(version));
+	cfgTlvLen = 0;
+	if (cfgModel[0])
+		cfgTlvPut(cfgTlv, &cfgTlvLen, CFG_TLV_MODEL, cfgModel, strlen(cfgModel));
+	if (cfgSerialNo[0])
+		cfgTlvPut(cfgTlv, &cfgTlvLen, CFG_TLV_SERIAL, cfgSerialNo, strlen(cfgSerialNo));
+	if (version[0])
+		cfgTlvPut(cfgTlv, &cfgTlvLen, CFG_TLV_FIRMWARE, version, strlen(version));
 }
 
-static int uci_rpc_set(char *tuple){
-	struct uci_ptr ptr;
-	int ret = UCI_OK;
+/*
+ * Consistent copy of camifd's status page, -1 while camifd isn't running.
+ * camifd reuses the file across restarts, so after the one mmap a read
+ * costs one kill(pid, 0): pid is only cleared on a clean stop, and a
+ * camifd that crashed leaves it behind.
+ */
+static int cfgCamStatus(CAM_STATUS_STRUCT *st)
+{
+	struct stat sb;
+	UINT32 seq, now;
+	void *p;
+	int fd, i;
 
-	if (uci_lookup_ptr(ctx, &ptr, tuple, true) != UCI_OK) {
-		cli_perror();
-		return 1;
+	if (cfgCamPage == NULL)
+	{
+		now = cfgNowMs();
+		if (cfgCamLook && now - cfgCamLook < CFG_CAM_RETRY)
+			return -1;
+		cfgCamLook = now ? now : 1;
+		if ((fd = open(CAM_STATUS_PATH, O_RDONLY | O_CLOEXEC)) < 0)
+			return -1;
+		if (fstat(fd, &sb) < 0 || sb.st_size < (off_t)sizeof(*st))
+		{
+			close(fd);
+			return -1;
+		}
+		p = mmap(NULL, sizeof(*st), PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED)
+			return -1;
+		cfgCamPage = p;
+	}
+
+	for (i = 0; i < CFG_CAM_TRIES; i++)
+	{
+		seq = __atomic_load_n(&cfgCamPage->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(st, cfgCamPage, sizeof(*st));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&cfgCamPage->seq, __ATOMIC_RELAXED) == seq)
+			break;
 	}
+	if (i == CFG_CAM_TRIES || st->magic != CAM_STATUS_MAGIC || st->size < sizeof(*st) || st->pid == 0)
+		return -1;
+	if (kill(st->pid, 0) < 0 && errno == ESRCH)
+		return -1;
+	return 0;
+}
 
-	ret = uci_set(ctx, &ptr);
+/*
+ * GETCONFIGOK for a probe of the given version into reply, returning its
+ * length: the fixed reply alone for older tools, with the TLVs otherwise.
+ */
+static int cfgBuildReplyV4(CFG_REPLY_V4 *reply, UINT32 version)
+{
+	CFG_TLV_UPGRADE_VAL up;
+	CAM_STATUS_STRUCT st;
+	int len = cfgTlvLen;
 
-	/* save changes, but don't commit them yet */
-	if (ret == UCI_OK)
-		ret = uci_save(ctx, ptr.p);
+	memcpy(&reply->cfg, &cfgReply, sizeof(cfgReply));
+	if (version < CFG_VERSION_TLV)
+		return sizeof(reply->cfg);
 
-	if (ret != UCI_OK) {
-		cli_perror();
-		return 3;
+	reply->cfg.version = CFG_VERSION_TLV;
+	memcpy(reply->tlv, cfgTlv, cfgTlvLen);
+	if (cfgCamStatus(&st) == 0)
+	{
+		memset(&up, 0, sizeof(up));
+		up.stage = st.stage;
+		up.result = st.result;
+		up.staged = st.staged;
+		cfgTlvPut(reply->tlv, &len, CFG_TLV_UPGRADE, &up, sizeof(up));
 	}
+	reply->len = len;
+	return CFG_REPLY_V4_LEN(len);
+}
 
-	if (ptr.p)
-		uci_unload(ctx, ptr.p);
+/* Set key in the loaded package if it differs, flag when it did. */
+static int cfgConfUpdate(char *key, char *val, int flag)
+{
+	char *cur = conf_get(key);
 
-	return 0;
+	if (cur && !strcmp(cur, val))
+		return 0;
+	if (conf_set(key, val)) {
+		printf("%s=%s failed\n", key, val);
+		return 0;
+	}
+	printf("%s=%s\n", key, val);
+	return flag;
 }
 
-int cfgSetDataAll( CFG_NVRAM_STRUCT *cfg)
+/*
+ * Write cfg to network.lan in one load and one commit, which uci does as a
+ * rename of the whole file. Nothing is written when nothing changed.
+ * Returns the CFG_CHG_xxx keys that changed, -1 on failure.
+ */
+static int cfgSetDataAll( CFG_NVRAM_STRUCT *cfg)
 {
-	int i;                  /* generic loop counter */
-	unsigned char *s,*d;
-	UINT32 g;
 	struct in_addr addr;
 	char ip[32], mask[32], gateway[32];
-	int ret = 0;
+	int changed = 0;
+
+	addr.s_addr = cfg->ipAddress;
+	strcpy(ip, inet_ntoa(addr));
+	addr.s_addr = cfg->ipMask;
+	strcpy(mask, inet_ntoa(addr));
+	addr.s_addr = cfg->ipGateway;
+	strcpy(gateway, inet_ntoa(addr));
+
+	cfgConfOpen();
+	if (conf_load("network") < 0) {
+		printf("ERROR\n    network config not loaded\n");
+		cfgConfClose();
+		return -1;
+	}
+
+	changed |= cfgConfUpdate("network.lan.proto", "static", CFG_CHG_PROTO);
+	changed |= cfgConfUpdate("network.lan.ipaddr", ip, CFG_CHG_IPADDR);
+	changed |= cfgConfUpdate("network.lan.netmask", mask, CFG_CHG_NETMASK);
+	changed |= cfgConfUpdate("network.lan.gateway", gateway, CFG_CHG_GATEWAY);
+	changed |= cfgConfUpdate("network.lan.dns", CFG_DNS_DEFAULT, CFG_CHG_DNS);
+
+	if (changed && conf_commit("network") < 0) {
+		printf("ERROR\n    network config not written\n");
+		changed = -1;
+	}
+	cfgConfClose();
+	return changed;
+}
+
+static int cfgPrefixLen(UINT32 mask)
+{
+	return mask ? 32 - __builtin_ctz(ntohl(mask)) : 0;
+}
+
+/*
+ * Move EIPIFNAME to the requested address with the link up: add the new
+ * address, point the default route at the new gateway, then drop the old
+ * address. Connections on the old address are lost, nothing else is.
+ * Returns 0 when the kernel took all of it.
+ */
+static int cfgApplyNet(CFG_NVRAM_STRUCT *cfg)
+{
+	struct in_addr oldAddr, oldMask, addr, gw;
+	unsigned char mac[6];
+	struct rtsock *s;
+	int index, len, oldLen, oif;
+	int ret = -1;
 	char path[64];
+	FILE *fp;
 
-	s = (unsigned char *)&cfg->ipAddress;
-	d = (unsigned char *)&addr;
-	for( i = 0; i < 4; i++) d[i]=s[i];
-		sprintf(ip,"%s",inet_ntoa(addr));
-		
-	s =  (unsigned char *)&cfg->ipMask;
-	for( i = 0; i < 4; i++) d[i]=s[i];
-		sprintf(mask,"%s",inet_ntoa(addr));
-		
-	s =  (unsigned char *)&cfg->ipGateway;
-	for( i = 0; i < 4; i++) d[i]=s[i];
-		sprintf(gateway,"%s",inet_ntoa(addr));
+	index = netcache_get_index(EIPIFNAME);
+	if (index <= 0)
+		return -1;
+	netcache_get_if(EIPIFNAME, &oldAddr, &oldMask, mac);
+	oldLen = cfgPrefixLen(oldMask.s_addr);
+	addr.s_addr = cfg->ipAddress;
+	len = cfgPrefixLen(cfg->ipMask);
+
+	/* a request for what the kernel already has is left alone */
+	if (oldAddr.s_addr == addr.s_addr && oldLen == len &&
+		netcache_get_gateway(&gw, &oif) == 0 && gw.s_addr == cfg->ipGateway && oif == index)
+		return 0;
+
+	/* dropping the old primary must not take a new address on its subnet along */
+	sprintf(path, "/proc/sys/net/ipv4/conf/%s/promote_secondaries", EIPIFNAME);
+	if ((fp = fopen(path, "w")) != NULL) {
+		fputs("1", fp);
+		fclose(fp);
+	}
 
-	ctx = uci_alloc_context();
-	if (!ctx) {
-		printf("Out of memory\n");
-		return 1;
+	s = open_route_socket();
+	if (s == NULL)
+		return -1;
+
+	if (write_address(s, RTM_NEWADDR, index, &addr, len) < 0) {
+		printf("add address failed\n");
+		goto out;
 	}
 
-	sprintf(path, "network.lan.proto=static");
-	ret = uci_rpc_set(path);
-	printf("%s %d\n", path, ret);
+	if (cfgWriteGateway(s, cfg->ipGateway, index) < 0) {
+		printf("default route failed\n");
+		goto out;
+	}
 
-	sprintf(path, "network.lan.ipaddr=%s", ip);
-	ret = uci_rpc_set(path);
-	printf("%s %d\n", path, ret);
+	if (oldAddr.s_addr && (oldAddr.s_addr != addr.s_addr || oldLen != len) &&
+		write_address(s, RTM_DELADDR, index, &oldAddr, oldLen) < 0) {
+		printf("remove address failed\n");
+		goto out;
+	}
+	ret = 0;
+out:
+	close_route_socket(s);
+	free(s);
+	return ret;
+}
 
-	sprintf(path, "network.lan.netmask=%s", mask);
-	ret = uci_rpc_set(path);
-	printf("%s %d\n", path, ret);
+static void cfgSaveStart(void);
 
-	sprintf(path, "network.lan.gateway=%s", gateway);
-	ret = uci_rpc_set(path);
-	printf("%s %d\n", path, ret);
+static void cfgReloadStart(void);
 
-	sprintf(path, "network.lan.dns=%s", "168.126.63.1");
-	ret = uci_rpc_set(path);
-	printf("%s %d\n", path, ret);
+static void cfgReloadDone(struct uloop_process *p, int ret)
+{
+	if (!WIFEXITED(ret) || WEXITSTATUS(ret) != 0)
+		printf("network reload failed %d\n", ret);
+	if (cfgReloadQueued)
+		cfgReloadStart();
+}
 
-	uci_rpc_commit(path);
+/*
+ * Have netifd reread network, off the loop. "interface up" would not do,
+ * netifd leaves an interface that is up alone; only a reload sees the new
+ * proto, and it restarts lan to apply it, so the link does bounce here.
+ */
+static void cfgReloadStart(void)
+{
+	pid_t pid;
 
-	uci_free_context(ctx);
-	return 0;
+	cfgReloadQueued = 0;
+	if (cfgReloadProc.pending) {
+		cfgReloadQueued = 1;
+		return;
+	}
+	pid = fork();
+	if (pid < 0) {
+		printf("network reload: %s\n", strerror(errno));
+		return;
+	}
+	if (pid == 0) {
+		execlp("ubus", "ubus", "call", "network", "reload", (char *)NULL);
+		_exit(127);
+	}
+
+	cfgReloadProc.pid = pid;
+	cfgReloadProc.cb = cfgReloadDoneCb;
+	uloop_process_add(&cfgReloadProc);
+}
+
+static void cfgSaveDone(struct uloop_process *p, int ret)
+{
+	/* the child exits with the keys it changed, 255 on failure */
+	if (!WIFEXITED(ret) || WEXITSTATUS(ret) == 255)
+		printf("uci save failed %d\n", ret);
+	else if (WEXITSTATUS(ret) == 0)
+		printf("uci unchanged\n");
+	else {
+		printf("uci changed %02x\n", WEXITSTATUS(ret));
+		/* a DHCP lan keeps udhcpc, whose next lease would add its address back */
+		if (WEXITSTATUS(ret) & CFG_CHG_PROTO)
+			cfgReloadStart();
+	}
+	if (cfgSaveQueued)
+		cfgSaveStart();
 }
 
-void cfgSetDefault(CFG_NVRAM_STRUCT *cfg)
+static void cfgSaveStart(void)
+{
+	pid_t pid;
+	int ret;
+
+	cfgSaveQueued = 0;
+	pid = fork();
+	if (pid < 0) {
+		/* no child, pay for the flash write here */
+		cfgSetDataAll(&cfgSavePending);
+		return;
+	}
+	if (pid == 0) {
+		ret = cfgSetDataAll(&cfgSavePending);
+		_exit(ret < 0 ? 255 : ret);
+	}
+
+	cfgSaveProc.pid = pid;
+	cfgSaveProc.cb = cfgSaveDoneCb;
+	uloop_process_add(&cfgSaveProc);
+}
+
+/* Persist cfg to uci in the background, the newest request wins. */
+static void cfgSave(CFG_NVRAM_STRUCT *cfg)
+{
+	memcpy(&cfgSavePending, cfg, sizeof(cfgSavePending));
+	if (cfgSaveProc.pending) {
+		cfgSaveQueued = 1;
+		return;
+	}
+	cfgSaveStart();
+}
+
+/* Move to the settings in cfg, by a network restart if netlink fails. */
+static void cfgApplyConfig(CFG_NVRAM_STRUCT *cfg)
+{
+	/* the netlink events that follow rebuild the reply */
+	if (cfgApplyNet(cfg) == 0) {
+		cfgSave(cfg);
+	} else {
+		printf("falling back to network restart\n");
+		cfgSetDataAll(cfg);
+		system("/etc/init.d/network restart");
+		cfgBuildReply();
+	}
+}
+
+static void cfgSetDefault(CFG_NVRAM_STRUCT *cfg)
 {
 	printf("cfgSetDefault call\n");
 }
 
-void cfgDaemonTask(void)
+/*
+ * Send everything queued by cfgReplyQueue. A reply the socket refuses is
+ * dropped, the requester probes again anyway.
+ */
+static void cfgReplyFlush(void)
 {
-	char strIP[32];
-	struct sockaddr_in saFrom;
-	int saFromLen;
-	REMOTE_CFG_STRUCT cfgRemote;
-	struct sockaddr_in saTo;
-	int err;
-	char *p;
+	struct cmsghdr *cmsg;
+	int sent = 0;
+	int n;
 	int i;
-	char buf[64];
-	char strGW[32];
-
-	while(1)
-	{
-		if( sConfig != INVALID_SOCKET )
-			cfgSockClose();
-		cfgSockCreate();
-		memset((char *)&saFrom, 0, sizeof(saFrom));
-		saFromLen = sizeof(saFrom);
-
-		/* Receive configuration request. */
-		if (recvfrom(
-			sConfig,
-			(char *)&cfgRemote,
-			sizeof(cfgRemote),
-			0,
-			(struct sockaddr *)&saFrom,
-			&saFromLen
-			) != sizeof(cfgRemote))
-		{
-			printf("CFGSOCK: ERROR on recvfrom()\n");
+
+	for (i = 0; i < cfgReplyCount; i++)
+	{
+		cfgReplyIov[i].iov_base = &cfgReplyBuf[i];
+		cfgReplyIov[i].iov_len = cfgReplyLen[i];
+		memset(&cfgReplyMsg[i], 0, sizeof(cfgReplyMsg[i]));
+		cfgReplyMsg[i].msg_hdr.msg_iov = &cfgReplyIov[i];
+		cfgReplyMsg[i].msg_hdr.msg_iovlen = 1;
+		cfgReplyMsg[i].msg_hdr.msg_name = &cfgReplyTo[i];
+		cfgReplyMsg[i].msg_hdr.msg_namelen = sizeof(cfgReplyTo[i]);
+		if (cfgReplyPi[i].ipi_ifindex == 0)
 			continue;
-		}
-		/* Verify version. */
-		if ((cfgRemote.cfgNvRam.sig != CFG_SIG) || (cfgNvRam.sig != CFG_SIG))
+
+		cfgReplyMsg[i].msg_hdr.msg_control = cfgReplyCtl[i];
+		cfgReplyMsg[i].msg_hdr.msg_controllen = sizeof(cfgReplyCtl[i]);
+		cmsg = CMSG_FIRSTHDR(&cfgReplyMsg[i].msg_hdr);
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type = IP_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+		memcpy(CMSG_DATA(cmsg), &cfgReplyPi[i], sizeof(struct in_pktinfo));
+	}
+
+	while (sent < cfgReplyCount)
+	{
+		n = sendmmsg(sConfig, &cfgReplyMsg[sent], cfgReplyCount - sent, MSG_DONTWAIT);
+		if (n < 0)
 		{
-#ifdef DEBUG_TRACE
-			printf("Invalid message\n");
-			printf("cfgRemotesig : %08x\n",cfgRemote.cfgNvRam.sig);
-			printf("cfgRemotesig : %08x\n",cfgNvRam.sig);           
-			printf("CFG_SIG      : %08x\n",CFG_SIG);            
-			p = &cfgRemote.cfgNvRam.sig;
-			printf("%c %c %c %c\n",p[0],p[1],p[2],p[3]);
-#endif
-			continue;
+			if (errno == EINTR)
+				continue;
+			printf("ERROR on sendmmsg(), %d, %d replies dropped\n", errno, cfgReplyCount - sent);
+			break;
 		}
+		sent += n;
+	}
+	cfgReplyCount = 0;
+}
 
-		 p = inet_ntoa(saFrom.sin_addr);
-		 strcpy(strIP,p);
-#ifdef DEBUG_TRACE
-		printf("1 Configuration message from %s\n", strIP);
-#endif  /* DEBUG_TRACE */
+/*
+ * Queue the first len bytes of reply for the end of the batch. pi picks
+ * the outgoing interface and source address, NULL leaves it to the
+ * routing table. Probes repeated within one batch produce identical
+ * replies on the same path, only one of them goes out.
+ */
+static void cfgReplyQueue(void *reply, int len, struct sockaddr_in *to, struct in_pktinfo *pi)
+{
+	struct in_pktinfo none;
+	int i;
 
-		/* If not broadcast or addressed to us, discard message. */
-		if ((cfgRemote.cfgNvRam.ipMacAddress[0] == cfgNvRam.ipMacAddress[0]) &&
-			(cfgRemote.cfgNvRam.ipMacAddress[1] == cfgNvRam.ipMacAddress[1]) &&
-			(cfgRemote.cfgNvRam.ipMacAddress[2] == cfgNvRam.ipMacAddress[2]) &&
-			(cfgRemote.cfgNvRam.ipMacAddress[3] == cfgNvRam.ipMacAddress[3]) &&
-			(cfgRemote.cfgNvRam.ipMacAddress[4] == cfgNvRam.ipMacAddress[4]) &&
-			(cfgRemote.cfgNvRam.ipMacAddress[5] == cfgNvRam.ipMacAddress[5]))
+	if (pi == NULL)
+	{
+		memset(&none, 0, sizeof(none));
+		pi = &none;
+	}
+	for (i = 0; i < cfgReplyCount; i++)
+	{
+		if (cfgReplyTo[i].sin_addr.s_addr == to->sin_addr.s_addr &&
+			cfgReplyTo[i].sin_port == to->sin_port &&
+			cfgReplyPi[i].ipi_ifindex == pi->ipi_ifindex &&
+			cfgReplyPi[i].ipi_spec_dst.s_addr == pi->ipi_spec_dst.s_addr &&
+			cfgReplyLen[i] == len && !memcmp(&cfgReplyBuf[i], reply, len))
+			return;
+	}
+	if (cfgReplyCount == CFG_RECV_BATCH)
+		cfgReplyFlush();
+
+	memcpy(&cfgReplyBuf[cfgReplyCount], reply, len);
+	cfgReplyLen[cfgReplyCount] = len;
+	memcpy(&cfgReplyTo[cfgReplyCount], to, sizeof(*to));
+	memset(&cfgReplyPi[cfgReplyCount], 0, sizeof(cfgReplyPi[0]));
+	cfgReplyPi[cfgReplyCount].ipi_ifindex = pi->ipi_ifindex;
+	cfgReplyPi[cfgReplyCount].ipi_spec_dst = pi->ipi_spec_dst;
+	cfgReplyCount++;
+}
+
+#ifdef IFWLAN
+/* Reply path out of one of our LANs, NULL if it is down. */
+static struct in_pktinfo *cfgIfPktinfo(char *ifname, struct in_pktinfo *pi)
+{
+	struct in_addr mask;
+	unsigned char mac[6];
+
+	memset(pi, 0, sizeof(*pi));
+	pi->ipi_ifindex = netcache_get_index(ifname);
+	if (pi->ipi_ifindex == 0)
+		return NULL;
+	netcache_get_if(ifname, &pi->ipi_spec_dst, &mask, mac);
+	return pi;
+}
+#endif
+
+static void cfgDelayedFire(struct uloop_timeout *t)
+{
+	cfg_delayed_t *d = (cfg_delayed_t *)((char *)t - offsetof(cfg_delayed_t, timer));
+
+	d->used = 0;
+	cfgReplyQueue(&d->reply, d->len, &d->to, d->pi.ipi_ifindex ? &d->pi : NULL);
+	cfgReplyFlush();
+}
+
+static UINT32 cfgNowMs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Announce ourselves unasked with what a GETCONFIG would get. IFWLAN
+ * builds send each LAN's settings out of its own interface, as there.
+ */
+static void cfgBeaconSend(struct uloop_timeout *t)
+{
+	REMOTE_CFG_STRUCT beacon;
+	UINT32 next;
+#ifdef IFWLAN
+	struct in_pktinfo pi;
+#endif
+
+	if (cfgBeaconPeriod == 0)
+		return;
+	next = cfgBeaconPeriod * 1000;
+	if (cfgBeaconJitter)
+		next += rand_r(&cfgBeaconSeed) % (cfgBeaconJitter * 1000);
+	uloop_timeout_set(t, next);
+
+	memcpy(&beacon, &cfgReply, sizeof(beacon));
+#ifdef IFWLAN
+	memcpy(&beacon.cfgNvRam, &cfgNvRam, sizeof(cfgNvRam));
+	cfgReplyQueue(&beacon, sizeof(beacon), &cfgBeaconTo, cfgIfPktinfo(EIPIFNAME, &pi));
+	memcpy(&beacon.cfgNvRam, &cfgNvRam_w, sizeof(cfgNvRam_w));
+	cfgReplyQueue(&beacon, sizeof(beacon), &cfgBeaconTo, cfgIfPktinfo(WIPIFNAME, &pi));
+#else
+	cfgReplyQueue(&beacon, sizeof(beacon), &cfgBeaconTo, NULL);
+#endif
+	cfgReplyFlush();
+}
+
+/* Non-zero if this probe already came from the same source in the window. */
+static int cfgDupSeen(struct sockaddr_in *from, UINT32 msg, UINT32 nonce)
+{
+	cfg_dup_t *d, *victim = NULL;
+	UINT32 now, h, age, oldest = 0;
+	int i;
+
+	if (cfgDupWindow == 0)
+		return 0;
+
+	now = cfgNowMs();
+	h = 2166136261U;
+	h = (h ^ from->sin_addr.s_addr) * 16777619U;
+	h = (h ^ from->sin_port) * 16777619U;
+	h = (h ^ msg) * 16777619U;
+	h = (h ^ nonce) * 16777619U;
+
+	for (i = 0; i < CFG_DUP_PROBE; i++)
+	{
+		d = &cfgDup[(h + i) & (CFG_DUP_SLOTS - 1)];
+		age = d->msg ? now - d->seen : 0xffffffffU;
+		if (age < cfgDupWindow && d->addr == from->sin_addr.s_addr &&
+			d->port == from->sin_port && d->msg == msg && d->nonce == nonce)
+			return 1;
+		/* an empty or expired slot first, else the stalest */
+		if (victim == NULL || age > oldest)
 		{
-			if(DEBUG_TRACE ) printf("eth0 UNICAST, ");
-			selecteth = FLAG_ELAN;
+			victim = d;
+			oldest = age;
 		}
+	}
+
+	victim->addr = from->sin_addr.s_addr;
+	victim->port = from->sin_port;
+	victim->msg = msg;
+	victim->nonce = nonce;
+	victim->seen = now;
+	return 0;
+}
+
+/* Is (mac, cfgGeneration) in the probe's bloom filter? */
+static int cfgBloomHas(CFG_PROBE_STRUCT *probe, UINT8 *mac)
+{
+	UINT8 *gen = (UINT8 *)&cfgGeneration;
+	UINT32 h = 2166136261U, step, bit;
+	int i;
+
+	for (i = 0; i < 6; i++)
+		h = (h ^ mac[i]) * 16777619U;
+	for (i = 0; i < (int)sizeof(cfgGeneration); i++)
+		h = (h ^ gen[i]) * 16777619U;
+
+	step = (h >> 17 | h << 15) | 1;
+	for (i = 0; i < PROBE_BLOOM_K; i++) {
+		bit = (h + i * step) % PROBE_BLOOM_BITS;
+		if (!(probe->bloom[bit / 8] & (1 << (bit % 8))))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * A requester that already holds our current generation doesn't need the
+ * reply: a directed probe names the generation it has, a broadcast one
+ * lists what it has in a bloom filter. A false positive only delays an
+ * update until the requester's next plain probe.
+ */
+static int cfgProbeCurrent(CFG_PROBE_STRUCT *probe)
+{
+	if (selecteth != FLAG_BROA)
+		return probe->generation == cfgGeneration;
+
+	if (cfgBloomHas(probe, cfgNvRam.ipMacAddress))
+		return 1;
 #ifdef IFWLAN
-		else if ((cfgRemote.cfgNvRam.ipMacAddress[0] == cfgNvRam_w.ipMacAddress[0]) &&
-			(cfgRemote.cfgNvRam.ipMacAddress[1] == cfgNvRam_w.ipMacAddress[1]) &&
-			(cfgRemote.cfgNvRam.ipMacAddress[2] == cfgNvRam_w.ipMacAddress[2]) &&
-			(cfgRemote.cfgNvRam.ipMacAddress[3] == cfgNvRam_w.ipMacAddress[3]) &&
-			(cfgRemote.cfgNvRam.ipMacAddress[4] == cfgNvRam_w.ipMacAddress[4]) &&
-			(cfgRemote.cfgNvRam.ipMacAddress[5] == cfgNvRam_w.ipMacAddress[5]))
+	if (cfgBloomHas(probe, cfgNvRam_w.ipMacAddress))
+		return 1;
+#endif
+	return 0;
+}
+
+/*
+ * Send a reply after our slot in a window of window ms. Without a window,
+ * or with every slot busy, it goes out with the batch. A copy already
+ * waiting on the same path covers a repeated probe.
+ */
+static void cfgReplyJitter(void *reply, int len, struct sockaddr_in *to, struct in_pktinfo *pi, UINT32 window)
+{
+	cfg_delayed_t *d, *free_d = NULL;
+	UINT32 delay;
+	int ifindex = pi ? pi->ipi_ifindex : 0;
+	int i;
+
+	if (window > PROBE_WINDOW_MAX)
+		window = PROBE_WINDOW_MAX;
+	delay = window ? cfgMacHash % window : 0;
+	if (delay == 0)
+	{
+		cfgReplyQueue(reply, len, to, pi);
+		return;
+	}
+
+	for (i = 0; i < CFG_DELAY_MAX; i++)
+	{
+		d = &cfgDelayed[i];
+		if (!d->used)
 		{
-			if(DEBUG_TRACE ) printf("eth1 UNICAST, ");
-			selecteth = FLAG_WLAN;
+			if (free_d == NULL)
+				free_d = d;
+			continue;
 		}
+		if (d->to.sin_addr.s_addr == to->sin_addr.s_addr && d->to.sin_port == to->sin_port &&
+			d->pi.ipi_ifindex == ifindex && d->len == len && !memcmp(&d->reply, reply, len))
+			return;
+	}
+	if (free_d == NULL)
+	{
+		cfgReplyQueue(reply, len, to, pi);
+		return;
+	}
+
+	d = free_d;
+	d->used = 1;
+	memcpy(&d->reply, reply, len);
+	d->len = len;
+	memcpy(&d->to, to, sizeof(*to));
+	memset(&d->pi, 0, sizeof(d->pi));
+	if (pi)
+	{
+		d->pi.ipi_ifindex = pi->ipi_ifindex;
+		d->pi.ipi_spec_dst = pi->ipi_spec_dst;
+	}
+	d->timer.cb = cfgDelayedFireCb;
+	uloop_timeout_set(&d->timer, delay);
+}
+
+/* Our slot in the bulk window came: acknowledge, then take the entry. */
+static void cfgBulkFire(struct uloop_timeout *t)
+{
+	REMOTE_CFG_STRUCT ack;
+	struct sockaddr_in saTo;
+#ifdef IFWLAN
+	struct in_pktinfo pi;
 #endif
-		else if ((cfgRemote.cfgNvRam.ipMacAddress[0] == 0xff) &&
-			(cfgRemote.cfgNvRam.ipMacAddress[1] == 0xff) &&
-			(cfgRemote.cfgNvRam.ipMacAddress[2] == 0xff) &&
-			(cfgRemote.cfgNvRam.ipMacAddress[3] == 0xff) &&
-			(cfgRemote.cfgNvRam.ipMacAddress[4] == 0xff) &&
-			(cfgRemote.cfgNvRam.ipMacAddress[5] == 0xff))
+
+	memset(&ack, 0, sizeof(ack));
+	ack.msg = RCFG_SETCONFIGOK;
+	ack.version = FW_VERSION;
+	memcpy(&ack.cfgNvRam, &cfgBulkCfg, sizeof(cfgBulkCfg));
+
+	memset(&saTo, 0, sizeof(saTo));
+	saTo.sin_family = AF_INET;
+	saTo.sin_addr.s_addr = INADDR_BROADCAST;
+	saTo.sin_port = htons(DEFAULT_CONFIG_PORT);
+#ifdef IFWLAN
+	cfgReplyQueue(&ack, sizeof(ack), &saTo, cfgIfPktinfo(EIPIFNAME, &pi));
+#else
+	cfgReplyQueue(&ack, sizeof(ack), &saTo, NULL);
+#endif
+	cfgReplyFlush();
+
+	cfgApplyConfig(&cfgBulkCfg);
+}
+
+/*
+ * Look for our wired MAC in a bulk table and schedule its entry. A later
+ * table replaces one still waiting for its slot.
+ */
+static void cfgBulkConfig(CFG_BULK_STRUCT *bulk, int len, struct sockaddr_in *saFrom)
+{
+	CFG_BULK_ENTRY *e = NULL;
+	UINT32 window;
+	int lo = 0, hi, mid = 0, c;
+
+	if (bulk->sig != CFG_SIG || cfgNvRam.sig != CFG_SIG ||
+		bulk->count > CFG_BULK_MAX || len < (int)CFG_BULK_LEN(bulk->count))
+		return;
+	if (cfgDupSeen(saFrom, bulk->msg, bulk->nonce))
+		return;
+
+	hi = bulk->count;
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		c = memcmp(bulk->entry[mid].ipMacAddress, cfgNvRam.ipMacAddress, 6);
+		if (c == 0)
 		{
-			if(DEBUG_TRACE ) printf("BROADCAST, ");
-			selecteth = FLAG_BROA;
-		}else{
-			if(DEBUG_TRACE ) printf("2 Configuration message from %s\n", strIP);
-				continue;
+			e = &bulk->entry[mid];
+			break;
 		}
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (e == NULL)
+		return;
 
-		switch (cfgRemote.msg)
-		{
-		case RCFG_GETCONFIG:
-#ifdef  DEBUG_TRACE
-			printf("RCFG_GETCONFIG\n");
+	memcpy(&cfgBulkCfg, &cfgNvRam, sizeof(cfgNvRam));
+	if (e->ipAddress)
+		cfgBulkCfg.ipAddress = e->ipAddress;
+	else
+		cfgBulkCfg.ipAddress = bulk->ipBase ? htonl(ntohl(bulk->ipBase) + bulk->first + mid) : 0;
+	cfgBulkCfg.ipMask = e->ipMask ? e->ipMask : bulk->ipMask;
+	cfgBulkCfg.ipGateway = e->ipGateway ? e->ipGateway : bulk->ipGateway;
+	if (cfgBulkCfg.ipAddress == 0 || cfgBulkCfg.ipMask == 0 ||
+		(cfgBulkCfg.ipAddress & cfgBulkCfg.ipMask) != (cfgBulkCfg.ipGateway & cfgBulkCfg.ipMask))
+	{
+		printf("bulk entry %d invalid\n", bulk->first + mid);
+		return;
+	}
+
+	window = bulk->window < CFG_BULK_WINDOW_MAX ? bulk->window : CFG_BULK_WINDOW_MAX;
+	cfgBulkTimer.cb = cfgBulkFireCb;
+	uloop_timeout_set(&cfgBulkTimer, window ? cfgMacHash % window : 0);
+}
+
+/*
+ * Answer a GETSTATS at once, they are rare and don't fit the reply batch.
+ * The reply is several times the request and goes to an address nobody
+ * checked, so one per CFG_STATS_GAP is all anyone gets; a real client
+ * asks again.
+ */
+static void cfgStatsReply(CFG_STATS_STRUCT *req, struct sockaddr_in *saFrom)
+{
+	static CFG_STATS_REPLY reply;
+	UINT32 now;
+	size_t len;
+
+	now = cfgNowMs();
+	if (cfgStatsSent && now - cfgStatsLast < CFG_STATS_GAP)
+	{
+		printf("stats request dropped, too soon\n");
+		return;
+	}
+	cfgStatsSent = 1;
+	cfgStatsLast = now;
+
+	memset(&reply, 0, offsetof(CFG_STATS_REPLY, rec));
+	reply.msg = RCFG_GETSTATSOK;
+	reply.version = FW_VERSION;
+	memcpy(reply.ipMacAddress, req->ipMacAddress, sizeof(reply.ipMacAddress));
+	sampler_header(&reply.hdr);
+	reply.count = sampler_read(req->from, reply.rec, STATS_REPLY_MAX, &reply.first);
+
+	len = offsetof(CFG_STATS_REPLY, rec) + reply.count * sizeof(reply.rec[0]);
+	if (sendto(sConfig, &reply, len, 0, (struct sockaddr *)saFrom, sizeof(*saFrom)) < 0)
+		printf("stats reply: %s\n", strerror(errno));
+}
+
+/*
+ * Handle one request datagram. Replies go out on sConfig, which stays
+ * open for the life of the daemon, through the interface the request
+ * came in on unless a LAN is picked explicitly.
+ */
+static void cfgProcessMsg(REMOTE_CFG_STRUCT *cfgRemote, struct sockaddr_in *saFrom, struct in_pktinfo *ingress)
+{
+	char strIP[32];
+	struct sockaddr_in saTo;
+	CFG_REPLY_V4 reply;
+	UINT32 window;
+	int len;
+	char *p;
+#ifdef IFWLAN
+	struct in_pktinfo pi;
+#endif
+
+	/* Verify version. */
+	if ((cfgRemote->cfgNvRam.sig != CFG_SIG) || (cfgNvRam.sig != CFG_SIG))
+	{
+#ifdef DEBUG_TRACE
+		printf("Invalid message\n");
+		printf("cfgRemotesig : %08x\n",cfgRemote->cfgNvRam.sig);
+		printf("cfgRemotesig : %08x\n",cfgNvRam.sig);           
+		printf("CFG_SIG      : %08x\n",CFG_SIG);            
+		p = &cfgRemote->cfgNvRam.sig;
+		printf("%c %c %c %c\n",p[0],p[1],p[2],p[3]);
+#endif
+		return;
+	}
+
+	 p = inet_ntoa(saFrom->sin_addr);
+	 strcpy(strIP,p);
+#ifdef DEBUG_TRACE
+	printf("1 Configuration message from %s\n", strIP);
 #endif  /* DEBUG_TRACE */
 
-			cfgRemote.msg = RCFG_GETCONFIGOK;
-			cfgRemote.version = FW_VERSION;
-
-			cfgGetData();
-			if( GetGwIf() == LANTYPE_ELAN )
-				memcpy((void *)&cfgRemote.cfgNvRam, (void *)&cfgNvRam, sizeof(cfgNvRam));
-			else
-				memcpy((void *)&cfgRemote.cfgNvRam, (void *)&cfgNvRam_w, sizeof(cfgNvRam_w));               
-
-			memset((char *)&saTo, 0, sizeof(saTo));
-
-			/* Build acknowledgement. */
-			saTo.sin_family = AF_INET;
-			saTo.sin_addr.s_addr = INADDR_BROADCAST;
-			saTo.sin_port = htons(DEFAULT_CONFIG_PORT);
-
-			/* Send acknowledgement. */
-			printf("sConfig is %d ,, saTo is %x \n", sConfig, &saTo);
-			err = sendto(sConfig, (char *)&cfgRemote, sizeof(cfgRemote), 0, (struct sockaddr *)&saTo, sizeof(saTo));
-			if (err != sizeof(cfgRemote))
-			{
-				printf("1 ERROR on sendto(), %d\n", err);
-				perror("send error");
-			}
+	/* If not broadcast or addressed to us, discard message. */
+	if ((cfgRemote->cfgNvRam.ipMacAddress[0] == cfgNvRam.ipMacAddress[0]) &&
+		(cfgRemote->cfgNvRam.ipMacAddress[1] == cfgNvRam.ipMacAddress[1]) &&
+		(cfgRemote->cfgNvRam.ipMacAddress[2] == cfgNvRam.ipMacAddress[2]) &&
+		(cfgRemote->cfgNvRam.ipMacAddress[3] == cfgNvRam.ipMacAddress[3]) &&
+		(cfgRemote->cfgNvRam.ipMacAddress[4] == cfgNvRam.ipMacAddress[4]) &&
+		(cfgRemote->cfgNvRam.ipMacAddress[5] == cfgNvRam.ipMacAddress[5]))
+	{
+		if(DEBUG_TRACE ) printf("eth0 UNICAST, ");
+		selecteth = FLAG_ELAN;
+	}
 #ifdef IFWLAN
-			//system("route del default");
-			system("route del 255.255.255.255 1>/dev/null 2>/dev/null");
-
-			if( GetGwIf() == LANTYPE_ELAN ){
-				GetGw(LANTYPE_WLAN,strGW);
-				//sprintf(buf,"route add default gw %s",strGW);
-				sprintf(buf,"route add 255.255.255.255 gw %s",strGW);
-				memcpy((void *)&cfgRemote.cfgNvRam, (void *)&cfgNvRam_w, sizeof(cfgNvRam_w));
-			} else {
-				GetGw(LANTYPE_ELAN,strGW);
-				//sprintf(buf,"route add default gw %s",strGW);
-				sprintf(buf,"route add 255.255.255.255 gw %s",strGW);
-				memcpy((void *)&cfgRemote.cfgNvRam, (void *)&cfgNvRam, sizeof(cfgNvRam));               
-			}
-			system(buf);
-
-			memset(&saTo, 0, sizeof(saTo));
-
-			/* Build acknowledgement. */
-			saTo.sin_family         = AF_INET;
-			saTo.sin_addr.s_addr    = INADDR_BROADCAST;
-			saTo.sin_port           = htons(DEFAULT_CONFIG_PORT);
-			sleep(2);
-			err = sendto(sConfig, (char *)&cfgRemote, sizeof(cfgRemote), 0, (struct sockaddr *)&saTo, sizeof(saTo));
-			if (err != sizeof(cfgRemote))
-			{
-				printf("2 ERROR on sendto(), %d\n", err);
-				perror("send error");
-			}
-			//system("route del default");
-			system("route del 255.255.255.255");
-			//sprintf(buf,"route add default gw %s",GateWay);
-			//system(buf);
+	else if ((cfgRemote->cfgNvRam.ipMacAddress[0] == cfgNvRam_w.ipMacAddress[0]) &&
+		(cfgRemote->cfgNvRam.ipMacAddress[1] == cfgNvRam_w.ipMacAddress[1]) &&
+		(cfgRemote->cfgNvRam.ipMacAddress[2] == cfgNvRam_w.ipMacAddress[2]) &&
+		(cfgRemote->cfgNvRam.ipMacAddress[3] == cfgNvRam_w.ipMacAddress[3]) &&
+		(cfgRemote->cfgNvRam.ipMacAddress[4] == cfgNvRam_w.ipMacAddress[4]) &&
+		(cfgRemote->cfgNvRam.ipMacAddress[5] == cfgNvRam_w.ipMacAddress[5]))
+	{
+		if(DEBUG_TRACE ) printf("eth1 UNICAST, ");
+		selecteth = FLAG_WLAN;
+	}
 #endif
-			break;
+	else if ((cfgRemote->cfgNvRam.ipMacAddress[0] == 0xff) &&
+		(cfgRemote->cfgNvRam.ipMacAddress[1] == 0xff) &&
+		(cfgRemote->cfgNvRam.ipMacAddress[2] == 0xff) &&
+		(cfgRemote->cfgNvRam.ipMacAddress[3] == 0xff) &&
+		(cfgRemote->cfgNvRam.ipMacAddress[4] == 0xff) &&
+		(cfgRemote->cfgNvRam.ipMacAddress[5] == 0xff))
+	{
+		if(DEBUG_TRACE ) printf("BROADCAST, ");
+		selecteth = FLAG_BROA;
+	}else{
+		if(DEBUG_TRACE ) printf("2 Configuration message from %s\n", strIP);
+			return;
+	}
 
-		case RCFG_SETCONFIG:
+	switch (cfgRemote->msg)
+	{
+	case RCFG_GETCONFIG:
 #ifdef  DEBUG_TRACE
-			printf("RCFG_SETCONFIG\n");
+		printf("RCFG_GETCONFIG\n");
 #endif  /* DEBUG_TRACE */
 
-			if( (cfgRemote.cfgNvRam.ipAddress & cfgRemote.cfgNvRam.ipMask) != (cfgRemote.cfgNvRam.ipGateway & cfgRemote.cfgNvRam.ipMask) ){
-				printf("ip gw mismatch\n");
-				break;
-			}
-
-			cfgRemote.msg = RCFG_SETCONFIGOK;
+		if (cfgDupSeen(saFrom, cfgRemote->msg, ((CFG_PROBE_STRUCT *)&cfgRemote->cfgNvRam)->nonce))
+			break;
+		if (cfgProbeCurrent((CFG_PROBE_STRUCT *)&cfgRemote->cfgNvRam))
+			break;
+		window = ((CFG_PROBE_STRUCT *)&cfgRemote->cfgNvRam)->window;
+		len = cfgBuildReplyV4(&reply, cfgRemote->version);
 
-			memcpy((void *)&cfgNvRam, (void *)&cfgRemote.cfgNvRam, sizeof(cfgNvRam));
+		memset((char *)&saTo, 0, sizeof(saTo));
 
-			memset(&saTo, 0, sizeof(saTo));
+		/* Build acknowledgement. */
+		saTo.sin_family = AF_INET;
+		saTo.sin_addr.s_addr = INADDR_BROADCAST;
+		saTo.sin_port = htons(DEFAULT_CONFIG_PORT);
 
-			/* Build acknowledgement. */
-			saTo.sin_family = AF_INET;
-			saTo.sin_addr.s_addr = INADDR_BROADCAST;
-			saTo.sin_port = htons(DEFAULT_CONFIG_PORT);
+		/* Send acknowledgement. */
 #ifdef IFWLAN
-			if( selecteth == FLAG_ELAN && (GetGwIf() == LANTYPE_WLAN)){
-				//system("route del default");
-				system("route del 255.255.255.255 1>/dev/null 2>/dev/null");
-				GetGw(LANTYPE_ELAN,strGW);
-				//sprintf(buf,"route add default gw %s",strGW);
-				sprintf(buf,"route add 255.255.255.255 gw %s",strGW);
-				system(buf);
-			} else if( selecteth == FLAG_WLAN && (GetGwIf() == LANTYPE_ELAN)){
-				//system("route del default");
-				system("route del 255.255.255.255 1>/dev/null 2>/dev/null");
-				GetGw(LANTYPE_WLAN,strGW);
-				//sprintf(buf,"route add default gw %s",strGW);
-				sprintf(buf,"route add 255.255.255.255 gw %s",strGW);
-				system(buf);
-			}
-#endif          
-			/* Send acknowledgement. */
-			err = sendto(sConfig, (char *)&cfgRemote, sizeof(cfgRemote), 0, (struct sockaddr *)&saTo, sizeof(saTo));
-			if (err != sizeof(cfgRemote))
-			{
-				printf("3 ERROR on sendto(), %d\n", err);
-			}
-
-			
-#ifdef IFWLAN           
-			if( selecteth == FLAG_ELAN && (GetGwIf() == LANTYPE_WLAN)){
-				//system("route del default");
-				system("route del 255.255.255.255");
-				//sprintf(buf,"route add default gw %s",GateWay);
-				//system(buf);
-			} else if( selecteth == FLAG_WLAN && (GetGwIf() == LANTYPE_ELAN)){
-				//system("route del default");
-				system("route del 255.255.255.255");
-				//sprintf(buf,"route add default gw %s",GateWay);
-				//system(buf);
-			}
+		/* Each LAN gets its own settings, out of its own interface. */
+		if( GetGwIf() == LANTYPE_ELAN ){
+			cfgReplyJitter(&reply, len, &saTo, cfgIfPktinfo(EIPIFNAME, &pi), window);
+			memcpy((void *)&reply.cfg.cfgNvRam, (void *)&cfgNvRam_w, sizeof(cfgNvRam_w));
+			cfgReplyJitter(&reply, len, &saTo, cfgIfPktinfo(WIPIFNAME, &pi), window);
+		} else {
+			cfgReplyJitter(&reply, len, &saTo, cfgIfPktinfo(WIPIFNAME, &pi), window);
+			memcpy((void *)&reply.cfg.cfgNvRam, (void *)&cfgNvRam, sizeof(cfgNvRam));
+			cfgReplyJitter(&reply, len, &saTo, cfgIfPktinfo(EIPIFNAME, &pi), window);
+		}
+#else
+		/*
+		 * A requester on one of our subnets gets the reply alone. One that
+		 * isn't, typically because our address is wrong, still needs the
+		 * broadcast to find and fix us.
+		 */
+		if (saFrom->sin_addr.s_addr != INADDR_ANY && netcache_on_link(saFrom->sin_addr))
+			saTo.sin_addr = saFrom->sin_addr;
+		cfgReplyJitter(&reply, len, &saTo, ingress, window);
 #endif
+		break;
 
-			cfgSetDataAll(&cfgNvRam);
-			system("/etc/init.d/network restart");
-			break;
-			
-		case RCFG_SETDEFAULT:
-			printf("RCFG_SETDEFAULT\n");            
-			memset((char *)&cfgNvRam, 0xff, sizeof(cfgNvRam));
-			cfgSetDefault(&cfgNvRam);
-
-			/* Preserve the MAC address. */
-			//            bcopy((char *)sysFecEnetAddr, (char *)cfgNvRam.ipMacAddress, 6);
-
-			/* Save configuration. */
-			//            cfgSetNvRam();
-			system("/sbin/reboot");
-			//            reboot(BOOT_CLEAR);
+	case RCFG_SETCONFIG:
+#ifdef  DEBUG_TRACE
+		printf("RCFG_SETCONFIG\n");
+#endif  /* DEBUG_TRACE */
+
+		if( (cfgRemote->cfgNvRam.ipAddress & cfgRemote->cfgNvRam.ipMask) != (cfgRemote->cfgNvRam.ipGateway & cfgRemote->cfgNvRam.ipMask) ){
+			printf("ip gw mismatch\n");
 			break;
+		}
+
+		cfgRemote->msg = RCFG_SETCONFIGOK;
 
-		case RCFG_UPGRADE:
+		memset(&saTo, 0, sizeof(saTo));
+
+		/* Build acknowledgement. */
+		saTo.sin_family = AF_INET;
+		saTo.sin_addr.s_addr = INADDR_BROADCAST;
+		saTo.sin_port = htons(DEFAULT_CONFIG_PORT);
+		/* Send acknowledgement, before the network goes down. */
+#ifdef IFWLAN
+		/* on the LAN whose MAC the request named */
+		if( selecteth == FLAG_ELAN )
+			cfgReplyQueue(cfgRemote, sizeof(*cfgRemote), &saTo, cfgIfPktinfo(EIPIFNAME, &pi));
+		else if( selecteth == FLAG_WLAN )
+			cfgReplyQueue(cfgRemote, sizeof(*cfgRemote), &saTo, cfgIfPktinfo(WIPIFNAME, &pi));
+		else
+#endif
+		cfgReplyQueue(cfgRemote, sizeof(*cfgRemote), &saTo, ingress);
+		cfgReplyFlush();
+
+		cfgApplyConfig(&cfgRemote->cfgNvRam);
+		break;
+		
+	case RCFG_SETDEFAULT:
+		printf("RCFG_SETDEFAULT\n");            
+		memset((char *)&cfgNvRam, 0xff, sizeof(cfgNvRam));
+		cfgSetDefault(&cfgNvRam);
+
+		/* Preserve the MAC address. */
+		//            bcopy((char *)sysFecEnetAddr, (char *)cfgNvRam.ipMacAddress, 6);
+
+		/* Save configuration. */
+		//            cfgSetNvRam();
+		system("/sbin/reboot");
+		//            reboot(BOOT_CLEAR);
+		break;
+
+	case RCFG_UPGRADE:
 #ifdef  DEBUG_TRACE
-			printf("RCFG_UPGRADE\n");
+		printf("RCFG_UPGRADE\n");
 #endif  /* DEBUG_TRACE */
-			cfgGetInfo();
-			cfgRemote.msg = RCFG_UPGRADEOK;
-
-			memset(&saTo, 0, sizeof(saTo));
-
-			/* Build acknowledgement. */
-			saTo.sin_family         = AF_INET;
-			saTo.sin_addr.s_addr    = INADDR_BROADCAST;
-			saTo.sin_port           = htons(DEFAULT_CONFIG_PORT);
-
-			/* Send acknowledgement. */
-			err = sendto(sConfig, (char *)&cfgRemote, sizeof(cfgRemote), 0, (struct sockaddr *)&saTo, sizeof(saTo));
-			if (err != sizeof(cfgRemote))
-			{
-				printf("4 ERROR on sendto(), %d\n", err);
-			}
-			break;
+		cfgGetInfo();
+		cfgRemote->msg = RCFG_UPGRADEOK;
+
+		memset(&saTo, 0, sizeof(saTo));
 
-		case RCFG_REBOOT:
+		/* Build acknowledgement. */
+		saTo.sin_family         = AF_INET;
+		saTo.sin_addr.s_addr    = INADDR_BROADCAST;
+		saTo.sin_port           = htons(DEFAULT_CONFIG_PORT);
+
+		/* Send acknowledgement. */
+		cfgReplyQueue(cfgRemote, sizeof(*cfgRemote), &saTo, ingress);
+		break;
+
+	case RCFG_GETSTATS:
 #ifdef  DEBUG_TRACE
-			printf("RCFG_REBOOT\n");
+		printf("RCFG_GETSTATS\n");
 #endif  /* DEBUG_TRACE */
-			system("/sbin/reboot");
-			//            reboot(BOOT_CLEAR);
-			break;
-		default:
+		/* a broadcast would make every camera answer with a full datagram */
+		if (selecteth == FLAG_BROA)
 			break;
+		cfgStatsReply((CFG_STATS_STRUCT *)&cfgRemote->cfgNvRam, saFrom);
+		break;
+
+	case RCFG_REBOOT:
+#ifdef  DEBUG_TRACE
+		printf("RCFG_REBOOT\n");
+#endif  /* DEBUG_TRACE */
+		system("/sbin/reboot");
+		//            reboot(BOOT_CLEAR);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Drain up to CFG_RECV_BATCH requests with one recvmmsg, handle them and
+ * send every queued reply with one sendmmsg.
+ */
+static void cfgSockRead(struct uloop_fd *u_fd, unsigned int events)
+{
+	struct in_pktinfo *ingress;
+	struct cmsghdr *cmsg;
+	int len;
+	int n;
+	int i;
+
+	for (i = 0; i < CFG_RECV_BATCH; i++)
+	{
+		cfgRecvIov[i].iov_base = &cfgRecvBuf[i];
+		cfgRecvIov[i].iov_len = sizeof(cfgRecvBuf[i]);
+		memset(&cfgRecvMsg[i], 0, sizeof(cfgRecvMsg[i]));
+		cfgRecvMsg[i].msg_hdr.msg_iov = &cfgRecvIov[i];
+		cfgRecvMsg[i].msg_hdr.msg_iovlen = 1;
+		cfgRecvMsg[i].msg_hdr.msg_name = &cfgRecvFrom[i];
+		cfgRecvMsg[i].msg_hdr.msg_namelen = sizeof(cfgRecvFrom[i]);
+		cfgRecvMsg[i].msg_hdr.msg_control = cfgRecvCtl[i];
+		cfgRecvMsg[i].msg_hdr.msg_controllen = sizeof(cfgRecvCtl[i]);
+	}
+
+	/* Receive configuration requests. */
+	n = recvmmsg(u_fd->fd, cfgRecvMsg, CFG_RECV_BATCH, MSG_DONTWAIT, NULL);
+	if (n < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return;
+		printf("CFGSOCK: ERROR on recvmmsg(), %d\n", errno);
+		cfgSockRebind();
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		len = cfgRecvMsg[i].msg_len;
+		if (len >= (int)CFG_BULK_LEN(0) && cfgRecvBuf[i].bulk.msg == RCFG_BULKCONFIG)
+		{
+			cfgBulkConfig(&cfgRecvBuf[i].bulk, len, &cfgRecvFrom[i]);
+			continue;
 		}
+		/* a longer one is a reply with extensions, the fixed part is ours */
+		if (len < (int)sizeof(REMOTE_CFG_STRUCT))
+		{
+			printf("CFGSOCK: short datagram %d\n", len);
+			continue;
+		}
+		ingress = NULL;
+		for (cmsg = CMSG_FIRSTHDR(&cfgRecvMsg[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&cfgRecvMsg[i].msg_hdr, cmsg))
+		{
+			if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO)
+				ingress = (struct in_pktinfo *)CMSG_DATA(cmsg);
+		}
+		cfgProcessMsg(&cfgRecvBuf[i].cfg, &cfgRecvFrom[i], ingress);
 	}
+	cfgReplyFlush();
 }
 
-int main(int argc, char *argv[])
+/*
+ * Link and address changes are the only time the discovery socket is
+ * rebound. Any change the reply depends on rebuilds it here, so a probe
+ * never waits for the kernel.
+ */
+static void cfgNetChanged(int what)
+{
+	cfgBuildReply();
+	if (what & (NC_CHANGE_LINK | NC_CHANGE_ADDR))
+		cfgSockRebind();
+}
+
+/* uci packages cfgLoadPorts reads */
+static char *cfgUciWatch[] = { "uhttpd", "media", "jpeg_send", "rtsp", "nexpa", "" };
+
+static void uciWatchRead(struct uloop_fd *u_fd, unsigned int events)
 {
+	char buf[1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	int changed = 0;
+	int own = 0;
+	int len;
+	int off;
+	int i;
+
+	while ((len = read(u_fd->fd, buf, sizeof(buf))) > 0)
+	{
+		for (off = 0; off < len; off += sizeof(*ev) + ev->len)
+		{
+			ev = (struct inotify_event *)(buf + off);
+			if (ev->len == 0)
+				continue;
+			if (!strcmp(ev->name, "ipinstall"))
+				own = 1;
+			for (i = 0; cfgUciWatch[i][0]; i++)
+				if (!strcmp(ev->name, cfgUciWatch[i]))
+					changed = 1;
+		}
+	}
+	if (changed)
+	{
+		cfgLoadPorts();
+		cfgBuildReply();
+	}
+	if (own)
+	{
+		cfgLoadDiscovery();
+		cfgLoadBeacon();
+		cfgLoadSampler();
+	}
+}
+
+/* uci commits by renaming a new file over the package */
+static void uciWatchCreate(void)
+{
+	int fd;
+
+	fd = inotify_init1(IN_NONBLOCK);
+	if (fd < 0)
+	{
+		printf("ERROR\n    Failed to create inotify\n");
+		return;
+	}
+	if (inotify_add_watch(fd, "/etc/config", IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+	{
+		printf("ERROR\n    Failed to watch /etc/config\n");
+		close(fd);
+		return;
+	}
+	uciUfd.cb = uciWatchReadCb;
+	uciUfd.fd = fd;
+	uloop_fd_add(&uciUfd, ULOOP_READ);
+}
+
+/*
+ * Start answering on the running uloop. model and serial feed the
+ * extended reply, NULL or empty leaves them out.
+ */
+int ipinstall_init(char *model, char *serial, int lp_site)
+{
+	ipiLpSite = lp_site;
+	snprintf(cfgModel, sizeof(cfgModel), "%s", model ? model : "");
+	snprintf(cfgSerialNo, sizeof(cfgSerialNo), "%s", serial ? serial : "");
+	cfgBuildTlv();
 	cfgGetInfo();
-	cfgGetData();
-	cfgDaemonTask();
+
+	if (netcache_init(cfgNetChanged) < 0)
+		printf("ERROR\n    interface cache incomplete\n");
+	uciWatchCreate();
+	cfgLoadPorts();
+	cfgBuildReply();
+	cfgLoadDiscovery();
+	cfgLoadBeacon();
+	cfgLoadSampler();
+
+	cfgSockRebind();
+	return sConfig == INVALID_SOCKET ? -1 : 0;
 }
+
+/* Take everything off the loop; a save in progress finishes on its own. */
+void ipinstall_done(void)
+{
+	int i;
+
+	uloop_timeout_cancel(&cfgBeaconTimer);
+	uloop_timeout_cancel(&cfgBulkTimer);
+	for (i = 0; i < CFG_DELAY_MAX; i++)
+	{
+		uloop_timeout_cancel(&cfgDelayed[i].timer);
+		cfgDelayed[i].used = 0;
+	}
+	uloop_process_delete(&cfgSaveProc);
+	uloop_process_delete(&cfgReloadProc);
+	cfgSockClose();
+	if (uciUfd.registered)
+	{
+		uloop_fd_delete(&uciUfd);
+		close(uciUfd.fd);
+	}
+	sampler_done();
+	netcache_done();
+	if (cfgCamPage)
+	{
+		munmap(cfgCamPage, sizeof(*cfgCamPage));
+		cfgCamPage = NULL;
+	}
+}
+
+#ifndef IPINSTALL_MODULE
+static void show_usage(char *s)
+{
+	printf("show usage %s\n",s);
+	return;
+}
+
+static void cfgDaemonTask(char *model, char *serial)
+{
+	uloop_init();
+	ipinstall_init(model, serial, 0);
+	uloop_run();
+	ipinstall_done();
+	uloop_done();
+}
+
+int main(int argc, char *argv[])
+{
+	char *model = NULL, *serial = NULL;
+	int c;
+
+	while ((c = getopt(argc, argv, "i:s:")) != -1)
+	{
+		switch (c)
+		{
+		case 'i':
+			model = optarg;
+			break;
+		case 's':
+			serial = optarg;
+			break;
+		default:
+			show_usage(argv[0]);
+			return 1;
+		}
+	}
+	cfgDaemonTask(model, serial);
+}
+#endif
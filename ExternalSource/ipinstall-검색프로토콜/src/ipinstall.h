@@ -15,6 +15,10 @@ This file contains Configuration related constants and structures.
 #ifndef __IPINSTALL_H
 #define __IPINSTALL_H
 
+#include <stddef.h>     /* for offsetof */
+
+#include "sampler.h"
+
 #define UCHAR	unsigned char
 #define UINT8	unsigned char
 #define UINT16	unsigned short
@@ -78,10 +82,187 @@ typedef struct {
 #define RCFG_UPGRADEFAIL                FOURCC('U','P','F','A')
 #define RCFG_REBOOT                     FOURCC('B','O','O','T')
 #define RCFG_SETDEFAULT                 FOURCC('S','D','E','F')
+#define RCFG_GETSTATS                   FOURCC('G','S','T','S')
+#define RCFG_GETSTATSOK                 FOURCC('G','S','O','K')
+#define RCFG_BULKCONFIG                 FOURCC('B','C','F','G')
     UINT32              version;
     CFG_NVRAM_STRUCT    cfgNvRam;
 } REMOTE_CFG_STRUCT;
 
+/*
+ * A camera that finds its MAC and current generation in a probe's bloom
+ * filter keeps quiet. Bit i of the k bits for a pair is
+ * (h + i * ((h >> 17 | h << 15) | 1)) % PROBE_BLOOM_BITS, where h is the
+ * FNV-1a of the 6 MAC bytes followed by the 4 generation bytes as they
+ * appear in the reply. An all-zero filter matches nothing.
+ */
+#define PROBE_BLOOM_BITS                512
+#define PROBE_BLOOM_K                   3
+
+/*
+ * GETCONFIG probe view of CFG_NVRAM_STRUCT. Older firmware only looks at
+ * ipMacAddress and sig in a probe and older tools send zeros everywhere
+ * else, so extensions live in that space and zero keeps the old meaning.
+ */
+
+typedef struct {
+    UINT8   ipMacAddress[6];            /* ff:ff:ff:ff:ff:ff or a target MAC */
+    UINT8   pad[2];
+    UINT32  window;                     /* ms to spread replies over, 0 = at once */
+    UINT32  generation;                 /* directed probe: generation last seen, 0 = none */
+    UINT8   bloom[PROBE_BLOOM_BITS / 8];    /* broadcast probe: (MAC, generation) pairs seen */
+    UINT32  nonce;                      /* new per scan, copies of one probe share it */
+    UINT32  reserved[2];                /* zero, up to sig */
+    UINT32  sig;                        /* CFG_SIG, same offset as in CFG_NVRAM_STRUCT */
+    UINT8   tail[sizeof(CFG_NVRAM_STRUCT) - 96];
+} CFG_PROBE_STRUCT;
+
+_Static_assert(sizeof(CFG_PROBE_STRUCT) == sizeof(CFG_NVRAM_STRUCT), "probe view size");
+_Static_assert(offsetof(CFG_PROBE_STRUCT, sig) == offsetof(CFG_NVRAM_STRUCT, sig), "probe view sig");
+
+#define PROBE_WINDOW_MAX                5000                /* ms, cap on window */
+
+/*
+ * GETCONFIG reply extension. A wired camera never fills key, so the reply
+ * carries its configuration generation there. The generation starts at a
+ * random value and moves on whenever the address, ports or name change;
+ * a controller only compares it for equality.
+ */
+typedef struct {
+    UINT32  sig;                        /* CFG_GEN_SIG when generation is valid */
+    UINT32  generation;                 /* never 0 */
+} CFG_REPLY_EXT;
+
+#define CFG_GEN_SIG                     FOURCC('C','G','E','N')
+#define CFG_REPLY_EXT(cfg)              ((CFG_REPLY_EXT *)(cfg)->key)
+
+_Static_assert(sizeof(CFG_REPLY_EXT) <= MAX_KEY, "reply extension size");
+
+/*
+ * GETSTATS request view, honoured only when addressed to our MAC. The
+ * answer is a CFG_STATS_REPLY sent back to the requester's own address
+ * and port, cut after the last record it holds.
+ */
+typedef struct {
+    UINT8   ipMacAddress[6];            /* target MAC */
+    UINT8   pad[2];
+    UINT32  from;                       /* first sample wanted, 0 = the newest */
+    UINT32  reserved[20];               /* zero, up to sig */
+    UINT32  sig;                        /* CFG_SIG */
+    UINT8   tail[sizeof(CFG_NVRAM_STRUCT) - 96];
+} CFG_STATS_STRUCT;
+
+_Static_assert(sizeof(CFG_STATS_STRUCT) == sizeof(CFG_NVRAM_STRUCT), "stats view size");
+_Static_assert(offsetof(CFG_STATS_STRUCT, sig) == offsetof(CFG_NVRAM_STRUCT, sig), "stats view sig");
+
+#define STATS_REPLY_MAX                 8                   /* records per datagram */
+
+typedef struct {
+    UINT32      msg;                    /* RCFG_GETSTATSOK */
+    UINT32      version;
+    UINT8       ipMacAddress[6];
+    UINT8       pad[2];
+    smp_hdr_t   hdr;                    /* all zero while the sampler is off */
+    UINT32      first;                  /* sample number of rec[0] */
+    UINT32      count;
+    smp_rec_t   rec[STATS_REPLY_MAX];
+} CFG_STATS_REPLY;
+
+/*
+ * Bulk SETCONFIG, a table of cameras sorted by MAC in memcmp order. Each
+ * camera takes the address its entry names, or ipBase plus its index in
+ * the table when that is 0; a mask or gateway of 0 takes the header's.
+ * A table larger than CFG_BULK_MAX goes out as several datagrams, first
+ * giving the table index of entry[0]. A camera applies its entry after
+ * its slot in window and answers SETCONFIGOK as for SETCONFIG.
+ */
+#define CFG_BULK_MAX                    64                  /* entries per datagram, fits a 1500 byte MTU */
+#define CFG_BULK_WINDOW_MAX             60000               /* ms, cap on window */
+
+typedef struct {
+    UINT8   ipMacAddress[6];
+    UINT8   pad[2];
+    UINT32  ipAddress;                  /* 0 = ipBase + table index */
+    UINT32  ipMask;                     /* 0 = the header's */
+    UINT32  ipGateway;                  /* 0 = the header's */
+} CFG_BULK_ENTRY;
+
+typedef struct {
+    UINT32  msg;                        /* RCFG_BULKCONFIG */
+    UINT32  version;
+    UINT32  sig;                        /* CFG_SIG */
+    UINT32  nonce;                      /* new per datagram, resent copies share it */
+    UINT32  window;                     /* ms to spread the changes over */
+    UINT32  ipBase;
+    UINT32  ipMask;
+    UINT32  ipGateway;
+    UINT16  first;                      /* table index of entry[0] */
+    UINT16  count;                      /* entries that follow */
+    CFG_BULK_ENTRY entry[CFG_BULK_MAX];
+} CFG_BULK_STRUCT;
+
+#define CFG_BULK_LEN(n)                 (offsetof(CFG_BULK_STRUCT, entry) + (n) * sizeof(CFG_BULK_ENTRY))
+
+/*
+ * A GETCONFIG with version CFG_VERSION_TLV or above gets a version 4
+ * GETCONFIGOK: the fixed reply, then len bytes of TLV entries. An entry is
+ * a type byte, a length byte and that many value bytes; strings go
+ * without their NUL. A reader skips types it does not know, and tools
+ * that only know the fixed reply read it as before.
+ */
+#define CFG_VERSION_TLV                 4
+#define CFG_TLV_MAX                     512
+
+typedef struct {
+    REMOTE_CFG_STRUCT   cfg;            /* version is CFG_VERSION_TLV */
+    UINT16              len;            /* bytes of tlv in use */
+    UINT8               tlv[CFG_TLV_MAX];
+} CFG_REPLY_V4;
+
+#define CFG_REPLY_V4_LEN(tlvlen)        (offsetof(CFG_REPLY_V4, tlv) + (tlvlen))
+
+#define CFG_TLV_MODEL                   1                   /* board id, string */
+#define CFG_TLV_SERIAL                  2                   /* serial number, string */
+#define CFG_TLV_FIRMWARE                3                   /* DISTRIB_REVISION, string */
+#define CFG_TLV_UPGRADE                 4                   /* CFG_TLV_UPGRADE_VAL, while camifd runs */
+
+typedef struct {
+    UINT8   stage;                      /* camifd UPDATE_xxx, 0 = idle */
+    UINT8   result;                     /* result of the last upgrade, 0 = none, 1 = ok, 2 = fail */
+    UINT8   pad[2];
+    UINT32  staged;                     /* bytes received of the image */
+} CFG_TLV_UPGRADE_VAL;
+
+/*
+ * camifd's status page (statpage.h there), mapped read-only. seq is odd
+ * while camifd writes; a copy is good when seq read the same even value
+ * before and after it. Fields are only appended, so size is checked
+ * rather than version.
+ */
+#define CAM_STATUS_PATH                 "/var/run/camifd.status"
+#define CAM_STATUS_MAGIC                FOURCC('C','M','S','T')
+
+typedef struct {
+    UINT32  magic;                      /* CAM_STATUS_MAGIC */
+    UINT16  version;
+    UINT16  size;                       /* of camifd's record, at least ours */
+    UINT32  seq;
+    UINT32  pid;                        /* 0 once camifd stopped */
+    UINT32  stage;                      /* UPDATE_xxx */
+    UINT32  result;                     /* of the last upgrade */
+    UINT32  filesize;
+    UINT32  staged;
+    UINT32  rate;                       /* bytes/sec */
+    UINT32  cam_clients;
+    UINT32  id_clients;
+    UINT32  sessions;
+    UINT32  errors;
+    UINT32  error_time;
+    char    loadversion[64];
+    char    flashversion[64];
+    char    error[96];
+} CAM_STATUS_STRUCT;
+
 enum {
 	AUTH_NONE = 0,
 	AUTH_WEP64,
@@ -0,0 +1,35 @@
+/* ipinstall_module.h - Discovery responder on a host daemon's uloop */
+
+/*
+Built with IPINSTALL_MODULE the responder has no main and no uloop of its
+own. The host calls ipinstall_init after uloop_init and ipinstall_done
+before uloop_done; everything in between runs from the host's loop. These
+two are the library's only global symbols, the build localizes the rest.
+
+The host provides conf_get and the rest of uci_conf.h. Its conf_init must
+keep one context from before ipinstall_init to after ipinstall_done; the
+responder only reloads its packages in it, it never frees it. The host
+also provides loopprof_begin and loopprof_end. Each callback reports to
+lp_site plus its IPINSTALL_LP_xxx, so the host sets aside IPINSTALL_LP_MAX
+sites in this order.
+*/
+
+#ifndef __IPINSTALL_MODULE_H
+#define __IPINSTALL_MODULE_H
+
+/* the responder's uloop callbacks */
+enum {
+	IPINSTALL_LP_SOCK = 0,		/* discovery requests */
+	IPINSTALL_LP_REPLY,		/* delayed and bulk replies */
+	IPINSTALL_LP_BEACON,
+	IPINSTALL_LP_UCI,		/* uci change watch */
+	IPINSTALL_LP_NETCACHE,		/* netlink address and route events */
+	IPINSTALL_LP_SAMPLER,
+	IPINSTALL_LP_CHILD,		/* uci save and netifd reload exits */
+	IPINSTALL_LP_MAX
+};
+
+int ipinstall_init(char *model, char *serial, int lp_site);
+void ipinstall_done(void);
+
+#endif
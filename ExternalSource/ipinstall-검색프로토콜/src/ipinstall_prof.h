@@ -0,0 +1,61 @@
+/* ipinstall_prof.h - uloop callbacks timed by the host's loop profiler */
+
+/*
+Each IPI_xxx_CB(name, fn, site) defines the uloop callback 'name' that runs
+'fn'. Standalone it is a plain call the compiler folds away. Built with
+IPINSTALL_MODULE it brackets fn with the host's loopprof_begin and
+loopprof_end, reporting IPINSTALL_LP_xxx 'site' from the host's first
+discovery site on, see ipinstall_module.h.
+*/
+
+#ifndef __IPINSTALL_PROF_H
+#define __IPINSTALL_PROF_H
+
+#include <libubox/uloop.h>
+
+#include "ipinstall_module.h"
+
+/* host site of IPINSTALL_LP_SOCK, set by ipinstall_init */
+extern int ipiLpSite;
+
+#ifdef IPINSTALL_MODULE
+
+/* the host's, like conf_get */
+unsigned long loopprof_begin(void);
+void loopprof_end(int site, unsigned long t0);
+
+#define IPI_PROF_BEGIN()	unsigned long t0 = loopprof_begin()
+#define IPI_PROF_END(site)	loopprof_end(ipiLpSite + (site), t0)
+
+#else
+
+#define IPI_PROF_BEGIN()	do {} while (0)
+#define IPI_PROF_END(site)	do {} while (0)
+
+#endif
+
+#define IPI_FD_CB(name, fn, site)					\
+static void name(struct uloop_fd *u_fd, unsigned int events)		\
+{									\
+	IPI_PROF_BEGIN();						\
+	fn(u_fd, events);						\
+	IPI_PROF_END(site);						\
+}
+
+#define IPI_TIMEOUT_CB(name, fn, site)					\
+static void name(struct uloop_timeout *t)				\
+{									\
+	IPI_PROF_BEGIN();						\
+	fn(t);								\
+	IPI_PROF_END(site);						\
+}
+
+#define IPI_PROCESS_CB(name, fn, site)					\
+static void name(struct uloop_process *p, int ret)			\
+{									\
+	IPI_PROF_BEGIN();						\
+	fn(p, ret);							\
+	IPI_PROF_END(site);						\
+}
+
+#endif
@@ -0,0 +1,738 @@
+/* netcache.c - Live copy of the kernel's links, addresses and routes */
+
+/*
+This keeps what cfgGetData used to ask the kernel for on every request:
+interface addresses, MACs and the default gateway. One full dump fills
+the tables at startup, after that rtnetlink events keep them current.
+A lost event (ENOBUFS) falls back to a new dump.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_addr.h>
+
+#include <libubox/uloop.h>
+
+#include "netcache.h"
+#include "routing.h"
+#include "ipinstall_prof.h"
+
+static nc_link_t ncLink[NC_LINK_MAX];
+static int ncLinkCount;
+static nc_addr_t ncAddr[NC_ADDR_MAX];
+static int ncAddrCount;
+
+/*
+ * The route table doubles from NC_ROUTE_MIN as routes come in. A route it
+ * has no room for sets ncRouteLost and lookups go to the kernel until a
+ * dump fits again: with a route missing, a shorter prefix could pass for
+ * the longest match.
+ */
+#define NC_ROUTE_MIN    32
+static nc_route_t *ncRoute;
+static int ncRouteSize;
+static int ncRouteCount;
+static int ncRouteLost;
+static int ncRouteWarned;       /* the loss was logged, until a dump fits */
+static int ncRouteRedump;       /* a route went while some were lost */
+
+/*
+ * Path-compressed binary trie over ncRoute by destination prefix, node 0
+ * is 0/0. It is rebuilt from the table on the first lookup after a change
+ * and a lookup visits at most one node per prefix bit.
+ */
+typedef struct nc_node {
+	in_addr_t       key;            /* prefix, host order, bits past len clear */
+	int             len;
+	int             child[2];
+	int             route;          /* ncRoute index, -1 for a branch point */
+} nc_node_t;
+
+static nc_node_t *ncTrie;       /* room for 2 * ncRouteSize + 1 nodes */
+static int ncTrieSize;
+static int ncTrieCount;
+static int ncTrieDirty = 1;
+
+static struct uloop_fd ncUfd;
+static void (*ncChanged)(int what);
+
+static nc_link_t *nc_find_link(int index)
+{
+	int i;
+
+	for (i = 0; i < ncLinkCount; i++)
+		if (ncLink[i].index == index)
+			return &ncLink[i];
+	return NULL;
+}
+
+static int nc_link_msg(struct nlmsghdr *n)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(n);
+	struct rtattr *tb[IFLA_MAX + 1];
+	nc_link_t link;
+	nc_link_t *l;
+
+	if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
+		return 0;
+
+	l = nc_find_link(ifi->ifi_index);
+	if (n->nlmsg_type == RTM_DELLINK)
+	{
+		if (l == NULL)
+			return 0;
+		*l = ncLink[--ncLinkCount];
+		return NC_CHANGE_LINK;
+	}
+
+	memset(tb, 0, sizeof(tb));
+	parse_rtattr(tb, IFLA_MAX, IFLA_RTA(ifi), IFLA_PAYLOAD(n));
+
+	memset(&link, 0, sizeof(link));
+	link.index = ifi->ifi_index;
+	link.flags = ifi->ifi_flags;
+	if (tb[IFLA_IFNAME])
+		strncpy(link.name, RTA_DATA(tb[IFLA_IFNAME]), IFNAMSIZ - 1);
+	if (tb[IFLA_ADDRESS] && RTA_PAYLOAD(tb[IFLA_ADDRESS]) >= 6)
+		memcpy(link.mac, RTA_DATA(tb[IFLA_ADDRESS]), 6);
+
+	if (l == NULL)
+	{
+		if (ncLinkCount == NC_LINK_MAX)
+			return 0;
+		l = &ncLink[ncLinkCount++];
+	}
+	else if (!memcmp(l, &link, sizeof(link)))
+		return 0;	/* statistics or carrier noise, nothing we report */
+
+	*l = link;
+	return NC_CHANGE_LINK;
+}
+
+static int nc_addr_msg(struct nlmsghdr *n)
+{
+	struct ifaddrmsg *ifa = NLMSG_DATA(n);
+	struct rtattr *tb[IFA_MAX + 1];
+	nc_addr_t addr;
+	int i;
+
+	if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa)) || ifa->ifa_family != AF_INET)
+		return 0;
+
+	memset(tb, 0, sizeof(tb));
+	parse_rtattr(tb, IFA_MAX, IFA_RTA(ifa), IFA_PAYLOAD(n));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.index = ifa->ifa_index;
+	addr.prefixlen = ifa->ifa_prefixlen;
+	if (tb[IFA_LOCAL])
+		memcpy(&addr.addr, RTA_DATA(tb[IFA_LOCAL]), sizeof(addr.addr));
+	else if (tb[IFA_ADDRESS])
+		memcpy(&addr.addr, RTA_DATA(tb[IFA_ADDRESS]), sizeof(addr.addr));
+	if (tb[IFA_LABEL])
+		strncpy(addr.label, RTA_DATA(tb[IFA_LABEL]), IFNAMSIZ - 1);
+
+	for (i = 0; i < ncAddrCount; i++)
+		if (ncAddr[i].index == addr.index && ncAddr[i].addr.s_addr == addr.addr.s_addr)
+			break;
+
+	if (n->nlmsg_type == RTM_DELADDR)
+	{
+		if (i == ncAddrCount)
+			return 0;
+		/* shift, not swap: the first address of a label is its primary */
+		memmove(&ncAddr[i], &ncAddr[i + 1], (ncAddrCount - i - 1) * sizeof(ncAddr[0]));
+		ncAddrCount--;
+		return NC_CHANGE_ADDR;
+	}
+
+	/* secondaries never win a label lookup, don't let them take a slot */
+	if (ifa->ifa_flags & IFA_F_SECONDARY)
+		return 0;
+	if (i == ncAddrCount)
+	{
+		if (ncAddrCount == NC_ADDR_MAX)
+			return 0;
+		ncAddrCount++;
+	}
+	else if (!memcmp(&ncAddr[i], &addr, sizeof(addr)))
+		return 0;
+
+	ncAddr[i] = addr;
+	return NC_CHANGE_ADDR;
+}
+
+#define NC_MASK(len)    ((len) ? 0xffffffffU << (32 - (len)) : 0)
+#define NC_BIT(key, n)  (((key) >> (31 - (n))) & 1)
+
+static int nc_trie_node(in_addr_t key, int len, int route)
+{
+	nc_node_t *x = &ncTrie[ncTrieCount];
+
+	x->key = key;
+	x->len = len;
+	x->child[0] = x->child[1] = -1;
+	x->route = route;
+	return ncTrieCount++;
+}
+
+static void nc_trie_insert(int r)
+{
+	int len = ncRoute[r].dst_len;
+	in_addr_t key = ntohl(ncRoute[r].dst.s_addr) & NC_MASK(len);
+	nc_node_t *n, *m;
+	int idx = 0;
+	int common;
+	int b, c, x;
+
+	for (;;)
+	{
+		n = &ncTrie[idx];
+		if (n->len == len)
+		{
+			if (n->route < 0 || ncRoute[r].metric < ncRoute[n->route].metric)
+				n->route = r;
+			return;
+		}
+		b = NC_BIT(key, n->len);
+		c = n->child[b];
+		if (c < 0)
+		{
+			n->child[b] = nc_trie_node(key, len, r);
+			return;
+		}
+
+		m = &ncTrie[c];
+		common = (key ^ m->key) ? __builtin_clz(key ^ m->key) : 32;
+		if (common > len)
+			common = len;
+		if (common >= m->len)
+		{
+			idx = c;
+			continue;
+		}
+
+		/* m hangs below a new node at the point where the prefixes part */
+		if (common == len)
+			x = nc_trie_node(key, len, r);
+		else
+		{
+			x = nc_trie_node(key & NC_MASK(common), common, -1);
+			ncTrie[x].child[NC_BIT(key, common)] = nc_trie_node(key, len, r);
+		}
+		ncTrie[x].child[NC_BIT(m->key, common)] = c;
+		n->child[b] = x;
+		return;
+	}
+}
+
+/* -1 when there is no memory for the nodes, the trie stays dirty */
+static int nc_trie_build(void)
+{
+	nc_node_t *t;
+	int i;
+
+	if (ncTrieSize < 2 * ncRouteSize + 1)
+	{
+		if ((t = realloc(ncTrie, (2 * ncRouteSize + 1) * sizeof(*t))) == NULL)
+			return -1;
+		ncTrie = t;
+		ncTrieSize = 2 * ncRouteSize + 1;
+	}
+
+	ncTrieCount = 0;
+	nc_trie_node(0, 0, -1);
+	for (i = 0; i < ncRouteCount; i++)
+		nc_trie_insert(i);
+	ncTrieDirty = 0;
+	return 0;
+}
+
+/* Longest prefix match, the lowest metric among equal prefixes. */
+static nc_route_t *nc_trie_lookup(struct in_addr addr)
+{
+	in_addr_t key = ntohl(addr.s_addr);
+	nc_node_t *n;
+	int best = -1;
+	int idx = 0;
+
+	while (idx >= 0)
+	{
+		n = &ncTrie[idx];
+		if ((key & NC_MASK(n->len)) != n->key)
+			break;
+		if (n->route >= 0)
+			best = n->route;
+		if (n->len == 32)
+			break;
+		idx = n->child[NC_BIT(key, n->len)];
+	}
+	return best < 0 ? NULL : &ncRoute[best];
+}
+
+/* Double the route table, -1 when it is at NC_ROUTE_MAX or out of memory. */
+static int nc_route_grow(void)
+{
+	int size = ncRouteSize ? 2 * ncRouteSize : NC_ROUTE_MIN;
+	nc_route_t *r;
+
+	if (size > NC_ROUTE_MAX)
+		return -1;
+	if ((r = realloc(ncRoute, size * sizeof(*r))) == NULL)
+		return -1;
+	ncRoute = r;
+	ncRouteSize = size;
+	return 0;
+}
+
+/* An IPv4 RTM_xxxROUTE into route, NULL if n is not one. */
+static struct rtmsg *nc_route_parse(struct nlmsghdr *n, nc_route_t *route)
+{
+	struct rtmsg *rtm = NLMSG_DATA(n);
+	struct rtattr *tb[RTA_MAX + 1];
+
+	if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*rtm)) || rtm->rtm_family != AF_INET)
+		return NULL;
+
+	memset(tb, 0, sizeof(tb));
+	parse_rtattr(tb, RTA_MAX, RTM_RTA(rtm), RTM_PAYLOAD(n));
+
+	memset(route, 0, sizeof(*route));
+	route->dst_len = rtm->rtm_dst_len;
+	if (tb[RTA_DST])
+		memcpy(&route->dst, RTA_DATA(tb[RTA_DST]), sizeof(route->dst));
+	if (tb[RTA_GATEWAY])
+		memcpy(&route->gateway, RTA_DATA(tb[RTA_GATEWAY]), sizeof(route->gateway));
+	if (tb[RTA_PREFSRC])
+		memcpy(&route->prefsrc, RTA_DATA(tb[RTA_PREFSRC]), sizeof(route->prefsrc));
+	route->oif = tb[RTA_OIF] ? *(int *)RTA_DATA(tb[RTA_OIF]) : -1;
+	route->metric = tb[RTA_PRIORITY] ? *(unsigned int *)RTA_DATA(tb[RTA_PRIORITY]) : 0;
+	return rtm;
+}
+
+/*
+ * Unicast routes of the main table. Only a default route change is
+ * reported, the rest just invalidates the trie.
+ */
+static int nc_route_msg(struct nlmsghdr *n)
+{
+	struct rtmsg *rtm;
+	nc_route_t route;
+	int i;
+
+	rtm = nc_route_parse(n, &route);
+	if (rtm == NULL || rtm->rtm_table != RT_TABLE_MAIN || rtm->rtm_type != RTN_UNICAST)
+		return 0;
+
+	for (i = 0; i < ncRouteCount; i++)
+		if (!memcmp(&ncRoute[i], &route, sizeof(route)))
+			break;
+
+	if (n->nlmsg_type == RTM_DELROUTE)
+	{
+		/* the lost routes may fit now */
+		if (ncRouteLost)
+			ncRouteRedump = 1;
+		if (i == ncRouteCount)
+			return 0;
+		ncRoute[i] = ncRoute[--ncRouteCount];
+		ncTrieDirty = 1;
+		return route.dst_len == 0 ? NC_CHANGE_ROUTE : 0;
+	}
+	if (i < ncRouteCount)
+		return 0;
+	/* a replaced route comes without a delete for the one it displaced */
+	if (n->nlmsg_flags & NLM_F_REPLACE)
+	{
+		for (i = 0; i < ncRouteCount; i++)
+			if (ncRoute[i].dst.s_addr == route.dst.s_addr &&
+				ncRoute[i].dst_len == route.dst_len && ncRoute[i].metric == route.metric)
+				break;
+	}
+	if (i == ncRouteCount)
+	{
+		if (ncRouteCount == ncRouteSize && nc_route_grow() < 0)
+		{
+			if (!ncRouteWarned)
+				printf("netcache: route table full at %d, routes go to the kernel\n", ncRouteCount);
+			ncRouteWarned = 1;
+			ncRouteLost = 1;
+			/* a lost default route is a change too */
+			return route.dst_len == 0 ? NC_CHANGE_ROUTE : 0;
+		}
+		ncRouteCount++;
+	}
+	ncRoute[i] = route;
+	ncTrieDirty = 1;
+	return route.dst_len == 0 ? NC_CHANGE_ROUTE : 0;
+}
+
+/* read_xxx() callback and event dispatcher, ORs the change into *arg */
+static int nc_update(struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
+{
+	int *what = arg;
+
+	switch (n->nlmsg_type)
+	{
+	case RTM_NEWLINK:
+	case RTM_DELLINK:
+		*what |= nc_link_msg(n);
+		break;
+	case RTM_NEWADDR:
+	case RTM_DELADDR:
+		*what |= nc_addr_msg(n);
+		break;
+	case RTM_NEWROUTE:
+	case RTM_DELROUTE:
+		*what |= nc_route_msg(n);
+		break;
+	}
+	return 0;
+}
+
+/*
+ * Throw the tables away and dump everything again. Used at startup and
+ * whenever the event socket overflowed and updates were lost.
+ */
+int netcache_resync(void)
+{
+	struct rtsock *s;
+	int what = 0;
+	int rc = 0;
+
+	s = open_route_socket();
+	if (s == NULL)
+		return -1;
+
+	ncLinkCount = 0;
+	ncAddrCount = 0;
+	ncRouteCount = 0;
+	ncRouteLost = 0;
+	ncRouteRedump = 0;
+	ncTrieDirty = 1;
+	if (read_interfaces(s, nc_update, &what) < 0 ||
+		read_addresses(s, nc_update, &what) < 0 ||
+		read_routes(s, nc_update, &what) < 0)
+	{
+		printf("netcache: dump failed\n");
+		rc = -1;
+	}
+	if (!ncRouteLost)
+		ncRouteWarned = 0;
+	close_route_socket(s);
+	free(s);
+	return rc;
+}
+
+static void nc_event_read(struct uloop_fd *u_fd, unsigned int events)
+{
+	char buf[8192];
+	struct nlmsghdr *n;
+	int what = 0;
+	int len;
+
+	while ((len = recv(u_fd->fd, buf, sizeof(buf), 0)) > 0)
+	{
+		for (n = (struct nlmsghdr *)buf; NLMSG_OK(n, len); n = NLMSG_NEXT(n, len))
+			nc_update(NULL, n, &what);
+	}
+	if (len < 0 && errno == ENOBUFS)
+	{
+		printf("netcache: events lost, resync\n");
+		netcache_resync();
+		what = NC_CHANGE_ALL;
+	}
+	else if (ncRouteRedump)
+	{
+		netcache_resync();
+		what = NC_CHANGE_ALL;
+	}
+
+	if (what && ncChanged)
+		ncChanged(what);
+}
+
+IPI_FD_CB(nc_event_read_cb, nc_event_read, IPINSTALL_LP_NETCACHE)
+
+int netcache_init(void (*changed)(int what))
+{
+	struct sockaddr_nl snl;
+	int fd;
+
+	ncChanged = changed;
+
+	/* subscribe first so nothing between the dump and the events is missed */
+	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (fd < 0)
+	{
+		printf("ERROR\n    Failed to create netlink socket\n");
+		return -1;
+	}
+	memset(&snl, 0, sizeof(snl));
+	snl.nl_family = AF_NETLINK;
+	snl.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE;
+	if (bind(fd, (struct sockaddr *)&snl, sizeof(snl)) < 0)
+	{
+		printf("ERROR\n    Failed to bind netlink socket\n");
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+	ncUfd.cb = nc_event_read_cb;
+	ncUfd.fd = fd;
+	uloop_fd_add(&ncUfd, ULOOP_READ);
+
+	return netcache_resync();
+}
+
+void netcache_done(void)
+{
+	free(ncRoute);
+	ncRoute = NULL;
+	ncRouteSize = 0;
+	ncRouteCount = 0;
+	free(ncTrie);
+	ncTrie = NULL;
+	ncTrieSize = 0;
+	ncTrieDirty = 1;
+
+	if (ncUfd.fd <= 0)
+		return;
+	uloop_fd_delete(&ncUfd);
+	close(ncUfd.fd);
+	ncUfd.fd = -1;
+}
+
+/* Primary address of a label and the link it sits on, either may be NULL. */
+static void nc_lookup(char *label, nc_addr_t **pa, nc_link_t **pl)
+{
+	char name[IFNAMSIZ];
+	char *colon;
+	int i;
+
+	*pa = NULL;
+	*pl = NULL;
+	for (i = 0; i < ncAddrCount; i++)
+	{
+		if (!strcmp(ncAddr[i].label, label))
+		{
+			*pa = &ncAddr[i];
+			*pl = nc_find_link(ncAddr[i].index);
+			return;
+		}
+	}
+
+	/* an alias shares the link of its base interface */
+	strncpy(name, label, IFNAMSIZ - 1);
+	name[IFNAMSIZ - 1] = 0;
+	if ((colon = strchr(name, ':')) != NULL)
+		*colon = 0;
+	for (i = 0; i < ncLinkCount; i++)
+		if (!strcmp(ncLink[i].name, name))
+			*pl = &ncLink[i];
+}
+
+/*
+ * Primary address, mask and MAC of an interface or alias label. An
+ * interface without an address still reports its MAC. Returns -1 if
+ * neither the label nor its link is known.
+ */
+int netcache_get_if(char *label, struct in_addr *addr, struct in_addr *mask, unsigned char *mac)
+{
+	nc_link_t *l;
+	nc_addr_t *a;
+
+	addr->s_addr = 0;
+	mask->s_addr = 0;
+	memset(mac, 0, 6);
+
+	nc_lookup(label, &a, &l);
+	if (a)
+	{
+		*addr = a->addr;
+		mask->s_addr = a->prefixlen ? htonl(0xffffffffU << (32 - a->prefixlen)) : 0;
+	}
+	if (l)
+		memcpy(mac, l->mac, 6);
+	return (a || l) ? 0 : -1;
+}
+
+/* Kernel index of the link a label sits on, 0 if unknown. */
+int netcache_get_index(char *label)
+{
+	nc_link_t *l;
+	nc_addr_t *a;
+
+	nc_lookup(label, &a, &l);
+	if (a)
+		return a->index;
+	return l ? l->index : 0;
+}
+
+/* read_route_to() callback, the kernel's unicast answer into *arg */
+static int nc_kernel_msg(struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
+{
+	struct rtmsg *rtm;
+	nc_route_t route;
+
+	if (n->nlmsg_type != RTM_NEWROUTE)
+		return 0;
+	rtm = nc_route_parse(n, &route);
+	if (rtm != NULL && rtm->rtm_type == RTN_UNICAST)
+		*(nc_route_t *)arg = route;
+	return 0;
+}
+
+/*
+ * The kernel's route to addr. It answers for the host alone, so a
+ * directly connected one takes the prefix of our address on that subnet.
+ */
+static int nc_kernel_route(struct in_addr addr, nc_route_t *r)
+{
+	struct rtsock *s;
+	int i;
+
+	if ((s = open_route_socket()) == NULL)
+		return -1;
+	memset(r, 0, sizeof(*r));
+	r->dst_len = -1;
+	if (read_route_to(s, &addr, nc_kernel_msg, r) < 0)
+		r->dst_len = -1;
+	close_route_socket(s);
+	free(s);
+	if (r->dst_len < 0)
+		return -1;
+
+	if (r->gateway.s_addr == 0)
+		for (i = 0; i < ncAddrCount; i++)
+			if (ncAddr[i].index == r->oif &&
+				((ncAddr[i].addr.s_addr ^ addr.s_addr) & htonl(NC_MASK(ncAddr[i].prefixlen))) == 0)
+			{
+				r->dst_len = ncAddr[i].prefixlen;
+				break;
+			}
+	return 0;
+}
+
+/* read_routes() callback, the lowest metric default gateway into *arg */
+static int nc_gateway_msg(struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
+{
+	nc_route_t *best = arg;
+	struct rtmsg *rtm;
+	nc_route_t route;
+
+	rtm = nc_route_parse(n, &route);
+	if (rtm == NULL || rtm->rtm_table != RT_TABLE_MAIN || rtm->rtm_type != RTN_UNICAST)
+		return 0;
+	if (route.dst_len == 0 && route.gateway.s_addr &&
+		(best->gateway.s_addr == 0 || route.metric < best->metric))
+		*best = route;
+	return 0;
+}
+
+/*
+ * The route to addr from the trie, or from the kernel while the table is
+ * missing routes. -1 if nothing reaches addr.
+ */
+static int nc_route_find(struct in_addr addr, nc_route_t *out)
+{
+	nc_route_t *r;
+
+	if (ncRouteLost || (ncTrieDirty && nc_trie_build() < 0))
+		return nc_kernel_route(addr, out);
+	if ((r = nc_trie_lookup(addr)) == NULL)
+		return -1;
+	*out = *r;
+	return 0;
+}
+
+/* Non-zero if addr is a host on one of our directly connected subnets. */
+int netcache_on_link(struct in_addr addr)
+{
+	nc_route_t route, *r = &route;
+	in_addr_t mask;
+
+	if (nc_route_find(addr, r) < 0 || r->gateway.s_addr || r->dst_len == 0 || r->dst_len > 30 || r->oif <= 0)
+		return 0;
+	/* the network and broadcast addresses are not hosts */
+	mask = htonl(NC_MASK(r->dst_len));
+	if ((addr.s_addr & ~mask) == 0 || (addr.s_addr | mask) == 0xffffffffU)
+		return 0;
+	return r->oif;
+}
+
+/* Default gateway with the lowest metric, -1 if there is none. */
+int netcache_get_gateway(struct in_addr *gw, int *oif)
+{
+	nc_route_t kernel;
+	nc_route_t *best = NULL;
+	struct rtsock *s;
+	int i;
+
+	if (ncRouteLost)
+	{
+		/* the default route may be one the table had no room for */
+		memset(&kernel, 0, sizeof(kernel));
+		if ((s = open_route_socket()) != NULL)
+		{
+			if (read_routes(s, nc_gateway_msg, &kernel) == 0 && kernel.gateway.s_addr)
+				best = &kernel;
+			close_route_socket(s);
+			free(s);
+		}
+	}
+	else
+	{
+		for (i = 0; i < ncRouteCount; i++)
+			if (ncRoute[i].dst_len == 0 && ncRoute[i].gateway.s_addr &&
+				(best == NULL || ncRoute[i].metric < best->metric))
+				best = &ncRoute[i];
+	}
+
+	if (best == NULL)
+	{
+		gw->s_addr = 0;
+		if (oif)
+			*oif = -1;
+		return -1;
+	}
+	*gw = best->gateway;
+	if (oif)
+		*oif = best->oif;
+	return 0;
+}
+
+/*
+ * How dst is reached: the gateway (0 when directly connected), the
+ * outgoing interface and the source address the kernel would pick. Any
+ * of the outputs may be NULL. -1 if no route reaches dst.
+ */
+int netcache_route(struct in_addr dst, struct in_addr *gw, int *oif, struct in_addr *src)
+{
+	nc_route_t route, via;
+	nc_route_t *r = &route;
+
+	if (nc_route_find(dst, r) < 0)
+		return -1;
+	if (gw)
+		*gw = r->gateway;
+	if (oif)
+		*oif = r->oif;
+	if (src)
+	{
+		*src = r->prefsrc;
+		/* a gateway route takes its source from the prefix the gateway is on */
+		if (src->s_addr == 0 && r->gateway.s_addr &&
+			nc_route_find(r->gateway, &via) == 0 && via.gateway.s_addr == 0)
+			*src = via.prefsrc;
+	}
+	return 0;
+}
@@ -0,0 +1,51 @@
+/* netcache.h - Live copy of the kernel's links, addresses and routes */
+
+#ifndef __NETCACHE_H
+#define __NETCACHE_H
+
+#include <net/if.h>        /* for IFNAMSIZ */
+#include <netinet/in.h>    /* for struct in_addr */
+
+#define NC_LINK_MAX     8
+#define NC_ADDR_MAX     16
+#define NC_ROUTE_MAX    16384   /* main table unicast routes, the table grows to this */
+
+/* what changed, passed to the change callback */
+#define NC_CHANGE_LINK  0x01
+#define NC_CHANGE_ADDR  0x02
+#define NC_CHANGE_ROUTE 0x04
+#define NC_CHANGE_ALL   (NC_CHANGE_LINK | NC_CHANGE_ADDR | NC_CHANGE_ROUTE)
+
+typedef struct nc_link {
+	int             index;
+	char            name[IFNAMSIZ];
+	unsigned char   mac[6];
+	unsigned int    flags;          /* IFF_xxx */
+} nc_link_t;
+
+typedef struct nc_addr {
+	int             index;
+	char            label[IFNAMSIZ];    /* "eth0" or an alias like "eth0:1" */
+	struct in_addr  addr;
+	int             prefixlen;
+} nc_addr_t;
+
+typedef struct nc_route {
+	struct in_addr  dst;
+	int             dst_len;
+	struct in_addr  gateway;        /* 0 for a directly connected prefix */
+	struct in_addr  prefsrc;        /* 0 when the kernel gave none */
+	int             oif;
+	unsigned int    metric;
+} nc_route_t;
+
+int netcache_init(void (*changed)(int what));
+void netcache_done(void);
+int netcache_resync(void);
+int netcache_get_if(char *label, struct in_addr *addr, struct in_addr *mask, unsigned char *mac);
+int netcache_get_index(char *label);
+int netcache_on_link(struct in_addr addr);
+int netcache_get_gateway(struct in_addr *gw, int *oif);
+int netcache_route(struct in_addr dst, struct in_addr *gw, int *oif, struct in_addr *src);
+
+#endif
@@ -410,7 +410,7 @@ void readMacAddress(char *ifname, Interface * inf)
 int readGateway(HostRow * h)
 {
   int      rc;
-  struct route *routes = NULL;
+  struct route_list routes = ROUTE_LIST_INIT(routes);
   struct route *ptr;
 
   memset(h->gateway, 0, IP_ADDRESS_MAX_LEN);
@@ -426,14 +426,15 @@ int readGateway(HostRow * h)
   }
   /* Don't signal error if there is no gateway */
   rc = 0;
-  for (ptr = routes; ptr; ptr = ptr->next) {
-    if (ptr->gateway_valid && ptr->rtmsg.rtm_table == RT_TABLE_MAIN) {
+  for (ptr = routes.head; ptr; ptr = ptr->next) {
+    if (ptr->gateway_valid && ptr->rtmsg.rtm_table == RT_TABLE_MAIN &&
+      ptr->rtmsg.rtm_dst_len == 0) {
       strncpy(h->gateway, inet_ntoa(ptr->gateway), IP_ADDRESS_MAX_LEN);
       break;
     }
   }
 cleanup:
-  list_delete(&routes);
+  list_delete(&routes.head);
   close_route_socket(KernelRoutingSocket);  
   return rc;
 }
@@ -46,22 +46,23 @@
  *  - Function prototypes
  ***************************************************************************/
 
-int      list_add(struct route **list, struct route *route);
-int      list_append(struct route **list, struct route *route);
-int      send_route_request(struct rtsock *s);
-int      recv_route_response2(struct rtsock *s,
+static int      list_add(struct route **list, struct route *route);
+static int      send_route_request(struct rtsock *s);
+static int      recv_route_response2(struct rtsock *s,
   int (*doit) (struct sockaddr_nl *, struct nlmsghdr * n, void *),
   void *arg1);
-int      convert_netlink2route(struct route *route,
+static int      convert_netlink2route(struct route *route,
   struct nlmsghdr *netlink_header);
 int      parse_rtattr(struct rtattr *tb[], int max, struct rtattr *rta,
   int len);
-int      addattr32(struct nlmsghdr *n, int maxlen, int type, __u32 data);
-int      addattr_l(struct nlmsghdr *n, int maxlen, int type, void *data,
+static int      addattr32(struct nlmsghdr *n, int maxlen, int type, __u32 data);
+static int      addattr_l(struct nlmsghdr *n, int maxlen, int type, void *data,
   int alen);
-int      send_interface_request(struct rtsock *s);
-int      write_route0(struct rtsock *s, struct route *route);
-void     print_route(struct nlmsghdr *netlink_header);
+static int      send_interface_request(struct rtsock *s);
+static int      send_address_request(struct rtsock *s);
+static int      write_route0(struct rtsock *s, struct route *route);
+static void     print_route(struct nlmsghdr *netlink_header)
+  __attribute__((unused));  /* debugging aid, no caller */
 
 
 
@@ -259,14 +260,6 @@ int filter_static_routes_on_inf(struct route *in_routes,
 int write_route(struct rtsock *s, struct route *route)
 {
 
-  fd_set   rset;
-  struct timeval tv;
-
-  FD_ZERO(&rset);
-  FD_SET(s->sock, &rset);
-  tv.tv_sec = 0;
-  tv.tv_usec = 0;
-
   int      rc = write_route0(s, route);
 
   if (rc < 0) {
@@ -274,16 +267,13 @@ int write_route(struct rtsock *s, struct route *route)
     return -1;
   }
 
-  /* The kernel may respond with an NLMSG_ERROR message.  This may happen for
-   * example if you attempt to write the default gateway when all the
-   * interfaces are disabled.  If the kernel does so, we want to consume this
-   * message before we send the next message.  We consume it and ignore it. */
-  if (select(s->sock + 1, &rset, NULL, NULL, &tv) > 0) {
-    rc = recv_route_response2(s, NULL, NULL);
-    if (rc < 0) {
-//      LOG(LOG_ERR, MN, "recv_route_response2() failed, rc = %d", rc);
-      return -1;
-    }
+  /* The request asks for an acknowledgement, so the kernel always answers
+   * with an NLMSG_ERROR message, carrying 0 on success.  Wait for it like
+   * write_address() does; a failed write must not pass for a good one. */
+  rc = recv_route_response2(s, NULL, NULL);
+  if (rc < 0) {
+//    LOG(LOG_ERR, MN, "recv_route_response2() failed, rc = %d", rc);
+    return -1;
   }
   return 0;
 }
@@ -300,7 +290,7 @@ int write_route(struct rtsock *s, struct route *route)
  * Effects:      Modifies the kernel routing table 
  ***************************************************************/
 
-int write_route0(struct rtsock *s, struct route *route)
+static int write_route0(struct rtsock *s, struct route *route)
 {
 
   int      rc;
@@ -328,7 +318,7 @@ int write_route0(struct rtsock *s, struct route *route)
 
   request.netlink_header.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
   request.netlink_header.nlmsg_flags =
-    NLM_F_REQUEST | NLM_F_CREATE | NLM_F_REPLACE;
+    NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | NLM_F_REPLACE;
   request.netlink_header.nlmsg_type = RTM_NEWROUTE;
 
   request.rt_message.rtm_family = route->rtmsg.rtm_family;
@@ -387,6 +377,67 @@ int write_route0(struct rtsock *s, struct route *route)
 
 
 
+/***************************************************************
+ * write_address(): Add or remove an IPv4 address on an
+ * interface and wait for the kernel to acknowledge it.
+ *
+ * Input:        s -- socket handle 
+ *               cmd -- RTM_NEWADDR or RTM_DELADDR
+ *               index -- kernel index of the interface
+ *               addr -- the address
+ *               prefixlen -- netmask length
+ * Output:       none 
+ * Returns:      0 on success, -1 otherwise 
+ * Effects:      Modifies the kernel's interface addresses
+ ***************************************************************/
+
+int write_address(struct rtsock *s, int cmd, int index,
+  struct in_addr *addr, int prefixlen)
+{
+  struct in_addr brd;
+  struct sockaddr_nl nladdr;
+  struct
+  {
+    struct nlmsghdr nlh;
+    struct ifaddrmsg ifa;
+    char     space[256];
+  } req;
+
+  if (s == NULL || addr == NULL)
+    return -1;
+
+  memset(&req, 0, sizeof(req));
+  req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg));
+  req.nlh.nlmsg_type = cmd;
+  req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+  if (cmd == RTM_NEWADDR)
+    req.nlh.nlmsg_flags |= NLM_F_CREATE | NLM_F_REPLACE;
+  req.nlh.nlmsg_seq = ++s->seq;
+  req.ifa.ifa_family = AF_INET;
+  req.ifa.ifa_prefixlen = prefixlen;
+  req.ifa.ifa_scope = RT_SCOPE_UNIVERSE;
+  req.ifa.ifa_index = index;
+
+  addattr_l(&req.nlh, sizeof(req), IFA_LOCAL, addr, sizeof(struct in_addr));
+  addattr_l(&req.nlh, sizeof(req), IFA_ADDRESS, addr,
+    sizeof(struct in_addr));
+  if (cmd == RTM_NEWADDR && prefixlen < 31) {
+    brd.s_addr = addr->s_addr | htonl(0xffffffffU >> prefixlen);
+    addattr_l(&req.nlh, sizeof(req), IFA_BROADCAST, &brd,
+      sizeof(struct in_addr));
+  }
+
+  memset(&nladdr, 0, sizeof(nladdr));
+  nladdr.nl_family = AF_NETLINK;
+
+  if (sendto(s->sock, (void *) &req, req.nlh.nlmsg_len, 0,
+      (struct sockaddr *) &nladdr, sizeof(nladdr)) < 0)
+    return -1;
+
+  return recv_route_response2(s, NULL, NULL) < 0 ? -1 : 0;
+}
+
+
 /***************************************************************
  * read_interfaces(): Read interface information from 
  * the kernel. The function is written to use a callback 
@@ -420,6 +471,100 @@ int read_interfaces(struct rtsock *s,
 
 
 
+/***************************************************************
+ * read_addresses(): Reads the IPv4 addresses of all interfaces,
+ * calling doit for each RTM_NEWADDR message found.
+ *
+ * Input:        s -- socket handle 
+ *               doit -- callback function
+ *               arg -- argument that is passed to doit
+ * Output:       none 
+ * Returns:      0 on success, -1 otherwise 
+ * Effects:      No side effects
+ ***************************************************************/
+
+int read_addresses(struct rtsock *s,
+  int (*doit) (struct sockaddr_nl *, struct nlmsghdr * n, void *), void *arg)
+{
+  int      rc = send_address_request(s);
+
+  if (rc < 0)
+    return -1;
+
+  rc = recv_route_response2(s, doit, arg);
+  if (rc < 0)
+    return -1;
+  return 0;
+}
+
+
+
+/***************************************************************
+ * read_route_to(): Asks the kernel how it routes a single
+ * destination, calling doit with the RTM_NEWROUTE it answers.
+ * An unreachable destination is no error, doit just isn't
+ * called.
+ *
+ * Input:        s -- socket handle 
+ *               dst -- the destination
+ *               doit -- callback function
+ *               arg -- argument that is passed to doit
+ * Output:       none 
+ * Returns:      0 on success, -1 otherwise 
+ * Effects:      No side effects
+ ***************************************************************/
+
+int read_route_to(struct rtsock *s, struct in_addr *dst,
+  int (*doit) (struct sockaddr_nl *, struct nlmsghdr * n, void *), void *arg)
+{
+  int      rc;
+
+  struct
+  {
+    struct nlmsghdr netlink_header;
+    struct rtmsg rt_message;
+    char     space[64];
+  } request;
+
+  struct sockaddr_nl nladdr;
+  struct iovec iov = { &request, sizeof(request) };
+  struct msghdr msg = {
+    (void *) &nladdr, sizeof(nladdr),
+    &iov, 1, NULL, 0, 0
+  };
+
+  if (s == NULL)
+    return -1;
+
+  memset(&request, 0, sizeof(request));
+  request.netlink_header.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+  /* the acknowledgement ends the answer, there is no NLMSG_DONE */
+  request.netlink_header.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+  request.netlink_header.nlmsg_type = RTM_GETROUTE;
+  request.netlink_header.nlmsg_seq = ++s->seq;
+
+  request.rt_message.rtm_family = AF_INET;
+  request.rt_message.rtm_dst_len = 32;
+  if (addattr_l(&request.netlink_header, sizeof(request), RTA_DST, dst,
+      sizeof(struct in_addr)) < 0)
+    return -1;
+
+  memset(&nladdr, 0, sizeof(nladdr));
+  nladdr.nl_family = AF_NETLINK;
+
+  iov.iov_len = request.netlink_header.nlmsg_len;
+
+  rc = sendmsg(s->sock, &msg, 0);
+  if (rc < 0)
+    return -1;
+
+  rc = recv_route_response2(s, doit, arg);
+  if (rc < 0)
+    return -1;
+  return 0;
+}
+
+
 
 /***************************************************************
  * send_route_request(): Send a request to kernel to read the 
@@ -432,7 +577,7 @@ int read_interfaces(struct rtsock *s,
  * Effects:      Sends request packet to kernel 
  ***************************************************************/
 
-int send_route_request(struct rtsock *s)
+static int send_route_request(struct rtsock *s)
 {
   int      rc;
   struct sockaddr_nl nladdr;
@@ -476,7 +621,7 @@ int send_route_request(struct rtsock *s)
 }
 
 #define RECV_BUF_LEN (1024*8)
-char     recv_route_response_buf[RECV_BUF_LEN];
+static char recv_route_response_buf[RECV_BUF_LEN];
 
 
 /***************************************************************
@@ -492,7 +637,7 @@ char     recv_route_response_buf[RECV_BUF_LEN];
  * Effects:      No side effects
  ***************************************************************/
 
-int recv_route_response2(struct rtsock *s,
+static int recv_route_response2(struct rtsock *s,
   int (*doit) (struct sockaddr_nl *, struct nlmsghdr * n, void *), void *arg1)
 {
   int      rc;
@@ -534,6 +679,9 @@ int recv_route_response2(struct rtsock *s,
       if (netlink_header->nlmsg_type == NLMSG_ERROR) {
         struct nlmsgerr *err = (struct nlmsgerr *) NLMSG_DATA(netlink_header);
 
+        /* an acknowledgement is an error message carrying 0 */
+        if (err->error == 0)
+          return 0;
         printf("netlink error %s\n", strerror(-err->error));
         if (err->error == -ENETUNREACH)
           return 0;
@@ -569,7 +717,7 @@ int recv_route_response2(struct rtsock *s,
  * Effects:      No side effects
  ***************************************************************/
 
-int convert_netlink2route(struct route *route,
+static int convert_netlink2route(struct route *route,
   struct nlmsghdr *netlink_header)
 {
 
@@ -617,7 +765,7 @@ int convert_netlink2route(struct route *route,
  * Effects:      No side effects
  ***************************************************************/
 
-int send_interface_request(struct rtsock *s)
+static int send_interface_request(struct rtsock *s)
 {
   struct sockaddr_nl nladdr;
   struct
@@ -643,26 +791,43 @@ int send_interface_request(struct rtsock *s)
 
 
 /***************************************************************
- * list_add(): Add a route object to the front of the given list
+ * send_address_request(): Send a request to kernel to dump the 
+ * IPv4 interface addresses.  
  *
- * Input:        list -- list of routes 
- * Output:       route -- route to add 
- * Returns:      0 
+ * Input:        s -- socket handle 
+ * Output:       none 
+ * Returns:      0 on success, -1 otherwise (see sendto)
  * Effects:      No side effects
  ***************************************************************/
 
-int list_add(struct route **list, struct route *route)
+static int send_address_request(struct rtsock *s)
 {
-  route->next = *list;
-  *list = route;
-  return 0;
+  struct sockaddr_nl nladdr;
+  struct
+  {
+    struct nlmsghdr nlh;
+    struct ifaddrmsg ifa;
+  } req;
+
+  memset(&nladdr, 0, sizeof(nladdr));
+  nladdr.nl_family = AF_NETLINK;
+
+  memset(&req, 0, sizeof(req));
+  req.nlh.nlmsg_len = sizeof(req);
+  req.nlh.nlmsg_type = RTM_GETADDR;
+  req.nlh.nlmsg_flags = NLM_F_ROOT | NLM_F_MATCH | NLM_F_REQUEST;
+  req.nlh.nlmsg_pid = 0;
+  req.nlh.nlmsg_seq = ++s->seq;
+  req.ifa.ifa_family = AF_INET;
+
+  return sendto(s->sock, (void *) &req, sizeof(req), 0,
+    (struct sockaddr *) &nladdr, sizeof(nladdr));
 }
 
 
+
 /***************************************************************
- * list_append(): Add a route object to the end of 
- * the given list.  Note that route->next is not modified, so 
- * make sure that it is valid. 
+ * list_add(): Add a route object to the front of the given list
  *
  * Input:        list -- list of routes 
  * Output:       route -- route to add 
@@ -670,21 +835,14 @@ int list_add(struct route **list, struct route *route)
  * Effects:      No side effects
  ***************************************************************/
 
-int list_append(struct route **list, struct route *route)
+static int list_add(struct route **list, struct route *route)
 {
-
-  if (!*list)
-    *list = route;
-  else {
-    struct route *ptr;
-
-    for (ptr = *list; ptr->next; ptr = ptr->next);
-    ptr->next = route;
-  }
-  route->next = NULL;
+  route->next = *list;
+  *list = route;
   return 0;
 }
 
+
 /***************************************************************
  * list_delete(): Delete the entire list of route objects from 
  * the given list.
@@ -719,7 +877,7 @@ void list_delete(struct route **list)
  *
  * Input:        who -- netlink socket 
  *               nlmsghdr -- netlink message 
- *               arg -- pointer to the head of the list of routes 
+ *               arg -- struct route_list, set up with ROUTE_LIST_INIT
  * Output:       none 
  * Returns:      0 on success, -1 on failure 
  * Effects:      No side effects. 
@@ -727,6 +885,7 @@ void list_delete(struct route **list)
 
 int route_append(struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
 {
+  struct route_list *list = arg;
   struct route *route;
   int      rc;
 
@@ -737,9 +896,13 @@ int route_append(struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
   rc = convert_netlink2route(route, n);
   if (rc < 0) {
     printf("convert_netlink2route() failed, rc = %d", rc);
+    free(route);
     return -1;
   }
-  list_append((struct route **) arg, route);
+  /* a dump can run to hundreds of routes, don't walk the list for each */
+  route->next = NULL;
+  *list->tail = route;
+  list->tail = &route->next;
 
   return 0;
 }
@@ -755,7 +918,7 @@ int route_append(struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
  * Effects:      No side effects. 
  ***************************************************************/
 
-char    *rtm_type(unsigned char type)
+static char    *rtm_type(unsigned char type)
 {
   switch (type) {
     case RTN_UNSPEC:
@@ -797,7 +960,7 @@ char    *rtm_type(unsigned char type)
  * Effects:      No side effects. 
  ***************************************************************/
 
-char    *rtm_protocol(unsigned char protocol)
+static char    *rtm_protocol(unsigned char protocol)
 {
   switch (protocol) {
     case RTPROT_UNSPEC:
@@ -825,7 +988,7 @@ char    *rtm_protocol(unsigned char protocol)
  * Effects:      No side effects. 
  ***************************************************************/
 
-char    *rtm_table(unsigned char table)
+static char    *rtm_table(unsigned char table)
 {
   switch (table) {
     case RT_TABLE_UNSPEC:
@@ -850,7 +1013,7 @@ char    *rtm_table(unsigned char table)
  * Effects:      No side effects. 
  ***************************************************************/
 
-char    *rtm_scope(unsigned char scope)
+static char    *rtm_scope(unsigned char scope)
 {
   switch (scope) {
     case RT_SCOPE_UNIVERSE:
@@ -878,7 +1041,7 @@ char    *rtm_scope(unsigned char scope)
  * Effects:      No side effects. 
  ***************************************************************/
 
-char    *rta_type(unsigned short type)
+static char    *rta_type(unsigned short type)
 {
   switch (type) {
     case RTA_UNSPEC:
@@ -922,7 +1085,7 @@ char    *rta_type(unsigned short type)
  * Effects:      Pretty-print the route information to stdout. 
  ***************************************************************/
 
-void print_route(struct nlmsghdr *netlink_header)
+static void print_route(struct nlmsghdr *netlink_header)
 {
 
   struct rtmsg *rt = NLMSG_DATA(netlink_header);
@@ -983,7 +1146,7 @@ void print_route(struct nlmsghdr *netlink_header)
  * Effects:      No side effects 
  ***************************************************************/
 
-int addattr32(struct nlmsghdr *n, int maxlen, int type, __u32 data)
+static int addattr32(struct nlmsghdr *n, int maxlen, int type, __u32 data)
 {
   int      len = RTA_LENGTH(4);
   struct rtattr *rta;
@@ -1011,7 +1174,7 @@ int addattr32(struct nlmsghdr *n, int maxlen, int type, __u32 data)
  * Effects:      No side effects 
  ***************************************************************/
 
-int addattr_l(struct nlmsghdr *n, int maxlen, int type, void *data, int alen)
+static int addattr_l(struct nlmsghdr *n, int maxlen, int type, void *data, int alen)
 {
   int      len = RTA_LENGTH(alen);
   struct rtattr *rta;
@@ -51,10 +51,21 @@ struct route
 };
 
 
+/* route_append() collects into this, tail keeps the append O(1) */
+struct route_list
+{
+  struct route *head;
+  struct route **tail;
+};
+
+#define ROUTE_LIST_INIT(l)  { NULL, &(l).head }
+
 struct rtsock *open_route_socket();
 int      read_routes(struct rtsock *s,
   int (*doit) (struct sockaddr_nl *, struct nlmsghdr * n, void *), void *arg);
 int      write_route(struct rtsock *s, struct route *route);
+int      write_address(struct rtsock *s, int cmd, int index,
+  struct in_addr *addr, int prefixlen);
 
 int      filter_static_routes_on_inf(struct route *in_routes,
   struct route **out_routes, int inf_index);
@@ -64,6 +75,10 @@ int      write_static_routes(struct rtsock *s, struct route *routes,
 int      delete_routes(struct route *routes);
 int      read_interfaces(struct rtsock *s,
   int (*doit) (struct sockaddr_nl *, struct nlmsghdr * n, void *), void *arg);
+int      read_addresses(struct rtsock *s,
+  int (*doit) (struct sockaddr_nl *, struct nlmsghdr * n, void *), void *arg);
+int      read_route_to(struct rtsock *s, struct in_addr *dst,
+  int (*doit) (struct sockaddr_nl *, struct nlmsghdr * n, void *), void *arg);
 int      close_route_socket(struct rtsock *s);
 void     list_delete(struct route **list);
 int      parse_rtattr(struct rtattr *tb[], int max, struct rtattr *rta,
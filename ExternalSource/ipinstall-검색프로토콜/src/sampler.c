@@ -0,0 +1,361 @@
+/* sampler.c - System metrics sampled into an mmap'd ring file */
+
+/*
+This replaces log_memory.sh, which forked free, top and ifconfig every ten
+minutes and appended their text to /mnt. Each tick reads /proc/meminfo,
+/proc/stat, /proc/loadavg, /proc/uptime, /proc/net/dev and the stat of
+every process, and writes one fixed-size record into the next slot of a
+file mapped shared, so a tick costs a handful of reads and no process or
+fsync.
+
+The ring lives on tmpfs by default and does not survive a reboot. Keeping
+it on flash is an opt-in through ipinstall.sampler.path: the filesystem
+must allow a writable shared mapping, which JFFS2 does not, and every
+tick dirties a page there, so pair it with a longer interval.
+
+Another process may map the file read-only. A slot is stable when its seq
+reads the same even value before and after the copy; head is stored only
+after the record is complete.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libubox/uloop.h>
+
+#include "sampler.h"
+#include "ipinstall_prof.h"
+
+static smp_hdr_t *smpHdr;
+static smp_rec_t *smpRing;
+static size_t smpSize;
+static char smpPath[64];
+
+static struct uloop_timeout smpTimer;
+static int smpInterval;
+static long smpPageKb;
+
+/* /proc files kept open, read again from offset 0 on every tick */
+static int smpMemFd = -1;
+static int smpStatFd = -1;
+static int smpLoadFd = -1;
+static int smpUptimeFd = -1;
+static int smpNetFd = -1;
+
+static int smp_slurp(int *fd, char *path, char *buf, int size)
+{
+	int len;
+
+	if (*fd < 0 && (*fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+	len = pread(*fd, buf, size - 1, 0);
+	if (len < 0)
+	{
+		close(*fd);
+		*fd = -1;
+		return -1;
+	}
+	buf[len] = 0;
+	return len;
+}
+
+/* Value of a "Key: value" line, 0 if the key is missing. */
+static uint32_t smp_field(char *buf, char *key)
+{
+	size_t klen = strlen(key);
+	char *p;
+
+	for (p = buf; (p = strstr(p, key)) != NULL; p += klen)
+		if (p == buf || p[-1] == '\n')
+			return strtoul(p + klen, NULL, 10);
+	return 0;
+}
+
+static void smp_memory(smp_rec_t *r)
+{
+	char buf[4096];
+
+	if (smp_slurp(&smpMemFd, "/proc/meminfo", buf, sizeof(buf)) < 0)
+		return;
+	r->mem_total = smp_field(buf, "MemTotal:");
+	r->mem_free = smp_field(buf, "MemFree:");
+	r->mem_avail = smp_field(buf, "MemAvailable:");
+	r->buffers = smp_field(buf, "Buffers:");
+	r->cached = smp_field(buf, "Cached:");
+}
+
+static void smp_cpu(smp_rec_t *r)
+{
+	unsigned long long v[8];
+	char buf[4096];
+	unsigned int a, b;
+	int i, n;
+
+	if (smp_slurp(&smpStatFd, "/proc/stat", buf, sizeof(buf)) > 0)
+	{
+		memset(v, 0, sizeof(v));
+		n = sscanf(buf, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+			&v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+		for (i = 0; i < n; i++)
+			r->cpu_total += v[i];
+		r->cpu_idle = v[3] + v[4];
+	}
+	if (smp_slurp(&smpLoadFd, "/proc/loadavg", buf, sizeof(buf)) > 0 &&
+		sscanf(buf, "%u.%u", &a, &b) == 2)
+		r->load1 = a * 100 + b;
+	if (smp_slurp(&smpUptimeFd, "/proc/uptime", buf, sizeof(buf)) > 0)
+		r->uptime = strtoul(buf, NULL, 10);
+}
+
+static void smp_net(smp_rec_t *r)
+{
+	unsigned long long rb, rp, re, rd, tb, tp, te, td;
+	char buf[4096];
+	char *line, *colon, *name;
+
+	if (smp_slurp(&smpNetFd, "/proc/net/dev", buf, sizeof(buf)) < 0)
+		return;
+
+	/* two header lines, then "  name: rx... tx..." */
+	for (line = strchr(buf, '\n'); line && (line = strchr(line + 1, '\n')); )
+	{
+		line++;
+		colon = strchr(line, ':');
+		if (colon == NULL)
+			break;
+		for (name = line; *name == ' '; name++)
+			;
+		if (colon - name == 2 && !strncmp(name, "lo", 2))
+			continue;
+		if (sscanf(colon + 1, "%llu %llu %llu %llu %*u %*u %*u %*u %llu %llu %llu %llu",
+			&rb, &rp, &re, &rd, &tb, &tp, &te, &td) != 8)
+			continue;
+		r->rx_bytes += rb;
+		r->rx_packets += rp;
+		r->rx_errors += re + rd;
+		r->tx_bytes += tb;
+		r->tx_packets += tp;
+		r->tx_errors += te + td;
+	}
+}
+
+static int smp_proc_stat(char *pid, smp_proc_t *p)
+{
+	unsigned long utime, stime;
+	char path[sizeof("/proc//stat") + NAME_MAX];
+	char buf[512];
+	char *s, *e;
+	long rss;
+	int fd, len;
+
+	snprintf(path, sizeof(path), "/proc/%s/stat", pid);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	buf[len] = 0;
+
+	/* the name may hold spaces and parentheses, the last ')' ends it */
+	s = strchr(buf, '(');
+	e = strrchr(buf, ')');
+	if (s == NULL || e == NULL || e < s)
+		return -1;
+	/* state is field 3, utime 14, stime 15, rss 24 */
+	if (sscanf(e + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu "
+		"%*d %*d %*d %*d %*d %*d %*u %*u %ld", &utime, &stime, &rss) != 3)
+		return -1;
+
+	memset(p, 0, sizeof(*p));
+	p->pid = atoi(pid);
+	p->rss = rss * smpPageKb;
+	p->cpu = utime + stime;
+	len = e - s - 1;
+	if (len > (int)sizeof(p->comm) - 1)
+		len = sizeof(p->comm) - 1;
+	memcpy(p->comm, s + 1, len);
+	return 0;
+}
+
+/* Count the processes and keep the SMP_TOP largest, largest first. */
+static void smp_procs(smp_rec_t *r)
+{
+	struct dirent *d;
+	smp_proc_t p;
+	DIR *dir;
+	int i;
+
+	if ((dir = opendir("/proc")) == NULL)
+		return;
+	while ((d = readdir(dir)) != NULL)
+	{
+		if (d->d_name[0] < '1' || d->d_name[0] > '9')
+			continue;
+		if (smp_proc_stat(d->d_name, &p) < 0)
+			continue;
+		r->procs++;
+		if (p.rss <= r->top[SMP_TOP - 1].rss)
+			continue;
+		for (i = SMP_TOP - 1; i > 0 && r->top[i - 1].rss < p.rss; i--)
+			r->top[i] = r->top[i - 1];
+		r->top[i] = p;
+	}
+	closedir(dir);
+}
+
+static void smp_tick(struct uloop_timeout *t)
+{
+	smp_rec_t rec, *r;
+	uint32_t n;
+
+	uloop_timeout_set(t, smpInterval * 1000);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.time = time(NULL);
+	smp_memory(&rec);
+	smp_cpu(&rec);
+	smp_net(&rec);
+	smp_procs(&rec);
+
+	n = smpHdr->head + 1;
+	r = &smpRing[(n - 1) % smpHdr->slots];
+	__atomic_store_n(&r->seq, 2 * n - 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy((char *)r + sizeof(r->seq), (char *)&rec + sizeof(rec.seq), sizeof(rec) - sizeof(rec.seq));
+	__atomic_store_n(&r->seq, 2 * n, __ATOMIC_RELEASE);
+	__atomic_store_n(&smpHdr->head, n, __ATOMIC_RELEASE);
+}
+
+IPI_TIMEOUT_CB(smp_tick_cb, smp_tick, IPINSTALL_LP_SAMPLER)
+
+static void smp_unmap(void)
+{
+	if (smpHdr == NULL)
+		return;
+	munmap(smpHdr, smpSize);
+	smpHdr = NULL;
+	smpRing = NULL;
+	smpPath[0] = 0;
+}
+
+/* Map the ring, keeping what an earlier run left if the layout matches. */
+static int smp_map(char *path, int slots)
+{
+	size_t size = sizeof(smp_hdr_t) + (size_t)slots * sizeof(smp_rec_t);
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || ((size_t)st.st_size != size && ftruncate(fd, size) < 0))
+	{
+		close(fd);
+		return -1;
+	}
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return -1;
+
+	smpHdr = p;
+	smpRing = (smp_rec_t *)(smpHdr + 1);
+	smpSize = size;
+	snprintf(smpPath, sizeof(smpPath), "%s", path);
+
+	if (smpHdr->magic != SMP_MAGIC || smpHdr->version != SMP_VERSION ||
+		smpHdr->rec_size != sizeof(smp_rec_t) || smpHdr->slots != (uint32_t)slots)
+	{
+		memset(p, 0, size);
+		smpHdr->version = SMP_VERSION;
+		smpHdr->rec_size = sizeof(smp_rec_t);
+		smpHdr->slots = slots;
+		__atomic_store_n(&smpHdr->magic, SMP_MAGIC, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+/*
+ * Start sampling every interval seconds into slots records at path, or
+ * apply a new configuration. An interval of 0 stops the sampler and
+ * leaves the file as it is.
+ */
+int sampler_init(char *path, int slots, int interval)
+{
+	if (interval <= 0 || slots <= 0)
+	{
+		sampler_done();
+		return 0;
+	}
+
+	if (smpHdr && (strcmp(smpPath, path) || smpHdr->slots != (uint32_t)slots))
+		smp_unmap();
+	if (smpHdr == NULL && smp_map(path, slots) < 0)
+	{
+		printf("ERROR\n    Failed to map %s\n", path);
+		return -1;
+	}
+	if (smpPageKb == 0)
+		smpPageKb = sysconf(_SC_PAGESIZE) / 1024;
+
+	smpHdr->interval = interval;
+	if (interval != smpInterval || !smpTimer.pending)
+	{
+		smpInterval = interval;
+		smpTimer.cb = smp_tick_cb;
+		uloop_timeout_set(&smpTimer, 0);
+	}
+	return 0;
+}
+
+void sampler_done(void)
+{
+	uloop_timeout_cancel(&smpTimer);
+	smpInterval = 0;
+	smp_unmap();
+}
+
+int sampler_header(smp_hdr_t *hdr)
+{
+	if (smpHdr == NULL)
+		return -1;
+	memcpy(hdr, smpHdr, sizeof(*hdr));
+	return 0;
+}
+
+/*
+ * Copy up to max samples, oldest first, starting at sample from or with
+ * the newest ones when from is 0. A reader pages forward by asking again
+ * from first + count; *first is the number of rec[0].
+ */
+int sampler_read(uint32_t from, smp_rec_t *rec, int max, uint32_t *first)
+{
+	uint32_t head, oldest, n;
+	int count = 0;
+
+	*first = 0;
+	if (smpHdr == NULL || max <= 0)
+		return 0;
+
+	head = smpHdr->head;
+	oldest = head > smpHdr->slots ? head - smpHdr->slots + 1 : 1;
+	if (from == 0 || from > head)
+		from = head > (uint32_t)max ? head - max + 1 : 1;
+	if (from < oldest)
+		from = oldest;
+
+	*first = from;
+	for (n = from; n <= head && count < max; n++)
+		rec[count++] = smpRing[(n - 1) % smpHdr->slots];
+	return count;
+}
@@ -0,0 +1,65 @@
+/* sampler.h - System metrics sampled into an mmap'd ring file */
+
+#ifndef __SAMPLER_H
+#define __SAMPLER_H
+
+#include <stdint.h>
+
+#define SMP_MAGIC       0x4c504d53  /* "SMPL" */
+#define SMP_VERSION     1
+#define SMP_TOP         4           /* processes kept per sample, by resident size */
+
+#define SMP_PATH        "/var/run/metrics.ring"  /* tmpfs, see sampler.c */
+#define SMP_SLOTS       1440        /* a day at SMP_INTERVAL */
+#define SMP_INTERVAL    60          /* seconds */
+
+typedef struct smp_proc {
+	uint32_t    pid;
+	uint32_t    rss;                /* kB */
+	uint32_t    cpu;                /* utime + stime, jiffies, cumulative */
+	char        comm[12];
+} smp_proc_t;
+
+/*
+ * One sample. Counters are cumulative as the kernel reports them and wrap
+ * at 32 bits; a reader takes the difference of two samples.
+ */
+typedef struct smp_rec {
+	uint32_t    seq;                /* 2n-1 while sample n is written, 2n after */
+	uint32_t    time;               /* seconds since the epoch */
+	uint32_t    uptime;             /* seconds */
+	uint32_t    mem_total;          /* kB, /proc/meminfo */
+	uint32_t    mem_free;
+	uint32_t    mem_avail;
+	uint32_t    buffers;
+	uint32_t    cached;
+	uint32_t    cpu_total;          /* jiffies, /proc/stat */
+	uint32_t    cpu_idle;           /* idle + iowait */
+	uint32_t    load1;              /* 1 minute load average * 100 */
+	uint32_t    procs;
+	uint32_t    rx_bytes;           /* every interface but lo, /proc/net/dev */
+	uint32_t    tx_bytes;
+	uint32_t    rx_packets;
+	uint32_t    tx_packets;
+	uint32_t    rx_errors;          /* errs + drop */
+	uint32_t    tx_errors;
+	smp_proc_t  top[SMP_TOP];
+} smp_rec_t;
+
+/* Start of the ring file, the slots follow it. */
+typedef struct smp_hdr {
+	uint32_t    magic;              /* SMP_MAGIC */
+	uint16_t    version;            /* SMP_VERSION */
+	uint16_t    rec_size;           /* sizeof(smp_rec_t) */
+	uint32_t    slots;
+	uint32_t    interval;           /* seconds */
+	uint32_t    head;               /* newest sample, n lives in slot (n - 1) % slots */
+	uint32_t    reserved[3];
+} smp_hdr_t;
+
+int sampler_init(char *path, int slots, int interval);
+void sampler_done(void);
+int sampler_header(smp_hdr_t *hdr);
+int sampler_read(uint32_t from, smp_rec_t *rec, int max, uint32_t *first);
+
+#endif
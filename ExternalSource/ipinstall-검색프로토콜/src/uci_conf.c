@@ -92,6 +92,20 @@ int conf_save(char *name)
     return 0;
 }
 
+/* Write a loaded package back in one go, without a delta file. */
+int conf_commit(char *name)
+{
+    struct uci_package *p;
+
+    p = uci_lookup_package(context, name);
+    if (!p)
+        return -1;
+
+    if (uci_commit(context, &p, false))
+        return -1;
+    return 0;
+}
+
 int conf_init(char *name)
 {
     context = uci_alloc_context();
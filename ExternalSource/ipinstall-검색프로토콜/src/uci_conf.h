@@ -5,6 +5,7 @@ char *conf_get(char *key);
 int conf_set(char *key, char *val);
 int conf_load(char *name);
 int conf_save(char *name);
+int conf_commit(char *name);
 int conf_init(char *name);
 void conf_exit(void);
 